@@ -0,0 +1,388 @@
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+#include "bc1_codec.hpp"
+
+#if defined (__i386__) || defined (__x86_64__) || defined (_M_IX86) || defined (_M_X64)
+  #define BC1_CODEC_X86 1
+  #include <immintrin.h>
+#endif
+
+#if defined (__GNUC__)
+  #define BC1_CODEC_TARGET(x) __attribute__ ((target (x)))
+#else
+  #define BC1_CODEC_TARGET(x)
+#endif
+
+using pyr_down::isa;
+
+namespace bc1_codec
+{
+
+// ----------------------------------------------------------------------------
+// the parts which are the same for all encoders.
+//
+//   channel ranges:   mn, mx of r, g, b over the 16 pixels.
+//   covariances:      sum ((2*r - (mn_r + mx_r)) * (2*g - (mn_g + mx_g))),
+//                     the same for b.  the box center is doubled to stay
+//                     integer.
+//   palette index:    x = clamp (dot (p - e0, e1 - e0) * 3 / |e1 - e0|^2,
+//                     0, 3), rounded as (int)(x + 0.5).  e0 and e1 are the
+//                     end points as the graphics card expands them.
+//
+// the float operations must not be re-associated, or the simd encoder
+// produces different indices.
+
+struct end_points
+{
+  // the end points in r5_g6_b5, c0 > c1 for the 4 color mode.
+  uint16_t c0;
+  uint16_t c1;
+
+  // the expanded end point c0 and the direction to c1.
+  int e0[3];
+  int axis[3];
+
+  // 3 / |axis|^2.  0 if the end points are the same.
+  float scale;
+};
+
+static inline unsigned int to_565 (const int* c)
+{
+  return (unsigned int)((c[0] * 31 + 127) / 255) << 11
+	 | (unsigned int)((c[1] * 63 + 127) / 255) << 5
+	 | (unsigned int)((c[2] * 31 + 127) / 255);
+}
+
+static inline void from_565 (unsigned int c, int* out)
+{
+  const int r = (c >> 11) & 31;
+  const int g = (c >> 5) & 63;
+  const int b = c & 31;
+
+  out[0] = (r << 3) | (r >> 2);
+  out[1] = (g << 2) | (g >> 4);
+  out[2] = (b << 3) | (b >> 2);
+}
+
+static end_points
+make_end_points (const int* mn, const int* mx, int cov_rg, int cov_bg)
+{
+  int lo[3];
+  int hi[3];
+
+  for (unsigned int c = 0; c < 3; ++c)
+  {
+    const int inset = (mx[c] - mn[c]) >> 4;
+    lo[c] = mn[c] + inset;
+    hi[c] = mx[c] - inset;
+  }
+
+  // the colors are on the other diagonal of the box, where red or blue
+  // decrease when green increases.
+  if (cov_rg < 0)
+    std::swap (lo[0], hi[0]);
+  if (cov_bg < 0)
+    std::swap (lo[2], hi[2]);
+
+  unsigned int c0 = to_565 (hi);
+  unsigned int c1 = to_565 (lo);
+
+  if (c0 < c1)
+    std::swap (c0, c1);
+
+  end_points e;
+  e.c0 = (uint16_t)c0;
+  e.c1 = (uint16_t)c1;
+
+  int e1[3];
+  from_565 (c0, e.e0);
+  from_565 (c1, e1);
+
+  int len2 = 0;
+  for (unsigned int c = 0; c < 3; ++c)
+  {
+    e.axis[c] = e1[c] - e.e0[c];
+    len2 += e.axis[c] * e.axis[c];
+  }
+
+  // with c0 == c1 the block is in the 3 color mode, where index 0 is c0.
+  e.scale = len2 > 0 ? 3.0f / (float)len2 : 0.0f;
+  return e;
+}
+
+static inline void
+write_block (uint8_t* dst, const end_points& e, uint32_t indices)
+{
+  dst[0] = (uint8_t)e.c0;
+  dst[1] = (uint8_t)(e.c0 >> 8);
+  dst[2] = (uint8_t)e.c1;
+  dst[3] = (uint8_t)(e.c1 >> 8);
+  dst[4] = (uint8_t)indices;
+  dst[5] = (uint8_t)(indices >> 8);
+  dst[6] = (uint8_t)(indices >> 16);
+  dst[7] = (uint8_t)(indices >> 24);
+}
+
+// ----------------------------------------------------------------------------
+
+static inline unsigned int
+palette_index (const end_points& e, const uint8_t* p)
+{
+  // the positions 0 .. 3 on the line are the palette colors 0, 2, 3, 1.
+  static const unsigned int order[4] = { 0, 2, 3, 1 };
+
+  const int dot = (p[0] - e.e0[0]) * e.axis[0]
+		  + (p[1] - e.e0[1]) * e.axis[1]
+		  + (p[2] - e.e0[2]) * e.axis[2];
+
+  const float x = std::min (std::max ((float)dot * e.scale, 0.0f), 3.0f);
+  return order[(int)(x + 0.5f)];
+}
+
+static void
+encode_scalar (const void* src, unsigned int src_bytes_per_line,
+	       uint8_t* dst, unsigned int width, unsigned int height)
+{
+  for (unsigned int by = 0; by < height; by += block_size)
+    for (unsigned int bx = 0; bx < width; bx += block_size, dst += bytes_per_block)
+    {
+      const uint8_t* rows[block_size];
+      for (unsigned int y = 0; y < block_size; ++y)
+	rows[y] = (const uint8_t*)src + (size_t)(by + y) * src_bytes_per_line + bx * 4;
+
+      int mn[3] = { 255, 255, 255 };
+      int mx[3] = { 0, 0, 0 };
+
+      for (unsigned int y = 0; y < block_size; ++y)
+	for (unsigned int x = 0; x < block_size; ++x)
+	  for (unsigned int c = 0; c < 3; ++c)
+	  {
+	    mn[c] = std::min (mn[c], (int)rows[y][x*4 + c]);
+	    mx[c] = std::max (mx[c], (int)rows[y][x*4 + c]);
+	  }
+
+      int cov_rg = 0;
+      int cov_bg = 0;
+
+      for (unsigned int y = 0; y < block_size; ++y)
+	for (unsigned int x = 0; x < block_size; ++x)
+	{
+	  const uint8_t* p = rows[y] + x*4;
+	  const int g = 2 * p[1] - (mn[1] + mx[1]);
+	  cov_rg += (2 * p[0] - (mn[0] + mx[0])) * g;
+	  cov_bg += (2 * p[2] - (mn[2] + mx[2])) * g;
+	}
+
+      const end_points e = make_end_points (mn, mx, cov_rg, cov_bg);
+
+      uint32_t indices = 0;
+      for (unsigned int y = 0; y < block_size; ++y)
+	for (unsigned int x = 0; x < block_size; ++x)
+	  indices |= palette_index (e, rows[y] + x*4) << ((y * block_size + x) * 2);
+
+      write_block (dst, e, indices);
+    }
+}
+
+// ----------------------------------------------------------------------------
+
+#ifdef BC1_CODEC_X86
+
+// a block is 4 registers of 4 pixels.  the channels are processed as 16 bit
+// values, 2 pixels per register, and combined with pmaddwd.
+
+BC1_CODEC_TARGET ("sse2") static void
+encode_sse2 (const void* src, unsigned int src_bytes_per_line,
+	     uint8_t* dst, unsigned int width, unsigned int height)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+
+  // the green channel in the lanes of red and blue.
+  const __m128i g_mask = _mm_set_epi16 (0, -1, 0, -1, 0, -1, 0, -1);
+
+  const __m128 zero_ps = _mm_setzero_ps ();
+  const __m128 three_ps = _mm_set1_ps (3.0f);
+  const __m128 half_ps = _mm_set1_ps (0.5f);
+
+  const __m128i one8 = _mm_set1_epi8 (1);
+  const __m128i three8 = _mm_set1_epi8 (3);
+
+  for (unsigned int by = 0; by < height; by += block_size)
+    for (unsigned int bx = 0; bx < width; bx += block_size, dst += bytes_per_block)
+    {
+      __m128i p[block_size];
+      for (unsigned int y = 0; y < block_size; ++y)
+	p[y] = _mm_loadu_si128 ((const __m128i*)((const uint8_t*)src
+						  + (size_t)(by + y) * src_bytes_per_line
+						  + bx * 4));
+
+      // the channel ranges in all pixels.
+      __m128i mn = _mm_min_epu8 (_mm_min_epu8 (p[0], p[1]), _mm_min_epu8 (p[2], p[3]));
+      __m128i mx = _mm_max_epu8 (_mm_max_epu8 (p[0], p[1]), _mm_max_epu8 (p[2], p[3]));
+
+      mn = _mm_min_epu8 (mn, _mm_shuffle_epi32 (mn, _MM_SHUFFLE (1, 0, 3, 2)));
+      mn = _mm_min_epu8 (mn, _mm_shuffle_epi32 (mn, _MM_SHUFFLE (2, 3, 0, 1)));
+      mx = _mm_max_epu8 (mx, _mm_shuffle_epi32 (mx, _MM_SHUFFLE (1, 0, 3, 2)));
+      mx = _mm_max_epu8 (mx, _mm_shuffle_epi32 (mx, _MM_SHUFFLE (2, 3, 0, 1)));
+
+      const uint32_t mn32 = (uint32_t)_mm_cvtsi128_si32 (mn);
+      const uint32_t mx32 = (uint32_t)_mm_cvtsi128_si32 (mx);
+
+      const int mnc[3] = { (int)(mn32 & 255), (int)((mn32 >> 8) & 255), (int)((mn32 >> 16) & 255) };
+      const int mxc[3] = { (int)(mx32 & 255), (int)((mx32 >> 8) & 255), (int)((mx32 >> 16) & 255) };
+
+      // the covariances.  the doubled and centered channels times green
+      // give r*g and b*g in the 32 bit lanes of each pixel.
+      const __m128i center = _mm_set_epi16 (0, (short)(mnc[2] + mxc[2]), (short)(mnc[1] + mxc[1]),
+					    (short)(mnc[0] + mxc[0]),
+					    0, (short)(mnc[2] + mxc[2]), (short)(mnc[1] + mxc[1]),
+					    (short)(mnc[0] + mxc[0]));
+      __m128i acc = zero;
+
+      for (unsigned int y = 0; y < block_size; ++y)
+	for (unsigned int h = 0; h < 2; ++h)
+	{
+	  __m128i q = h == 0 ? _mm_unpacklo_epi8 (p[y], zero) : _mm_unpackhi_epi8 (p[y], zero);
+	  q = _mm_sub_epi16 (_mm_add_epi16 (q, q), center);
+
+	  __m128i g = _mm_shufflelo_epi16 (q, _MM_SHUFFLE (1, 1, 1, 1));
+	  g = _mm_shufflehi_epi16 (g, _MM_SHUFFLE (1, 1, 1, 1));
+
+	  acc = _mm_add_epi32 (acc, _mm_madd_epi16 (q, _mm_and_si128 (g, g_mask)));
+	}
+
+      acc = _mm_add_epi32 (acc, _mm_shuffle_epi32 (acc, _MM_SHUFFLE (1, 0, 3, 2)));
+
+      const int cov_rg = _mm_cvtsi128_si32 (acc);
+      const int cov_bg = _mm_cvtsi128_si32 (_mm_shuffle_epi32 (acc, _MM_SHUFFLE (1, 1, 1, 1)));
+
+      const end_points e = make_end_points (mnc, mxc, cov_rg, cov_bg);
+
+      // the positions of the pixels on the line.
+      const __m128i e0 = _mm_set_epi16 (0, (short)e.e0[2], (short)e.e0[1], (short)e.e0[0],
+					0, (short)e.e0[2], (short)e.e0[1], (short)e.e0[0]);
+      const __m128i axis = _mm_set_epi16 (0, (short)e.axis[2], (short)e.axis[1], (short)e.axis[0],
+					  0, (short)e.axis[2], (short)e.axis[1], (short)e.axis[0]);
+      const __m128 scale = _mm_set1_ps (e.scale);
+
+      __m128i l[block_size];
+
+      for (unsigned int y = 0; y < block_size; ++y)
+      {
+	// r*ar + g*ag and b*ab of pixels 0, 1 and 2, 3.
+	const __m128i lo = _mm_madd_epi16 (_mm_sub_epi16 (_mm_unpacklo_epi8 (p[y], zero), e0), axis);
+	const __m128i hi = _mm_madd_epi16 (_mm_sub_epi16 (_mm_unpackhi_epi8 (p[y], zero), e0), axis);
+
+	const __m128i even = _mm_castps_si128 (_mm_shuffle_ps (_mm_castsi128_ps (lo), _mm_castsi128_ps (hi),
+							       _MM_SHUFFLE (2, 0, 2, 0)));
+	const __m128i odd = _mm_castps_si128 (_mm_shuffle_ps (_mm_castsi128_ps (lo), _mm_castsi128_ps (hi),
+							      _MM_SHUFFLE (3, 1, 3, 1)));
+	const __m128i dot = _mm_add_epi32 (even, odd);
+
+	__m128 x = _mm_mul_ps (_mm_cvtepi32_ps (dot), scale);
+	x = _mm_min_ps (_mm_max_ps (x, zero_ps), three_ps);
+	l[y] = _mm_cvttps_epi32 (_mm_add_ps (x, half_ps));
+      }
+
+      // the positions as bytes in pixel order, mapped to the palette order
+      // 0, 2, 3, 1.
+      const __m128i l8 = _mm_packus_epi16 (_mm_packs_epi32 (l[0], l[1]), _mm_packs_epi32 (l[2], l[3]));
+
+      __m128i idx = _mm_add_epi8 (l8, one8);
+      idx = _mm_add_epi8 (idx, _mm_cmpeq_epi8 (l8, zero));
+      idx = _mm_sub_epi8 (idx, _mm_and_si128 (_mm_cmpeq_epi8 (l8, three8), three8));
+
+      // pack the 2 bit indices of 2, 4 and 8 pixels.
+      idx = _mm_and_si128 (_mm_or_si128 (idx, _mm_srli_epi16 (idx, 6)), _mm_set1_epi16 (0x000f));
+      idx = _mm_and_si128 (_mm_or_si128 (idx, _mm_srli_epi32 (idx, 12)), _mm_set1_epi32 (0x00ff));
+      idx = _mm_and_si128 (_mm_or_si128 (idx, _mm_srli_epi64 (idx, 24)), _mm_set1_epi64x (0xffff));
+
+      const uint32_t indices = (uint32_t)_mm_cvtsi128_si32 (idx)
+			       | (uint32_t)_mm_cvtsi128_si32 (_mm_srli_si128 (idx, 8)) << 16;
+
+      write_block (dst, e, indices);
+    }
+}
+
+#endif // BC1_CODEC_X86
+
+// ----------------------------------------------------------------------------
+
+size_t encoded_size (const utils::vec2<unsigned int>& size)
+{
+  return (size_t)(size.x / block_size) * (size.y / block_size) * bytes_per_block;
+}
+
+encoder find_encoder (isa i)
+{
+  if (i > pyr_down::best_isa ())
+    return nullptr;
+
+  switch (i)
+  {
+    case isa::scalar: return encode_scalar;
+#ifdef BC1_CODEC_X86
+    // there is nothing to gain from avx2 for single blocks.
+    case isa::sse2: return encode_sse2;
+    case isa::avx2: return encode_sse2;
+#endif
+    default: return nullptr;
+  }
+}
+
+void encode (const void* pixels, unsigned int bytes_per_line,
+	     const utils::vec2<unsigned int>& size, uint8_t* out)
+{
+  if (size.x % block_size != 0 || size.y % block_size != 0)
+    throw std::invalid_argument ("bc1_codec: the size is not a multiple of the block size");
+
+  static const encoder e = find_encoder ();
+  (e != nullptr ? e : encode_scalar) (pixels, bytes_per_line, out, size.x, size.y);
+}
+
+void decode (const uint8_t* data, void* pixels, unsigned int bytes_per_line,
+	     const utils::vec2<unsigned int>& size)
+{
+  for (unsigned int by = 0; by < size.y; by += block_size)
+    for (unsigned int bx = 0; bx < size.x; bx += block_size, data += bytes_per_block)
+    {
+      const unsigned int c0 = data[0] | (data[1] << 8);
+      const unsigned int c1 = data[2] | (data[3] << 8);
+      const uint32_t indices = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+
+      int palette[4][3];
+      from_565 (c0, palette[0]);
+      from_565 (c1, palette[1]);
+
+      for (unsigned int c = 0; c < 3; ++c)
+	if (c0 > c1)
+	{
+	  palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+	  palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+	}
+	else
+	{
+	  // the 3 color mode.  the 4th color is transparent black.
+	  palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+	  palette[3][c] = 0;
+	}
+
+      for (unsigned int y = 0; y < block_size; ++y)
+      {
+	uint8_t* row = (uint8_t*)pixels + (size_t)(by + y) * bytes_per_line + bx * 4;
+
+	for (unsigned int x = 0; x < block_size; ++x)
+	{
+	  const unsigned int i = (indices >> ((y * block_size + x) * 2)) & 3;
+	  row[x*4 + 0] = (uint8_t)palette[i][0];
+	  row[x*4 + 1] = (uint8_t)palette[i][1];
+	  row[x*4 + 2] = (uint8_t)palette[i][2];
+	  row[x*4 + 3] = 255;
+	}
+      }
+    }
+}
+
+} // namespace bc1_codec
@@ -0,0 +1,57 @@
+#ifndef includeguard_bc1_codec_hpp_includeguard
+#define includeguard_bc1_codec_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+
+#include "utils/vec_mat.hpp"
+#include "pyr_down.hpp"
+
+// bc1 (dxt1) block compression of rgba8 color texture tiles, which are
+// uploaded to the graphics card in compressed form.  each block of 4x4
+// pixels is stored in 8 bytes, i.e. 1/8 of rgba8.  alpha is not stored, the
+// blocks are always opaque.
+//
+// the encoder is a fast one for encoding tiles while rendering.  the end
+// points of a block are the corners of the bounding box of its colors,
+// inset by 1/16 of the range.  the diagonal of the box is chosen by the
+// signs of the covariances of red and blue with green.  each pixel gets the
+// palette color which is nearest to its projection onto the line between
+// the end points.
+//
+// like the pyramid kernels, there is a scalar and a simd version of the
+// encoder, which produce exactly the same blocks.
+
+namespace bc1_codec
+{
+
+static constexpr unsigned int block_size = 4;
+static constexpr unsigned int bytes_per_block = 8;
+
+// the bytes of the blocks of an image.  the width and height must be
+// multiples of 'block_size'.
+size_t encoded_size (const utils::vec2<unsigned int>& size);
+
+// an encoder converts 'width' x 'height' rgba8 pixels into blocks, which
+// are stored row by row without gaps.  the width and height are multiples of
+// 'block_size'.
+typedef void (*encoder) (const void* src, unsigned int src_bytes_per_line,
+			 uint8_t* dst, unsigned int width, unsigned int height);
+
+// returns nullptr if the instruction set is not supported by the cpu.
+encoder find_encoder (pyr_down::isa i = pyr_down::best_isa ());
+
+// encode rgba8 pixels with the best available encoder.  'out' must have
+// 'encoded_size (size)' bytes.  throws std::invalid_argument if the size is
+// not a multiple of 'block_size'.
+void encode (const void* pixels, unsigned int bytes_per_line,
+	     const utils::vec2<unsigned int>& size, uint8_t* out);
+
+// decode the blocks into rgba8 pixels with an alpha of 255, like the
+// graphics card does it.  for measuring the quality of the encoder.
+void decode (const uint8_t* data, void* pixels, unsigned int bytes_per_line,
+	     const utils::vec2<unsigned int>& size);
+
+} // namespace bc1_codec
+
+#endif // includeguard_bc1_codec_hpp_includeguard
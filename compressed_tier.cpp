@@ -0,0 +1,175 @@
+
+#include <chrono>
+#include <stdexcept>
+
+#include "compressed_tier.hpp"
+#include "tile_codec.hpp"
+#include "mapped_arena.hpp"
+
+using utils::vec2;
+using img::pixel_format;
+
+compressed_tier::stats&
+compressed_tier::stats::operator += (const stats& rhs)
+{
+  num_tiles += rhs.num_tiles;
+  num_resident += rhs.num_resident;
+  num_compressed += rhs.num_compressed;
+  resident_bytes += rhs.resident_bytes;
+  compressed_raw_bytes += rhs.compressed_raw_bytes;
+  compressed_bytes += rhs.compressed_bytes;
+  num_encoded += rhs.num_encoded;
+  num_decoded += rhs.num_decoded;
+  encode_seconds += rhs.encode_seconds;
+  decode_seconds += rhs.decode_seconds;
+  return *this;
+}
+
+// ----------------------------------------------------------------------------
+
+compressed_tier::compressed_tier (size_t resident_budget)
+: m_resident_budget (resident_budget)
+{
+}
+
+unsigned int
+compressed_tier::add_tile (void* pixels, unsigned int bytes_per_line,
+			   const vec2<unsigned int>& size, pixel_format pf,
+			   mapped_arena* arena)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  tile t;
+  t.pixels = (uint8_t*)pixels;
+  t.arena = arena;
+  t.size = size;
+  t.bytes_per_line = bytes_per_line;
+  t.format = pf;
+
+  m_tiles.push_back (std::move (t));
+  m_stats.num_tiles = m_tiles.size ();
+
+  return (unsigned int)(m_tiles.size () - 1);
+}
+
+compressed_tier::stats compressed_tier::get_stats (void) const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_stats;
+}
+
+void compressed_tier::make_resident (unsigned int id)
+{
+  auto& t = m_tiles[id];
+
+  if (!t.data.empty ())
+  {
+    if (t.arena != nullptr)
+      t.arena->touch (t.pixels, tile_bytes (t));
+
+    auto t0 = std::chrono::steady_clock::now ();
+
+    if (!tile_codec::decode (t.data.data (), t.data.size (),
+			     t.pixels, t.bytes_per_line, t.size, t.format))
+      throw std::runtime_error ("compressed_tier: corrupt tile data");
+
+    auto t1 = std::chrono::steady_clock::now ();
+
+    m_stats.num_decoded += 1;
+    m_stats.decode_seconds += std::chrono::duration<double> (t1 - t0).count ();
+    m_stats.num_compressed -= 1;
+    m_stats.compressed_raw_bytes -= t.raw_bytes;
+    m_stats.compressed_bytes -= t.data.size ();
+
+    std::vector<uint8_t> ().swap (t.data);
+  }
+
+  t.resident_index = (unsigned int)m_resident.size ();
+  m_resident.push_back (id);
+
+  m_stats.num_resident += 1;
+  m_stats.resident_bytes += tile_bytes (t);
+}
+
+bool compressed_tier::compress (unsigned int id)
+{
+  auto& t = m_tiles[id];
+  const size_t raw_bytes = tile_bytes (t);
+
+  std::vector<uint8_t> data;
+
+  auto t0 = std::chrono::steady_clock::now ();
+  tile_codec::encode (t.pixels, t.bytes_per_line, t.size, t.format, data);
+  auto t1 = std::chrono::steady_clock::now ();
+
+  m_stats.num_encoded += 1;
+  m_stats.encode_seconds += std::chrono::duration<double> (t1 - t0).count ();
+
+  // not worth it.  keep the tile as it is.
+  if (data.size () > raw_bytes / 8 * 7)
+    return false;
+
+  data.shrink_to_fit ();
+  t.data = std::move (data);
+  t.raw_bytes = raw_bytes;
+
+  // the memory is not needed anymore.  it's restored when the tile is
+  // touched again.
+  if (t.arena != nullptr)
+    t.arena->discard (t.pixels, raw_bytes);
+
+  const unsigned int i = t.resident_index;
+  m_resident[i] = m_resident.back ();
+  m_tiles[m_resident[i]].resident_index = i;
+  m_resident.pop_back ();
+  t.resident_index = invalid_id;
+
+  m_stats.num_resident -= 1;
+  m_stats.resident_bytes -= raw_bytes;
+  m_stats.num_compressed += 1;
+  m_stats.compressed_raw_bytes += raw_bytes;
+  m_stats.compressed_bytes += t.data.size ();
+
+  return true;
+}
+
+void compressed_tier::touch (unsigned int id)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto& t = m_tiles[id];
+
+  m_touch_count += 1;
+  t.last_touch = m_touch_count;
+  t.referenced = true;
+  t.incompressible = false;
+
+  if (t.resident_index == invalid_id)
+    make_resident (id);
+
+  // compress the tiles which haven't been touched since the clock hand
+  // passed them the last time.  give up after two rounds, if the remaining
+  // tiles are in use or don't compress.
+  size_t steps = m_resident.size () * 2;
+
+  while (m_stats.resident_bytes > m_resident_budget && steps-- > 0)
+  {
+    if (m_clock_hand >= m_resident.size ())
+      m_clock_hand = 0;
+
+    auto& v = m_tiles[m_resident[m_clock_hand]];
+
+    if (v.referenced || v.incompressible
+	|| m_touch_count - v.last_touch < pinned_recent)
+    {
+      v.referenced = false;
+      m_clock_hand += 1;
+    }
+    else if (!compress (m_resident[m_clock_hand]))
+    {
+      // don't try again until the tile has been touched again.
+      v.incompressible = true;
+      m_clock_hand += 1;
+    }
+  }
+}
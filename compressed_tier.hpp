@@ -0,0 +1,118 @@
+#ifndef includeguard_compressed_tier_hpp_includeguard
+#define includeguard_compressed_tier_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+
+#include "utils/vec_mat.hpp"
+#include "img/image.hpp"
+
+class mapped_arena;
+
+// keeps the tiles (bricks) of the cpu images which haven't been accessed
+// recently in compressed form.
+//
+// the tiles are registered once with their pixel memory in a mapped_arena.
+// users of the tiles have to announce accesses with 'touch', like for the
+// arena.  a touched tile is decompressed into its memory if necessary.  if
+// the uncompressed tiles take up more than 'resident_budget' bytes, the
+// least recently used tiles are compressed with tile_codec and their memory
+// is released back to the arena.
+//
+// tiles which don't compress well are left uncompressed, so the budget is
+// not a hard limit.
+//
+// a tile must not be compressed while it's being used.  the most recently
+// touched tiles are never compressed, which is enough for one thread.  if
+// multiple threads use tiles at the same time, they need separate tiers.
+
+class compressed_tier
+{
+public:
+  // tile ids
+  static constexpr unsigned int invalid_id = ~0u;
+
+  // the most recently touched tiles are never compressed, so that the
+  // tiles a caller is working on stay valid.
+  static constexpr unsigned int pinned_recent = 16;
+
+  struct stats
+  {
+    size_t num_tiles = 0;
+    size_t num_resident = 0;
+    size_t num_compressed = 0;
+
+    // bytes of the uncompressed tiles.
+    size_t resident_bytes = 0;
+
+    // bytes of the compressed tiles before and after compression.
+    size_t compressed_raw_bytes = 0;
+    size_t compressed_bytes = 0;
+
+    uint64_t num_encoded = 0;
+    uint64_t num_decoded = 0;
+    double encode_seconds = 0;
+    double decode_seconds = 0;
+
+    stats& operator += (const stats& rhs);
+  };
+
+  explicit compressed_tier (size_t resident_budget);
+
+  compressed_tier (const compressed_tier&) = delete;
+  compressed_tier& operator = (const compressed_tier&) = delete;
+
+  size_t resident_budget (void) const { return m_resident_budget; }
+
+  // register a tile.  the memory is not accessed until the tile is touched
+  // the first time.
+  unsigned int add_tile (void* pixels, unsigned int bytes_per_line,
+			 const utils::vec2<unsigned int>& size, img::pixel_format pf,
+			 mapped_arena* arena);
+
+  // announce an access to the tile.  might compress other tiles.
+  void touch (unsigned int id);
+
+  stats get_stats (void) const;
+
+private:
+  struct tile
+  {
+    uint8_t* pixels;
+    mapped_arena* arena;
+    utils::vec2<unsigned int> size;
+    unsigned int bytes_per_line;
+    img::pixel_format format;
+
+    // position in m_resident or invalid_id.
+    unsigned int resident_index = invalid_id;
+    bool referenced = false;
+    bool incompressible = false;
+    uint64_t last_touch = 0;
+
+    // the compressed data if the tile is compressed.
+    std::vector<uint8_t> data;
+    size_t raw_bytes = 0;
+  };
+
+  size_t m_resident_budget;
+
+  mutable std::mutex m_mutex;
+  std::vector<tile> m_tiles;
+
+  // clock (second chance) replacement of the uncompressed tiles.
+  std::vector<unsigned int> m_resident;
+  size_t m_clock_hand = 0;
+  uint64_t m_touch_count = 0;
+
+  stats m_stats;
+
+  size_t tile_bytes (const tile& t) const { return (size_t)t.bytes_per_line * t.size.y; }
+
+  void make_resident (unsigned int id);
+  bool compress (unsigned int id);
+};
+
+#endif // includeguard_compressed_tier_hpp_includeguard
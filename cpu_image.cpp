@@ -0,0 +1,576 @@
+
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <stdexcept>
+#include <limits>
+
+#include "cpu_image.hpp"
+#include "mapped_arena.hpp"
+#include "compressed_tier.hpp"
+#include "pyr_down.hpp"
+
+using utils::vec2;
+using utils::vec4;
+
+using img::image;
+using img::pixel_format;
+
+// ----------------------------------------------------------------------------
+
+static unsigned int bytes_per_pixel (pixel_format pf)
+{
+  switch (pf)
+  {
+    case pixel_format::r8:
+    case pixel_format::r8ui:
+      return 1;
+
+    case pixel_format::r16:
+    case pixel_format::r16ui:
+    case pixel_format::r5_g6_b5:
+      return 2;
+
+    case pixel_format::rgb8:
+    case pixel_format::bgr8:
+      return 3;
+
+    case pixel_format::rgba8:
+    case pixel_format::r32f:
+      return 4;
+
+    case pixel_format::rgba32f:
+      return 16;
+
+    default:
+      throw std::invalid_argument ("cpu_image: unsupported pixel format");
+  }
+}
+
+template <typename T> static void
+min_max (const image& img, const vec2<unsigned int>& xy, const vec2<unsigned int>& size,
+	 vec2<float>& r)
+{
+  for (unsigned int y = 0; y < size.y; ++y)
+  {
+    const T* row = (const T*)((const char*)img.data () + (size_t)(xy.y + y) * img.bytes_per_line ())
+		   + xy.x;
+
+    T lo = row[0];
+    T hi = row[0];
+
+    for (unsigned int x = 1; x < size.x; ++x)
+    {
+      lo = std::min (lo, row[x]);
+      hi = std::max (hi, row[x]);
+    }
+
+    r.x = std::min (r.x, (float)lo);
+    r.y = std::max (r.y, (float)hi);
+  }
+}
+
+static void
+min_max (const image& img, const vec2<unsigned int>& xy, const vec2<unsigned int>& size,
+	 vec2<float>& r)
+{
+  switch (img.format ())
+  {
+    case pixel_format::r8:
+    case pixel_format::r8ui:
+      return min_max<uint8_t> (img, xy, size, r);
+
+    case pixel_format::r16:
+    case pixel_format::r16ui:
+      return min_max<uint16_t> (img, xy, size, r);
+
+    case pixel_format::r32f:
+      return min_max<float> (img, xy, size, r);
+
+    default:
+      throw std::invalid_argument ("cpu_image: min_max needs a single channel format");
+  }
+}
+
+// true if all pixels of the area are the same as 'value'.
+static bool
+constant (const image& img, unsigned int bpp, const vec2<unsigned int>& xy,
+	  const vec2<unsigned int>& size, const void* value)
+{
+  const char* first_row = (const char*)img.data () + (size_t)xy.y * img.bytes_per_line ()
+			  + xy.x * bpp;
+
+  for (unsigned int x = 0; x < size.x; ++x)
+    if (std::memcmp (first_row + x * bpp, value, bpp) != 0)
+      return false;
+
+  // the other rows must be the same as the first one.
+  for (unsigned int y = 1; y < size.y; ++y)
+    if (std::memcmp (first_row + (size_t)y * img.bytes_per_line (), first_row,
+		     size.x * bpp) != 0)
+      return false;
+
+  return true;
+}
+
+// interleave the bits of x and y.
+static uint64_t morton_code (uint32_t x, uint32_t y)
+{
+  auto spread = [] (uint64_t v)
+  {
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+    v = (v | (v << 8))  & 0x00FF00FF00FF00FFull;
+    v = (v | (v << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    v = (v | (v << 2))  & 0x3333333333333333ull;
+    v = (v | (v << 1))  & 0x5555555555555555ull;
+    return v;
+  };
+
+  return spread (x) | (spread (y) << 1);
+}
+
+// replicate the edge pixels of the area (tl, br) of a block of
+// brick_size x brick_size pixels into the rest of the block.
+static void
+replicate_edges (image& blk, unsigned int bpp,
+		 const vec2<unsigned int>& tl, const vec2<unsigned int>& br)
+{
+  const unsigned int bs = cpu_image::brick_size;
+  const unsigned int bpl = blk.bytes_per_line ();
+  char* data = (char*)blk.data ();
+
+  for (unsigned int y = tl.y; y < br.y; ++y)
+  {
+    char* row = data + y * bpl;
+
+    for (unsigned int x = 0; x < tl.x; ++x)
+      std::memcpy (row + x * bpp, row + tl.x * bpp, bpp);
+
+    for (unsigned int x = br.x; x < bs; ++x)
+      std::memcpy (row + x * bpp, row + (br.x - 1) * bpp, bpp);
+  }
+
+  for (unsigned int y = 0; y < tl.y; ++y)
+    std::memcpy (data + y * bpl, data + tl.y * bpl, bs * bpp);
+
+  for (unsigned int y = br.y; y < bs; ++y)
+    std::memcpy (data + y * bpl, data + (br.y - 1) * bpl, bs * bpp);
+}
+
+// ----------------------------------------------------------------------------
+
+cpu_image::storage_image::storage_image (pixel_format pf, const vec2<unsigned int>& size,
+					 unsigned int bytes_per_pixel, mapped_arena* arena)
+{
+  if (arena == nullptr)
+  {
+    static_cast<image&> (*this) = image (pf, size);
+    return;
+  }
+
+  // same as in tiled_image::update.
+  m_size = size;
+  m_bytes_per_line = size.x * bytes_per_pixel;
+  m_format = pf;
+  m_data.ptr = (char*)arena->allocate ((size_t)m_bytes_per_line * size.y);
+}
+
+// ----------------------------------------------------------------------------
+
+pixel_format cpu_image::default_texture_format (pixel_format pf)
+{
+  if (pf == pixel_format::r16ui)
+    return pixel_format::r16;
+
+  return pf;
+}
+
+size_t cpu_image::storage_size (pixel_format pf, const vec2<unsigned int>& size, layout l)
+{
+  if (l == layout::linear)
+    return (size_t)size.x * size.y * ::bytes_per_pixel (pf);
+
+  auto&& n = (size + (brick_core_size - 1)) / brick_core_size;
+  return (size_t)n.x * n.y * brick_size * brick_size * ::bytes_per_pixel (pf);
+}
+
+cpu_image::cpu_image (pixel_format pf, const vec2<unsigned int>& size,
+		      pixel_format texture_format, layout l, mapped_arena* arena,
+		      compressed_tier* tier)
+: m_size (size), m_texture_format (texture_format), m_layout (l),
+  m_arena (arena), m_bytes_per_pixel (::bytes_per_pixel (pf))
+{
+  if (l == layout::linear)
+  {
+    m_data = storage_image (pf, size, m_bytes_per_pixel, arena);
+    return;
+  }
+
+  m_num_bricks = num_tiles ();
+
+  const unsigned int count = m_num_bricks.x * m_num_bricks.y;
+
+  m_data = storage_image (pf, { brick_size, brick_size * count }, m_bytes_per_pixel, arena);
+
+  // the bricks are stored in z-order, which is compacted to the actually
+  // existing bricks.
+  std::vector<std::pair<uint64_t, unsigned int>> order;
+  order.reserve (count);
+
+  for (unsigned int y = 0; y < m_num_bricks.y; ++y)
+    for (unsigned int x = 0; x < m_num_bricks.x; ++x)
+      order.emplace_back (morton_code (x, y), x + y * m_num_bricks.x);
+
+  std::sort (order.begin (), order.end ());
+
+  m_brick_slot.resize (count);
+  for (unsigned int i = 0; i < count; ++i)
+    m_brick_slot[order[i].second] = i;
+
+  m_brick_stale.assign (count, true);
+
+  if (tier != nullptr && arena != nullptr)
+  {
+    m_tier = tier;
+    m_brick_tier_id.resize (count);
+
+    for (unsigned int i = 0; i < count; ++i)
+    {
+      auto&& s = brick_storage ({ i % m_num_bricks.x, i / m_num_bricks.x });
+      m_brick_tier_id[i] = tier->add_tile (s.data (), s.bytes_per_line (), s.size (),
+					   pf, arena);
+    }
+  }
+}
+
+vec2<unsigned int> cpu_image::num_tiles (void) const
+{
+  return (m_size + (brick_core_size - 1)) / brick_core_size;
+}
+
+image cpu_image::brick_storage (const vec2<unsigned int>& b) const
+{
+  const unsigned int slot = m_brick_slot[b.x + b.y * m_num_bricks.x];
+  return m_data.subimg ({ 0, (int)(slot * brick_size) }, { brick_size });
+}
+
+void cpu_image::touch_brick (const vec2<unsigned int>& b) const
+{
+  if (m_arena == nullptr)
+    return;
+
+  const unsigned int i = b.x + b.y * m_num_bricks.x;
+  const size_t slot = m_brick_slot[i];
+  const size_t brick_bytes = (size_t)brick_size * m_data.bytes_per_line ();
+
+  m_arena->touch ((const char*)m_data.data () + slot * brick_bytes, brick_bytes);
+
+  if (m_tier != nullptr)
+    m_tier->touch (m_brick_tier_id[i]);
+}
+
+void cpu_image::touch (const vec2<unsigned int>& tl, const vec2<unsigned int>& br) const
+{
+  auto&& area_br = std::min (br, m_size);
+
+  if (m_arena == nullptr || tl.x >= area_br.x || tl.y >= area_br.y)
+    return;
+
+  if (m_layout == layout::linear)
+  {
+    m_arena->touch ((const char*)m_data.data () + (size_t)tl.y * m_data.bytes_per_line (),
+		    (size_t)(area_br.y - tl.y) * m_data.bytes_per_line ());
+    return;
+  }
+
+  auto&& b0 = tl / brick_core_size;
+  auto&& b1 = (area_br + (brick_core_size - 1)) / brick_core_size;
+
+  for (unsigned int y = b0.y; y < b1.y; ++y)
+    for (unsigned int x = b0.x; x < b1.x; ++x)
+      touch_brick ({ x, y });
+}
+
+template <typename Func> void
+cpu_image::for_each_brick (const vec2<unsigned int>& tl, const vec2<unsigned int>& br,
+			   Func&& f) const
+{
+  auto&& area_br = std::min (br, m_size);
+
+  if (tl.x >= area_br.x || tl.y >= area_br.y)
+    return;
+
+  auto&& b0 = tl / brick_core_size;
+  auto&& b1 = (area_br + (brick_core_size - 1)) / brick_core_size;
+
+  for (unsigned int y = b0.y; y < b1.y; ++y)
+    for (unsigned int x = b0.x; x < b1.x; ++x)
+    {
+      vec2<unsigned int> b (x, y);
+      auto&& core_tl = b * brick_core_size;
+
+      f (b, std::max (tl, core_tl), std::min (area_br, core_tl + brick_core_size));
+    }
+}
+
+void cpu_image::mark_stale (const vec2<unsigned int>& tl, const vec2<unsigned int>& br)
+{
+  // all bricks whose border overlaps the area.
+  auto&& b0 = vec2<unsigned int> (std::max (tl, vec2<unsigned int> (brick_border)) - brick_border)
+	      / brick_core_size;
+  auto&& b1 = std::min ((br + brick_border + (brick_core_size - 1)) / brick_core_size,
+			m_num_bricks);
+
+  for (unsigned int y = b0.y; y < b1.y; ++y)
+    for (unsigned int x = b0.x; x < b1.x; ++x)
+      m_brick_stale[x + y * m_num_bricks.x] = true;
+}
+
+void cpu_image::update_border (const vec2<unsigned int>& b)
+{
+  touch_brick (b);
+  auto&& dst = brick_storage (b);
+
+  // the brick origin in image coordinates and the part of the brick which
+  // is inside the image.
+  const vec2<int> org = vec2<int> (b * brick_core_size) - (int)brick_border;
+  const auto in_tl = vec2<unsigned int> (std::max (org, vec2<int> (0)));
+  const auto in_br = vec2<unsigned int> (std::min (org + (int)brick_size, vec2<int> (m_size)));
+
+  for (int ny = (int)b.y - 1; ny <= (int)b.y + 1; ++ny)
+    for (int nx = (int)b.x - 1; nx <= (int)b.x + 1; ++nx)
+    {
+      if (nx < 0 || ny < 0 || nx >= (int)m_num_bricks.x || ny >= (int)m_num_bricks.y
+	  || (nx == (int)b.x && ny == (int)b.y))
+	continue;
+
+      const vec2<unsigned int> n (nx, ny);
+      auto&& core_tl = n * brick_core_size;
+
+      auto&& a_tl = std::max (in_tl, core_tl);
+      auto&& a_br = std::min (in_br, core_tl + brick_core_size);
+
+      if (a_tl.x >= a_br.x || a_tl.y >= a_br.y)
+	continue;
+
+      touch_brick (n);
+      auto&& src = brick_storage (n);
+      src.copy_to (a_tl - core_tl + brick_border, a_br - a_tl,
+		   dst, vec2<int> (a_tl) - org);
+    }
+
+  replicate_edges (dst, m_bytes_per_pixel,
+		   vec2<unsigned int> (vec2<int> (in_tl) - org),
+		   vec2<unsigned int> (vec2<int> (in_br) - org));
+}
+
+// ----------------------------------------------------------------------------
+
+void cpu_image::fill (const vec2<unsigned int>& xy, const vec2<unsigned int>& size,
+		      const vec4<float>& color)
+{
+  if (m_layout == layout::linear)
+  {
+    touch (xy, xy + size);
+    m_data.fill (vec2<int> (xy), size, color);
+    return;
+  }
+
+  for_each_brick (xy, xy + size,
+		  [&] (const vec2<unsigned int>& b,
+		       const vec2<unsigned int>& tl, const vec2<unsigned int>& br)
+		  {
+		    touch_brick (b);
+		    auto&& s = brick_storage (b);
+		    s.fill (vec2<int> (tl - b * brick_core_size + brick_border), br - tl, color);
+		  });
+
+  mark_stale (xy, xy + size);
+}
+
+void cpu_image::write (const image& src, const vec2<unsigned int>& src_xy,
+		       const vec2<unsigned int>& size, const vec2<unsigned int>& dst_xy)
+{
+  const auto sz = std::min (size, src.size () - std::min (src_xy, src.size ()));
+
+  if (m_layout == layout::linear)
+  {
+    touch (dst_xy, dst_xy + sz);
+    src.copy_to (src_xy, sz, m_data, vec2<int> (dst_xy));
+    return;
+  }
+
+  for_each_brick (dst_xy, dst_xy + sz,
+		  [&] (const vec2<unsigned int>& b,
+		       const vec2<unsigned int>& tl, const vec2<unsigned int>& br)
+		  {
+		    touch_brick (b);
+		    auto&& s = brick_storage (b);
+		    src.copy_to (src_xy + (tl - dst_xy), br - tl,
+				 s, vec2<int> (tl - b * brick_core_size + brick_border));
+		  });
+
+  mark_stale (dst_xy, dst_xy + sz);
+}
+
+void cpu_image::reduce (const cpu_image& src, const vec2<unsigned int>& tl,
+			const vec2<unsigned int>& br)
+{
+  if (tl.x >= br.x || tl.y >= br.y)
+    return;
+
+  if (m_layout == layout::linear)
+  {
+    src.touch (tl * 2, br * 2);
+    touch (tl, br);
+    pyr_down::reduce (src.m_data.subimg (vec2<int> (tl * 2), (br - tl) * 2),
+		      m_data.subimg (vec2<int> (tl), br - tl));
+    return;
+  }
+
+  // the destination area is processed in cells of half the brick core size.
+  // the source area of each cell is in the core of one source brick and
+  // the cell itself is in the core of one destination brick.
+  const unsigned int cs = brick_core_size / 2;
+
+  static_assert (brick_core_size % 2 == 0, "");
+
+  auto&& c0 = tl / cs;
+  auto&& c1 = (br + (cs - 1)) / cs;
+
+  for (unsigned int y = c0.y; y < c1.y; ++y)
+    for (unsigned int x = c0.x; x < c1.x; ++x)
+    {
+      const vec2<unsigned int> c (x, y);
+      auto&& d_tl = std::max (tl, c * cs);
+      auto&& d_br = std::min (br, c * cs + cs);
+
+      auto&& db = d_tl / brick_core_size;
+      auto&& sb = (d_tl * 2) / brick_core_size;
+
+      src.touch_brick (sb);
+      touch_brick (db);
+
+      auto&& s = src.brick_storage (sb);
+      auto&& d = brick_storage (db);
+
+      pyr_down::reduce (s.subimg (vec2<int> (d_tl * 2 - sb * brick_core_size + brick_border),
+				  (d_br - d_tl) * 2),
+			d.subimg (vec2<int> (d_tl - db * brick_core_size + brick_border),
+				  d_br - d_tl));
+    }
+
+  mark_stale (tl, br);
+}
+
+vec2<float> cpu_image::min_max (const vec2<unsigned int>& tl, const vec2<unsigned int>& br) const
+{
+  auto&& area_br = std::min (br, m_size);
+
+  if (tl.x >= area_br.x || tl.y >= area_br.y)
+    return { 0, 0 };
+
+  vec2<float> r (std::numeric_limits<float>::max (), std::numeric_limits<float>::lowest ());
+
+  if (m_layout == layout::linear)
+  {
+    touch (tl, area_br);
+    ::min_max (m_data, tl, area_br - tl, r);
+    return r;
+  }
+
+  for_each_brick (tl, area_br,
+		  [&] (const vec2<unsigned int>& b,
+		       const vec2<unsigned int>& a_tl, const vec2<unsigned int>& a_br)
+		  {
+		    touch_brick (b);
+		    ::min_max (brick_storage (b), a_tl - b * brick_core_size + brick_border,
+			       a_br - a_tl, r);
+		  });
+
+  return r;
+}
+
+bool cpu_image::constant (const vec2<unsigned int>& tl, const vec2<unsigned int>& br,
+			  void* value) const
+{
+  auto&& area_br = std::min (br, m_size);
+
+  if (tl.x >= area_br.x || tl.y >= area_br.y)
+    return false;
+
+  if (m_layout == layout::linear)
+  {
+    touch (tl, area_br);
+    std::memcpy (value, (const char*)m_data.data () + (size_t)tl.y * m_data.bytes_per_line ()
+			+ tl.x * m_bytes_per_pixel, m_bytes_per_pixel);
+    return ::constant (m_data, m_bytes_per_pixel, tl, area_br - tl, value);
+  }
+
+  bool first = true;
+  bool res = true;
+
+  for_each_brick (tl, area_br,
+		  [&] (const vec2<unsigned int>& b,
+		       const vec2<unsigned int>& a_tl, const vec2<unsigned int>& a_br)
+		  {
+		    if (!res)
+		      return;
+
+		    touch_brick (b);
+
+		    auto&& img = brick_storage (b);
+		    auto&& xy = a_tl - b * brick_core_size + brick_border;
+
+		    if (first)
+		    {
+		      std::memcpy (value, (const char*)img.data () + (size_t)xy.y * img.bytes_per_line ()
+					  + xy.x * m_bytes_per_pixel, m_bytes_per_pixel);
+		      first = false;
+		    }
+
+		    res = ::constant (img, m_bytes_per_pixel, xy, a_br - a_tl, value);
+		  });
+
+  return res;
+}
+
+image cpu_image::brick (const vec2<unsigned int>& tile_xy)
+{
+  const unsigned int i = tile_xy.x + tile_xy.y * m_num_bricks.x;
+
+  if (m_brick_stale[i])
+  {
+    update_border (tile_xy);
+    m_brick_stale[i] = false;
+  }
+  else
+    touch_brick (tile_xy);
+
+  return brick_storage (tile_xy);
+}
+
+void cpu_image::copy_tile (const vec2<unsigned int>& tile_xy, image& dst)
+{
+  if (m_layout == layout::bricked)
+  {
+    auto&& b = brick (tile_xy);
+
+    for (unsigned int y = 0; y < brick_size; ++y)
+      std::memcpy ((char*)dst.data () + y * dst.bytes_per_line (),
+		   (const char*)b.data () + y * b.bytes_per_line (),
+		   brick_size * m_bytes_per_pixel);
+    return;
+  }
+
+  const vec2<int> org = vec2<int> (tile_xy * brick_core_size) - (int)brick_border;
+  const auto in_tl = vec2<unsigned int> (std::max (org, vec2<int> (0)));
+  const auto in_br = vec2<unsigned int> (std::min (org + (int)brick_size, vec2<int> (m_size)));
+
+  touch (in_tl, in_br);
+  m_data.copy_to (in_tl, in_br - in_tl, dst, vec2<int> (in_tl) - org);
+
+  replicate_edges (dst, m_bytes_per_pixel,
+		   vec2<unsigned int> (vec2<int> (in_tl) - org),
+		   vec2<unsigned int> (vec2<int> (in_br) - org));
+}
@@ -0,0 +1,184 @@
+#ifndef includeguard_cpu_image_hpp_includeguard
+#define includeguard_cpu_image_hpp_includeguard
+
+#include <vector>
+#include <cstddef>
+
+#include "utils/vec_mat.hpp"
+#include "img/image.hpp"
+
+class mapped_arena;
+class compressed_tier;
+
+// one level of the mipmap pyramid in cpu memory.
+//
+// since the gpu texture format might be different from the cpu image format
+// that is stored as part of the image.
+//
+// there are two storage layouts:
+//
+//   linear    the whole level is one row-major img::image.
+//
+//   bricked   the level is stored as bricks of brick_size x brick_size
+//             pixels.  each brick holds one texture tile (brick_core_size)
+//             plus the sampling border around it, so that a texture tile
+//             is one contiguous, upload-ready block of memory.
+//             the bricks are stored in z-order to keep neighbouring bricks
+//             close in memory.  pixels are always written to the core of
+//             the brick they belong to only.  the borders of the affected
+//             bricks are marked as stale and copied from the neighbouring
+//             bricks when the brick is accessed.  at the image edges the
+//             edge pixels are replicated into the border.
+//
+// the pixels can be stored in a mapped_arena instead of normal memory.
+// then all accesses are announced to the arena, so that it can keep the
+// resident memory within its budget.
+//
+// with the bricked layout in an arena, the bricks can also be registered
+// with a compressed_tier, which compresses the bricks that haven't been
+// accessed recently.
+//
+// all coordinates are in pixels of this level.
+
+class cpu_image
+{
+public:
+  enum class layout
+  {
+    linear,
+    bricked
+  };
+
+  // the brick geometry matches the texture tiles of tiled_image.
+  static constexpr unsigned int brick_border = 8;
+  static constexpr unsigned int brick_size = 128;
+  static constexpr unsigned int brick_core_size = brick_size - brick_border*2;
+
+  cpu_image (void) : m_texture_format (img::pixel_format::invalid) { }
+
+  // if 'arena' is not null, the pixels are allocated from the arena and
+  // are initially zero.  the arena must outlive the image.
+  // 'tier' is only used with the bricked layout and an arena.  it must
+  // outlive the image, too.
+  cpu_image (img::pixel_format pf, const utils::vec2<unsigned int>& size,
+	     img::pixel_format texture_format, layout l = layout::linear,
+	     mapped_arena* arena = nullptr, compressed_tier* tier = nullptr);
+
+  // the gpu texture format for uploading pixels of format 'pf' as they are.
+  // r16ui pixels are uploaded as normalized r16 textures.
+  static img::pixel_format default_texture_format (img::pixel_format pf);
+
+  // the number of bytes of pixel storage needed for an image.
+  static size_t storage_size (img::pixel_format pf, const utils::vec2<unsigned int>& size,
+			      layout l);
+
+  cpu_image (const cpu_image&) = delete;
+  cpu_image (cpu_image&&) = default;
+
+  cpu_image& operator = (const cpu_image&) = delete;
+  cpu_image& operator = (cpu_image&&) = default;
+
+  const utils::vec2<unsigned int>& size (void) const { return m_size; }
+  bool empty (void) const { return m_size.x == 0 || m_size.y == 0; }
+
+  img::pixel_format format (void) const { return m_data.format (); }
+  auto texture_format (void) const { return m_texture_format; }
+  unsigned int bytes_per_pixel (void) const { return m_bytes_per_pixel; }
+
+  layout storage_layout (void) const { return m_layout; }
+
+  // the number of texture tiles (bricks) in x and y direction.
+  utils::vec2<unsigned int> num_tiles (void) const;
+
+  // fill the area with a constant color.  the area is clipped to the image.
+  void fill (const utils::vec2<unsigned int>& xy, const utils::vec2<unsigned int>& size,
+	     const utils::vec4<float>& color);
+
+  void fill (const utils::vec4<float>& color) { fill ({ 0 }, m_size, color); }
+
+  // copy the area (src_xy, size) of 'src' to 'dst_xy' of this image and
+  // convert the pixel format.  the area is clipped to both images.
+  void write (const img::image& src, const utils::vec2<unsigned int>& src_xy,
+	      const utils::vec2<unsigned int>& size, const utils::vec2<unsigned int>& dst_xy);
+
+  // update the area (tl, br) of this image by 2x2 averaging the area
+  // (tl*2, br*2) of 'src', which is the next higher detail level.
+  // both images must have the same layout.  the pixels are converted if
+  // the formats are different.
+  void reduce (const cpu_image& src, const utils::vec2<unsigned int>& tl,
+	       const utils::vec2<unsigned int>& br);
+
+  // the minimum and maximum value of the first channel in the area (tl, br)
+  // as (min, max).  the area is clipped to the image.  only for single
+  // channel formats.  an empty area has the range (0, 0).
+  utils::vec2<float> min_max (const utils::vec2<unsigned int>& tl,
+			      const utils::vec2<unsigned int>& br) const;
+
+  // true if all pixels in the area (tl, br) are the same.  the pixel is
+  // copied to 'value', which must have room for one pixel.  the area is
+  // clipped to the image.  an empty area is not constant.
+  bool constant (const utils::vec2<unsigned int>& tl, const utils::vec2<unsigned int>& br,
+		 void* value) const;
+
+  // the whole image.  only for the linear layout.  direct accesses to the
+  // pixels have to be announced with 'touch'.
+  const img::image& linear_image (void) const { return m_data; }
+
+  // announce a direct access to the area (tl, br).
+  void touch (const utils::vec2<unsigned int>& tl, const utils::vec2<unsigned int>& br) const;
+
+  // the brick of the texture tile 'tile_xy' (in tiles) with the sampling
+  // border.  only for the bricked layout.  if the border of the brick is
+  // stale, it is updated first.
+  img::image brick (const utils::vec2<unsigned int>& tile_xy);
+
+  // copy the texture tile 'tile_xy' (in tiles) with the sampling border
+  // into 'dst', which must have brick_size x brick_size pixels and the
+  // same format.  this works for both layouts.  for the linear layout the
+  // edge pixels of the image are replicated into the border the same way
+  // as for the bricked layout.
+  void copy_tile (const utils::vec2<unsigned int>& tile_xy, img::image& dst);
+
+private:
+  utils::vec2<unsigned int> m_size = { 0 };
+  img::pixel_format m_texture_format;
+  layout m_layout = layout::linear;
+
+  // an img::image which can also use memory from an arena.
+  struct storage_image : public img::image
+  {
+    storage_image (void) = default;
+
+    storage_image (img::pixel_format pf, const utils::vec2<unsigned int>& size,
+		   unsigned int bytes_per_pixel, mapped_arena* arena);
+  };
+
+  // linear:  the image.
+  // bricked: all bricks stacked vertically (brick_size x brick_size*N).
+  storage_image m_data;
+  mapped_arena* m_arena = nullptr;
+  compressed_tier* m_tier = nullptr;
+
+  unsigned int m_bytes_per_pixel = 0;
+
+  // bricked layout only.
+  utils::vec2<unsigned int> m_num_bricks = { 0 };
+  std::vector<unsigned int> m_brick_slot;
+  std::vector<bool> m_brick_stale;
+  std::vector<unsigned int> m_brick_tier_id;
+
+  img::image brick_storage (const utils::vec2<unsigned int>& b) const;
+
+  void touch_brick (const utils::vec2<unsigned int>& b) const;
+
+  void mark_stale (const utils::vec2<unsigned int>& tl, const utils::vec2<unsigned int>& br);
+  void update_border (const utils::vec2<unsigned int>& b);
+
+  // call f (brick, area tl, area br) for each brick core which intersects
+  // the area.
+  template <typename Func> void
+  for_each_brick (const utils::vec2<unsigned int>& tl, const utils::vec2<unsigned int>& br,
+		  Func&& f) const;
+};
+
+#endif // includeguard_cpu_image_hpp_includeguard
@@ -0,0 +1,115 @@
+
+#include "encoded_tile_cache.hpp"
+
+encoded_tile_cache::encoded_tile_cache (size_t max_bytes)
+: m_max_bytes (max_bytes)
+{
+}
+
+unsigned int encoded_tile_cache::bucket (uint64_t key)
+{
+  // the keys of neighbouring tiles differ in the middle bits.
+  key ^= key >> 29;
+  key *= 0x9e3779b97f4a7c15ull;
+  return (unsigned int)(key >> 52) % num_erased_buckets;
+}
+
+uint64_t encoded_tile_cache::stamp (void) const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_serial;
+}
+
+bool encoded_tile_cache::find (uint64_t key, std::vector<uint8_t>& out)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto i = m_tiles.find (key);
+  if (i == m_tiles.end ())
+  {
+    m_num_misses += 1;
+    return false;
+  }
+
+  m_num_hits += 1;
+  m_lru.splice (m_lru.begin (), m_lru, i->second.lru);
+  out = i->second.data;
+  return true;
+}
+
+void encoded_tile_cache::insert (uint64_t key, const std::vector<uint8_t>& data,
+				 uint64_t stamp)
+{
+  if (data.size () > m_max_bytes)
+    return;
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  if (m_erased[bucket (key)] > stamp || m_tiles.find (key) != m_tiles.end ())
+    return;
+
+  while (m_bytes + data.size () > m_max_bytes && !m_lru.empty ())
+  {
+    auto i = m_tiles.find (m_lru.back ());
+    m_bytes -= i->second.data.size ();
+    m_lru.pop_back ();
+    m_tiles.erase (i);
+  }
+
+  m_lru.push_front (key);
+
+  auto&& e = m_tiles[key];
+  e.data = data;
+  e.lru = m_lru.begin ();
+  m_bytes += data.size ();
+}
+
+void encoded_tile_cache::erase (uint64_t key)
+{
+  erase (std::vector<uint64_t> (1, key));
+}
+
+void encoded_tile_cache::erase (const std::vector<uint64_t>& keys)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  m_serial += 1;
+
+  for (uint64_t key : keys)
+  {
+    m_erased[bucket (key)] = m_serial;
+
+    auto i = m_tiles.find (key);
+    if (i == m_tiles.end ())
+      continue;
+
+    m_bytes -= i->second.data.size ();
+    m_lru.erase (i->second.lru);
+    m_tiles.erase (i);
+  }
+}
+
+void encoded_tile_cache::clear (void)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  // the encodings in progress are not added anymore.
+  m_serial += 1;
+  m_erased.fill (m_serial);
+
+  m_tiles.clear ();
+  m_lru.clear ();
+  m_bytes = 0;
+}
+
+encoded_tile_cache::stats encoded_tile_cache::get_stats (void) const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  stats s;
+  s.num_hits = m_num_hits;
+  s.num_misses = m_num_misses;
+  s.num_tiles = m_tiles.size ();
+  s.bytes = m_bytes;
+  return s;
+}
@@ -0,0 +1,92 @@
+#ifndef includeguard_encoded_tile_cache_hpp_includeguard
+#define includeguard_encoded_tile_cache_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <array>
+#include <map>
+#include <list>
+#include <mutex>
+
+// the encoded (e.g. bc1 compressed) textures of the tiles of an image, so
+// that a texture which has been evicted from the graphics card memory can
+// be uploaded again without encoding it again.  the least recently used
+// textures are dropped when the cache takes more than its budget.
+//
+// the texels of a tile might change while it's being encoded.  such a
+// texture is not added to the cache.  for that, a stamp is taken before the
+// texels are read and passed to 'insert', which ignores the texture if the
+// tile has been erased since then.
+//
+// all functions can be called from any thread.
+
+class encoded_tile_cache
+{
+public:
+  struct stats
+  {
+    uint64_t num_hits = 0;
+    uint64_t num_misses = 0;
+    size_t num_tiles = 0;
+    size_t bytes = 0;
+  };
+
+  explicit encoded_tile_cache (size_t max_bytes);
+
+  encoded_tile_cache (const encoded_tile_cache&) = delete;
+  encoded_tile_cache& operator = (const encoded_tile_cache&) = delete;
+
+  size_t max_bytes (void) const { return m_max_bytes; }
+
+  // take a stamp before reading the texels of a tile for encoding them.
+  uint64_t stamp (void) const;
+
+  // copy the texture of the tile to 'out'.  returns false if it's not
+  // cached.
+  bool find (uint64_t key, std::vector<uint8_t>& out);
+
+  // add the texture of the tile, unless the tile has been erased since
+  // 'stamp' was taken.
+  void insert (uint64_t key, const std::vector<uint8_t>& data, uint64_t stamp);
+
+  // the texels of the tile have changed.
+  void erase (uint64_t key);
+  void erase (const std::vector<uint64_t>& keys);
+
+  void clear (void);
+
+  stats get_stats (void) const;
+
+private:
+  // the erased tiles are remembered in buckets by key.  a tile which
+  // shares a bucket with an erased one is not added either, which is rare
+  // and harmless.
+  static constexpr unsigned int num_erased_buckets = 4096;
+
+  size_t m_max_bytes;
+
+  mutable std::mutex m_mutex;
+
+  struct entry
+  {
+    std::vector<uint8_t> data;
+    std::list<uint64_t>::iterator lru;
+  };
+
+  std::map<uint64_t, entry> m_tiles;
+
+  // most recently used first.
+  std::list<uint64_t> m_lru;
+
+  size_t m_bytes = 0;
+  uint64_t m_serial = 0;
+  std::array<uint64_t, num_erased_buckets> m_erased = { };
+
+  uint64_t m_num_hits = 0;
+  uint64_t m_num_misses = 0;
+
+  static unsigned int bucket (uint64_t key);
+};
+
+#endif // includeguard_encoded_tile_cache_hpp_includeguard
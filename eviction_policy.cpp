@@ -0,0 +1,341 @@
+
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <stdexcept>
+
+#include "eviction_policy.hpp"
+#include "tile_map.hpp"
+
+namespace
+{
+
+class lru_policy : public eviction_policy
+{
+public:
+  virtual kind get_kind (void) const override { return lru; }
+
+  virtual void insert (uint64_t key) override
+  {
+    m_tiles.lru_push_front (m_tiles.insert (key, 0));
+  }
+
+  virtual void touch (uint64_t key, bool) override
+  {
+    const auto h = m_tiles.find (key);
+    if (h != m_tiles.npos)
+      m_tiles.lru_push_front (h);
+  }
+
+  virtual void erase (uint64_t key) override
+  {
+    const auto h = m_tiles.find (key);
+    if (h != m_tiles.npos)
+      m_tiles.erase (h);
+  }
+
+  virtual uint64_t victim (void) override
+  {
+    return m_tiles.key (m_tiles.lru_back ());
+  }
+
+  virtual size_t size (void) const override { return m_tiles.size (); }
+  virtual void clear (void) override { m_tiles.clear (); }
+
+private:
+  tile_map<char> m_tiles;
+};
+
+// ----------------------------------------------------------------------------
+
+class gdsf_policy : public eviction_policy
+{
+public:
+  gdsf_policy (cost_func cost) : m_cost (std::move (cost)) { }
+
+  virtual kind get_kind (void) const override { return gdsf; }
+
+  virtual void insert (uint64_t key) override
+  {
+    entry e;
+    e.cost = m_cost != nullptr ? m_cost (key) : 1.0;
+    e.uses = 1;
+    e.priority = m_aging + e.cost;
+    e.last_use = ++m_serial;
+
+    m_tiles.insert (key, e);
+    push ({ e.priority, e.last_use, key });
+  }
+
+  virtual void touch (uint64_t key, bool reused) override
+  {
+    // the priority only grows, so the entry in the heap is updated lazily
+    // when it comes to the top.
+    const auto h = m_tiles.find (key);
+    if (h == m_tiles.npos)
+      return;
+
+    auto&& e = m_tiles[h];
+    if (reused)
+      e.uses += 1;
+    e.priority = m_aging + e.uses * e.cost;
+    e.last_use = ++m_serial;
+  }
+
+  virtual void erase (uint64_t key) override
+  {
+    const auto h = m_tiles.find (key);
+    if (h != m_tiles.npos)
+      m_tiles.erase (h);
+
+    // the evicted tile ages the others.
+    if (key == m_victim)
+      m_aging = std::max (m_aging, m_victim_priority);
+
+    // the stale heap entries are skipped in 'victim'.  if there are too
+    // many of them, the heap is rebuilt.
+    if (m_heap.size () > m_tiles.size () * 2 + 64)
+    {
+      m_heap.clear ();
+      m_tiles.for_each ([this] (uint64_t k, const entry& e)
+      {
+	m_heap.push_back ({ e.priority, e.last_use, k });
+      });
+      std::make_heap (m_heap.begin (), m_heap.end ());
+    }
+  }
+
+  virtual uint64_t victim (void) override
+  {
+    while (true)
+    {
+      const heap_entry top = m_heap.front ();
+      std::pop_heap (m_heap.begin (), m_heap.end ());
+      m_heap.pop_back ();
+
+      const auto h = m_tiles.find (top.key);
+      if (h == m_tiles.npos)
+	continue;
+
+      // used since the entry was pushed.
+      const entry& e = m_tiles[h];
+      if (e.last_use != top.last_use)
+      {
+	push ({ e.priority, e.last_use, top.key });
+	continue;
+      }
+
+      // the entry is pushed again in case the tile is not evicted.
+      push (top);
+      m_victim = top.key;
+      m_victim_priority = top.priority;
+      return top.key;
+    }
+  }
+
+  virtual size_t size (void) const override { return m_tiles.size (); }
+
+  virtual void clear (void) override
+  {
+    m_tiles.clear ();
+    m_heap.clear ();
+    m_aging = 0;
+    m_victim_priority = 0;
+  }
+
+private:
+  struct entry
+  {
+    double priority = 0;
+    double cost = 1;
+    double uses = 0;
+    uint64_t last_use = 0;
+  };
+
+  // of the tiles with the same priority, the least recently used one is
+  // evicted first.  otherwise the tiles which were just added for the
+  // current frame would be evicted as often as the old ones.
+  struct heap_entry
+  {
+    double priority;
+    uint64_t last_use;
+    uint64_t key;
+
+    // for a min heap with the std heap functions.
+    bool operator < (const heap_entry& rhs) const
+    {
+      return priority != rhs.priority ? priority > rhs.priority : last_use > rhs.last_use;
+    }
+  };
+
+  cost_func m_cost;
+  tile_map<entry> m_tiles;
+
+  // there can be several entries per tile and entries of tiles which are
+  // gone.
+  std::vector<heap_entry> m_heap;
+
+  double m_aging = 0;
+  uint64_t m_serial = 0;
+
+  // the last tile returned by 'victim'.
+  uint64_t m_victim = 0;
+  double m_victim_priority = 0;
+
+  void push (const heap_entry& e)
+  {
+    m_heap.push_back (e);
+    std::push_heap (m_heap.begin (), m_heap.end ());
+  }
+};
+
+// ----------------------------------------------------------------------------
+
+class arc_policy : public eviction_policy
+{
+public:
+  virtual kind get_kind (void) const override { return arc; }
+
+  virtual void insert (uint64_t key) override
+  {
+    const auto h = m_tiles.find (key);
+    if (h == m_tiles.npos)
+    {
+      m_lists[t1].push_front (key);
+      m_tiles.insert (key, { t1, m_lists[t1].begin () });
+    }
+    else if (m_tiles[h].list == t1 || m_tiles[h].list == t2)
+      move (m_tiles[h], t2);
+    else
+    {
+      // a ghost hit.  the list whose tiles are asked for again gets more
+      // room.
+      const double b1_size = (double)m_lists[b1].size ();
+      const double b2_size = (double)m_lists[b2].size ();
+
+      if (m_tiles[h].list == b1)
+	m_target_t1 = std::min (m_target_t1 + std::max (1.0, b2_size / b1_size),
+				(double)m_capacity);
+      else
+	m_target_t1 = std::max (m_target_t1 - std::max (1.0, b1_size / b2_size), 0.0);
+
+      move (m_tiles[h], t2);
+    }
+
+    m_capacity = std::max (m_capacity, size ());
+  }
+
+  virtual void touch (uint64_t key, bool reused) override
+  {
+    const auto h = m_tiles.find (key);
+    if (h == m_tiles.npos)
+      return;
+
+    auto&& e = m_tiles[h];
+    if (e.list == t1 || e.list == t2)
+      move (e, reused ? t2 : e.list);
+  }
+
+  virtual void erase (uint64_t key) override
+  {
+    const auto h = m_tiles.find (key);
+    if (h == m_tiles.npos)
+      return;
+
+    auto&& e = m_tiles[h];
+    if (e.list == t1)
+      move (e, b1);
+    else if (e.list == t2)
+      move (e, b2);
+
+    // the ghost lists remember as many keys as the cache can hold.
+    while (m_lists[t1].size () + m_lists[b1].size () > m_capacity && !m_lists[b1].empty ())
+      forget (b1);
+
+    while (size () + m_lists[b1].size () + m_lists[b2].size () > m_capacity * 2
+	   && !m_lists[b2].empty ())
+      forget (b2);
+  }
+
+  virtual uint64_t victim (void) override
+  {
+    if (!m_lists[t1].empty ()
+	&& (m_lists[t2].empty () || (double)m_lists[t1].size () > m_target_t1))
+      return m_lists[t1].back ();
+
+    return m_lists[t2].back ();
+  }
+
+  virtual size_t size (void) const override
+  {
+    return m_lists[t1].size () + m_lists[t2].size ();
+  }
+
+  virtual void clear (void) override
+  {
+    m_tiles.clear ();
+    for (auto&& l : m_lists)
+      l.clear ();
+
+    m_target_t1 = 0;
+    m_capacity = 0;
+  }
+
+private:
+  // the tiles in the cache which were used once and more often, and the
+  // evicted ones.  most recently used first.
+  enum list_index { t1 = 0, t2, b1, b2 };
+
+  struct entry
+  {
+    list_index list;
+    std::list<uint64_t>::iterator pos;
+  };
+
+  tile_map<entry> m_tiles;
+  std::list<uint64_t> m_lists[4];
+
+  // the size of t1 which is aimed for.
+  double m_target_t1 = 0;
+
+  // the most tiles the cache has held.
+  size_t m_capacity = 0;
+
+  void move (entry& e, list_index to)
+  {
+    m_lists[to].splice (m_lists[to].begin (), m_lists[e.list], e.pos);
+    e.list = to;
+  }
+
+  void forget (list_index l)
+  {
+    m_tiles.erase (m_tiles.find (m_lists[l].back ()));
+    m_lists[l].pop_back ();
+  }
+};
+
+} // anonymous namespace
+
+// ----------------------------------------------------------------------------
+
+std::unique_ptr<eviction_policy> eviction_policy::create (kind k, cost_func cost)
+{
+  switch (k)
+  {
+    case lru: return std::make_unique<lru_policy> ();
+    case gdsf: return std::make_unique<gdsf_policy> (std::move (cost));
+    case arc: return std::make_unique<arc_policy> ();
+    default: throw std::invalid_argument ("eviction_policy: unknown kind");
+  }
+}
+
+const char* eviction_policy::name (kind k)
+{
+  switch (k)
+  {
+    case lru: return "lru";
+    case gdsf: return "gdsf";
+    case arc: return "arc";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,75 @@
+#ifndef includeguard_eviction_policy_hpp_includeguard
+#define includeguard_eviction_policy_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <functional>
+
+// the order in which a cache evicts its tiles.  the cache tells the policy
+// which tiles it holds and when they are used, and asks it for the tile to
+// evict next.
+//
+// 'lru' evicts the least recently used tile.
+//
+// 'gdsf' (greedy dual size frequency) evicts the tile with the lowest
+// priority 'L + uses * cost', where L is the priority of the last evicted
+// tile.  tiles which are expensive to load again or used often stay longer,
+// and L ages the tiles which aren't used anymore.
+//
+// 'arc' (adaptive replacement cache) keeps the tiles which were used once
+// and those which were used again in separate lru lists.  it remembers the
+// keys of recently evicted tiles and shifts the balance between the lists
+// towards the list whose tiles are asked for again.  a scan of tiles which
+// are used only once doesn't evict the tiles which are used again.
+//
+// the cache should count at most one use per tile and frame.  a tile which
+// stays in view for a while, e.g. while flying over the image, is used only
+// once in the sense of 'gdsf' and 'arc'.  only a tile which comes back into
+// view is used again.
+
+class eviction_policy
+{
+public:
+  enum kind
+  {
+    lru = 0,
+    gdsf,
+    arc,
+
+    num_kinds
+  };
+
+  // the cost of loading the tile again, relative to the other tiles.  null
+  // means the same cost for all tiles.
+  typedef std::function<double (uint64_t key)> cost_func;
+
+  static std::unique_ptr<eviction_policy> create (kind k, cost_func cost = nullptr);
+  static const char* name (kind k);
+
+  virtual ~eviction_policy (void) = default;
+
+  virtual kind get_kind (void) const = 0;
+
+  // the tile has been added to the cache.
+  virtual void insert (uint64_t key) = 0;
+
+  // the tile has been used.  'reused' is false if it has been used in the
+  // previous frame too, i.e. if it has stayed in view.
+  virtual void touch (uint64_t key, bool reused) = 0;
+
+  // the tile has been evicted or dropped from the cache.
+  virtual void erase (uint64_t key) = 0;
+
+  // the tile which should be evicted next.  the cache must hold at least
+  // one tile.
+  virtual uint64_t victim (void) = 0;
+
+  // the number of tiles in the cache.
+  virtual size_t size (void) const = 0;
+  bool empty (void) const { return size () == 0; }
+
+  virtual void clear (void) = 0;
+};
+
+#endif // includeguard_eviction_policy_hpp_includeguard
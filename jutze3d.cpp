@@ -10,6 +10,7 @@
 #include <atomic>
 #include <chrono>
 #include <limits>
+#include <string>
 #include <iostream>
 #include <algorithm>
 
@@ -21,6 +22,7 @@
 
 #include "tiled_image.hpp"
 #include "test_scene1.hpp"
+#include "render_stats.hpp"
 
 #include "jutze3d.hpp"
 
@@ -53,6 +55,25 @@ static float drag_start_tilt_angle;
 static mat4<double> drag_start_rot_trv;
 
 static bool g_use_uint16_heightmap = false;
+static bool g_use_lazy_mipmaps = false;
+static bool g_use_bricked_image_layout = false;
+static bool g_use_file_backed_image = false;
+static std::string g_backing_file_dir;
+static unsigned int g_resident_budget_mbytes = 0;
+static unsigned int g_compressed_tier_budget_mbytes = 0;
+static unsigned int g_compact_levels_from = 0;
+static unsigned int g_upload_budget_kbytes = 0;
+static unsigned int g_upload_budget_usec = 4000;
+static unsigned int g_texture_cache_budget_mbytes = 128;
+static unsigned int g_texture_staging_budget_mbytes = 128;
+static unsigned int g_pinned_texture_levels = 5;
+static float g_max_height_error = 0;
+static bool g_compressed_color_textures = false;
+static eviction_policy::kind g_texture_eviction_policy = eviction_policy::lru;
+static std::string g_texture_trace;
+
+// outlives the scene, so that it can be read at any time.
+static render_stats g_stats;
 
 enum
 {
@@ -216,6 +237,149 @@ view3d_use_uint16_heightmap (int val)
   g_use_uint16_heightmap = val != 0;
 }
 
+JUTZE3D_API void
+view3d_use_bricked_image_layout (int val)
+{
+  g_use_bricked_image_layout = val != 0;
+}
+
+JUTZE3D_API void
+view3d_use_file_backed_image (const char* dir, unsigned int resident_budget_mbytes)
+{
+  g_use_file_backed_image = dir != nullptr;
+  g_backing_file_dir = dir != nullptr ? dir : "";
+  g_resident_budget_mbytes = resident_budget_mbytes;
+}
+
+JUTZE3D_API void
+view3d_use_compressed_image (unsigned int budget_mbytes)
+{
+  g_compressed_tier_budget_mbytes = budget_mbytes;
+}
+
+JUTZE3D_API void
+view3d_use_compact_coarse_levels (unsigned int first_level)
+{
+  g_compact_levels_from = first_level;
+}
+
+JUTZE3D_API void
+view3d_use_lazy_mipmaps (int val)
+{
+  g_use_lazy_mipmaps = val != 0;
+}
+
+JUTZE3D_API void
+view3d_set_texture_upload_budget (unsigned int max_kbytes, unsigned int max_usec)
+{
+  g_upload_budget_kbytes = max_kbytes;
+  g_upload_budget_usec = max_usec;
+}
+
+JUTZE3D_API void
+view3d_set_texture_cache_budget (unsigned int mbytes)
+{
+  g_texture_cache_budget_mbytes = mbytes;
+}
+
+JUTZE3D_API void
+view3d_set_texture_staging_budget (unsigned int mbytes)
+{
+  g_texture_staging_budget_mbytes = mbytes;
+}
+
+JUTZE3D_API void
+view3d_set_pinned_texture_levels (unsigned int levels)
+{
+  g_pinned_texture_levels = levels;
+}
+
+JUTZE3D_API void
+view3d_set_max_height_error (float val)
+{
+  g_max_height_error = val;
+}
+
+JUTZE3D_API void
+view3d_use_compressed_color_textures (int val)
+{
+  g_compressed_color_textures = val != 0;
+}
+
+JUTZE3D_API void
+view3d_set_texture_eviction_policy (int val)
+{
+  if (val >= 0 && val < eviction_policy::num_kinds)
+    g_texture_eviction_policy = (eviction_policy::kind)val;
+}
+
+JUTZE3D_API void
+view3d_record_texture_trace (const char* filename)
+{
+  g_texture_trace = filename != nullptr ? filename : "";
+}
+
+JUTZE3D_API void
+view3d_get_stats (view3d_stats* out)
+{
+  if (out == nullptr)
+    return;
+
+  auto&& get = [] (const render_stats::counter& c) { return render_stats::get (c); };
+
+  out->num_frames = get (g_stats.num_frames);
+  out->frame_usec = (unsigned int)get (g_stats.last_frame_usec);
+
+  static_assert (sizeof (out->visible_tiles) / sizeof (out->visible_tiles[0])
+		 == render_stats::max_lod_levels, "");
+
+  for (unsigned int i = 0; i < render_stats::max_lod_levels; ++i)
+    out->visible_tiles[i] = (unsigned int)get (g_stats.last_visible_tiles[i]);
+
+  out->candidate_tiles = (unsigned int)get (g_stats.last_candidate_tiles);
+  out->missing_tiles = (unsigned int)get (g_stats.last_missing_tiles);
+
+  out->texture_cache_hits = get (g_stats.texture_cache_hits);
+  out->texture_cache_misses = get (g_stats.texture_cache_misses);
+  out->texture_cache_evictions = get (g_stats.texture_cache_evictions);
+
+  out->upload_bytes_last_frame = get (g_stats.last_upload_bytes);
+  out->upload_bytes = get (g_stats.upload_bytes);
+
+  // pixels per microsecond = mpixels per second.
+  const uint64_t ingest_usec = get (g_stats.ingest_usec);
+  out->num_updates = get (g_stats.num_updates);
+  out->ingest_mpixels_per_sec = ingest_usec > 0
+				? (double)get (g_stats.ingest_pixels) / (double)ingest_usec
+				: 0.0;
+  out->pyramid_update_usec = get (g_stats.pyramid_usec);
+
+  out->cpu_image_bytes = get (g_stats.cpu_image_bytes);
+  out->gpu_texture_bytes = get (g_stats.gpu_texture_bytes);
+
+  out->height_textures = get (g_stats.height_textures);
+  out->quantized_height_textures = get (g_stats.quantized_height_textures);
+  out->quantized_height_bytes_saved = get (g_stats.quantized_height_bytes_saved);
+  out->max_height_error = (double)get (g_stats.max_height_error_millionths) * 1e-6;
+
+  out->compressed_color_textures = get (g_stats.compressed_color_textures);
+  out->color_textures_encoded = get (g_stats.color_textures_encoded);
+  out->color_encode_usec = get (g_stats.color_encode_usec);
+
+  out->texture_staging_hits = get (g_stats.texture_staging_hits);
+  out->staged_texture_bytes = get (g_stats.staged_texture_bytes);
+
+  out->pinned_textures = get (g_stats.pinned_textures);
+  out->pinned_textures_loaded = get (g_stats.pinned_textures_cached);
+
+  out->texture_stale_hits = get (g_stats.texture_stale_hits);
+
+  out->prefetch_requests = get (g_stats.prefetch_requests);
+  out->prefetch_hits = get (g_stats.prefetch_hits);
+  out->prefetch_late = get (g_stats.prefetch_late);
+  out->prefetch_unused = get (g_stats.prefetch_unused);
+}
+
 JUTZE3D_API void* 
 view3d_new_window (unsigned int desktop_pos_x, unsigned int desktop_pos_y,
 		   unsigned int width, unsigned int height, const char* title)
@@ -508,6 +672,7 @@ void thread_func (void)
 	      std::cerr << "gldev init extensions" << std::endl;
 	      g_gldev->init_extensions ();
 	      g_scene = std::make_unique<test_scene1> ();
+	      g_scene->set_stats (&g_stats);
 
 	      g_window = std::move (new_win);
 	    }
@@ -534,6 +699,21 @@ void thread_func (void)
 	{
 	  auto&& args = *(resize_image_args*)msg.lParam;
 	  g_scene->set_use_uint16_heightmap (g_use_uint16_heightmap);
+	  g_scene->set_use_bricked_image_layout (g_use_bricked_image_layout);
+	  g_scene->set_use_file_backed_image (g_use_file_backed_image, g_backing_file_dir,
+					      (size_t)g_resident_budget_mbytes << 20);
+	  g_scene->set_compressed_tier_budget ((size_t)g_compressed_tier_budget_mbytes << 20);
+	  g_scene->set_compact_levels_from (g_compact_levels_from);
+	  g_scene->set_use_lazy_mipmaps (g_use_lazy_mipmaps);
+	  g_scene->set_texture_upload_budget ((size_t)g_upload_budget_kbytes << 10,
+					      g_upload_budget_usec * 1e-6);
+	  g_scene->set_texture_cache_budget ((size_t)g_texture_cache_budget_mbytes << 20);
+	  g_scene->set_texture_staging_budget ((size_t)g_texture_staging_budget_mbytes << 20);
+	  g_scene->set_pinned_texture_levels (g_pinned_texture_levels);
+	  g_scene->set_max_height_error (g_max_height_error);
+	  g_scene->set_compressed_color_textures (g_compressed_color_textures);
+	  g_scene->set_texture_eviction_policy (g_texture_eviction_policy);
+	  g_scene->set_texture_trace (g_texture_trace);
 	  g_scene->resize_image ({ args.width, args.height });
 	}
 	ack_thread_message (msg);
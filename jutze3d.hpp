@@ -32,6 +32,216 @@ JUTZE3D_API void view3d_finish (void);
 // created/resized will use the new setting.
 JUTZE3D_API void view3d_use_uin16_heightmap (int val);
 
+// if 'val' is non-zero, the images that will be created will store the
+// detail levels in memory as texture tiles with their sampling border
+// (bricks) instead of row by row.  this makes the texture uploads cheaper,
+// at the cost of about 30% more memory for the image.
+// the default is to store the detail levels row by row.
+// this function can be called at any time.  the next image that will be
+// created/resized will use the new setting.
+JUTZE3D_API void view3d_use_bricked_image_layout (int val);
+
+// if 'dir' is not null, the images that will be created will be stored in
+// a temporary file in the directory 'dir', which is mapped into memory.
+// if 'dir' is an empty string, the system's temporary directory is used.
+// at most 'resident_budget_mbytes' MByte of the image are kept in physical
+// memory at a time (0 = no limit).  this allows displaying images which are
+// bigger than the physical memory.  for such images the bricked image layout
+// should be used too, so that only the displayed tiles have to be in memory.
+// if 'dir' is null, the images are stored in normal memory (the default).
+// the setting is applied to the image when it is created/resized.
+JUTZE3D_API void view3d_use_file_backed_image (const char* dir,
+					       unsigned int resident_budget_mbytes);
+
+// if 'budget_mbytes' is not 0, the parts of the images that haven't been
+// displayed or updated recently are kept in memory in compressed form (the
+// compression is lossless).  about 'budget_mbytes' MByte of the image are
+// kept uncompressed.  e.g. on a 32 GB machine a budget of 8192 keeps most
+// of a big board uncompressed and compresses the rest.  this uses the
+// bricked image layout.  it has no effect on file backed images.
+// the default is 0 (no compression).
+// the setting is applied to the image when it is created/resized.
+JUTZE3D_API void view3d_use_compressed_image (unsigned int budget_mbytes);
+
+// if 'first_level' is not 0, the detail levels starting with 'first_level'
+// (1 = the first level below the full resolution) are stored in memory with
+// 16 bit colors (rgb565) and 16 bit integer heights.  this reduces the memory
+// and the texture upload bandwidth of the coarse levels.  the full
+// resolution is not affected.
+// the default is 0 (all levels use the same formats).
+// the setting is applied to the image when it is created/resized.
+JUTZE3D_API void view3d_use_compact_coarse_levels (unsigned int first_level);
+
+// if 'val' is non-zero, image updates write only the full resolution image
+// and the lower detail levels are computed when they are needed for display.
+// this makes bursts of updates faster while zoomed in.
+// the default is to update all detail levels with each update.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_use_lazy_mipmaps (int val);
+
+// the texture tiles of the image are prepared in the background and
+// uploaded to the graphics card while rendering.  the uploads of one frame
+// are limited to 'max_kbytes' KByte and 'max_usec' microseconds (0 = no
+// limit), so that scrolling and zooming stay smooth.  tiles which are not
+// uploaded yet are not displayed until they are.
+// the default is 0 KByte and 4000 microseconds.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_set_texture_upload_budget (unsigned int max_kbytes,
+						   unsigned int max_usec);
+
+// the graphics card memory which is used for the color and height textures
+// of the displayed image in MByte.  if it's too small for the displayed
+// area, the textures are uploaded again and again.  a bigger budget keeps
+// more of the image ready for scrolling and zooming.
+// the default is 128 MByte.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_set_texture_cache_budget (unsigned int mbytes);
+
+// the ram in MByte which is used for keeping the prepared textures of the
+// tiles which have been loaded, so that textures which were evicted from
+// the graphics card memory can be uploaded again quickly, e.g. when going
+// back and forth between two distant areas of the image.  0 disables it.
+// the default is 128 MByte.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_set_texture_staging_budget (unsigned int mbytes);
+
+// the textures of the 'levels' lowest detail levels are kept in the
+// graphics card memory and loaded in the background as soon as the image
+// has been written there, so that the overview of the whole image is
+// rendered without waiting for textures.  the levels are pinned as long as
+// they take at most a quarter of the texture cache budget.  0 disables it.
+// the default is 5, which covers an image of about 10000 x 10000 pixels in
+// a 1000 x 1000 pixels window.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_set_pinned_texture_levels (unsigned int levels);
+
+// the height textures of the tiles are stored with 8 or 16 bits per texel,
+// scaled to the height range of each tile, if that changes the heights by
+// at most 'val' (in the units of the height values).  this reduces the
+// uploads and the graphics card memory of the height textures.
+// the default is 0, i.e. only tiles with integer heights in a small
+// enough range are stored with fewer bits.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_set_max_height_error (float val);
+
+// if enabled, the color textures are uploaded bc1 (dxt1) compressed, which
+// takes 1/8 of the graphics card memory and upload bandwidth at some loss
+// of quality.  ignored if the graphics card doesn't support it.  the
+// default is 0 (disabled).
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_use_compressed_color_textures (int val);
+
+// the order in which the textures are evicted from the graphics card memory
+// when the texture cache budget is used up.
+//   0: least recently used first (the default).
+//   1: greedy dual size frequency.  the textures of the lower detail levels,
+//      which cover a larger area and are needed whenever the view is zoomed
+//      out, and the often used textures are kept longer.
+//   2: adaptive replacement cache.  scrolling over an area once doesn't
+//      evict the textures which are used again and again.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_set_texture_eviction_policy (int val);
+
+// write the texture tiles which are rendered in each frame to the file, for
+// comparing the eviction policies and texture cache budgets offline with
+// '3dview_bench evict_sim'.  null or an empty string stops it.
+// like view3d_use_uin16_heightmap, the setting is applied to the image when
+// it is created/resized.
+JUTZE3D_API void view3d_record_texture_trace (const char* filename);
+
+// what the 3D view is doing, e.g. for displaying it in the HMI.  the
+// counters are updated while rendering and updating the image and can be
+// read at any time from any thread.  the values of the last frame are not
+// necessarily from the same frame.
+typedef struct
+{
+  // the number of rendered frames and the time between the last two frames
+  // in microseconds.
+  unsigned long long num_frames;
+  unsigned int frame_usec;
+
+  // the number of rendered tiles of each detail level (0 = full
+  // resolution) in the last frame.  the levels beyond 15 are counted in
+  // the last entry.
+  unsigned int visible_tiles[16];
+
+  // the number of tiles which were tested for visibility in the last
+  // frame and the number of visible tiles whose textures were not loaded.
+  unsigned int candidate_tiles;
+  unsigned int missing_tiles;
+
+  // the texture tiles which were found in the graphics card memory when
+  // they were rendered or not, and the number of tiles which were evicted
+  // to make room for others.
+  unsigned long long texture_cache_hits;
+  unsigned long long texture_cache_misses;
+  unsigned long long texture_cache_evictions;
+
+  // the bytes which were uploaded to the graphics card in the last frame
+  // and in total.
+  unsigned long long upload_bytes_last_frame;
+  unsigned long long upload_bytes;
+
+  // the image updates: their number, the updated area divided by the time
+  // of the update functions, and the total time of updating the detail
+  // levels of the color and height images in microseconds.
+  unsigned long long num_updates;
+  double ingest_mpixels_per_sec;
+  unsigned long long pyramid_update_usec;
+
+  // the memory of the current image's detail levels (uncompressed) and
+  // of its textures in bytes.
+  unsigned long long cpu_image_bytes;
+  unsigned long long gpu_texture_bytes;
+
+  // the height textures which were loaded, those which were stored with
+  // fewer bits, the bytes saved by that and the largest height error of
+  // those textures (see view3d_set_max_height_error).
+  unsigned long long height_textures;
+  unsigned long long quantized_height_textures;
+  unsigned long long quantized_height_bytes_saved;
+  double max_height_error;
+
+  // the color textures which were compressed, those which had to be
+  // encoded (the others were cached) and the total encoding time in
+  // microseconds (see view3d_use_compressed_color_textures).
+  unsigned long long compressed_color_textures;
+  unsigned long long color_textures_encoded;
+  unsigned long long color_encode_usec;
+
+  // the texture tiles which were uploaded again from the prepared textures
+  // in ram, and the bytes of those (see view3d_set_texture_staging_budget).
+  unsigned long long texture_staging_hits;
+  unsigned long long staged_texture_bytes;
+
+  // the pinned textures of the lower detail levels and those of them which
+  // are loaded (see view3d_set_pinned_texture_levels).
+  unsigned long long pinned_textures;
+  unsigned long long pinned_textures_loaded;
+
+  // the texture tiles which were rendered with their old texels after the
+  // image had changed, while their new textures were prepared.
+  unsigned long long texture_stale_hits;
+
+  // the tiles which were requested ahead of time for the predicted view,
+  // those which were used, those which were needed before they were ready
+  // and those which were dropped unused.
+  unsigned long long prefetch_requests;
+  unsigned long long prefetch_hits;
+  unsigned long long prefetch_late;
+  unsigned long long prefetch_unused;
+} view3d_stats;
+
+JUTZE3D_API void view3d_get_stats (view3d_stats* out);
+
 // --------------------------------------------------------------------------
 // create a new 3D view window
 // use standard win32 functions to
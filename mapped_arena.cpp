@@ -0,0 +1,289 @@
+
+#include <new>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+#ifdef WIN32
+  #include <windows.h>
+  #include <winioctl.h>
+#else
+  #include <sys/mman.h>
+  #include <unistd.h>
+  #include <fcntl.h>
+#endif
+
+#include "mapped_arena.hpp"
+
+// state bits of each chunk.
+enum
+{
+  chunk_resident = 1 << 0,
+  chunk_referenced = 1 << 1,
+  chunk_committed = 1 << 2
+};
+
+constexpr size_t mapped_arena::chunk_size;
+constexpr size_t mapped_arena::alignment;
+
+mapped_arena::mapped_arena (const std::string& dir, size_t capacity, size_t resident_budget)
+: m_resident_budget (resident_budget)
+{
+  m_capacity = std::max<size_t> (alignment, (capacity + alignment - 1) / alignment * alignment);
+
+#ifdef WIN32
+  std::string d = dir;
+  if (d.empty ())
+  {
+    char tmp_dir[MAX_PATH + 1];
+    if (GetTempPathA (sizeof (tmp_dir), tmp_dir) == 0)
+      throw std::runtime_error ("mapped_arena: can't get temp directory");
+    d = tmp_dir;
+  }
+
+  char name[MAX_PATH + 1];
+  if (GetTempFileNameA (d.c_str (), "3dv", 0, name) == 0)
+    throw std::runtime_error ("mapped_arena: can't create file in " + d);
+
+  HANDLE f = CreateFileA (name, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+			  FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+  if (f == INVALID_HANDLE_VALUE)
+    throw std::runtime_error (std::string ("mapped_arena: can't open ") + name);
+
+  // if the file system doesn't support sparse files, the file will take up
+  // the whole disk space, but it still works.
+  DWORD bytes_returned;
+  DeviceIoControl (f, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytes_returned, nullptr);
+
+  LARGE_INTEGER sz;
+  sz.QuadPart = (LONGLONG)m_capacity;
+  HANDLE m = nullptr;
+
+  if (SetFilePointerEx (f, sz, nullptr, FILE_BEGIN) && SetEndOfFile (f))
+    m = CreateFileMappingA (f, nullptr, PAGE_READWRITE,
+			    (DWORD)((uint64_t)m_capacity >> 32), (DWORD)m_capacity, nullptr);
+
+  void* p = m != nullptr ? MapViewOfFile (m, FILE_MAP_ALL_ACCESS, 0, 0, m_capacity) : nullptr;
+  if (p == nullptr)
+  {
+    if (m != nullptr)
+      CloseHandle (m);
+    CloseHandle (f);
+    throw std::runtime_error ("mapped_arena: can't map file");
+  }
+
+  m_file = f;
+  m_mapping = m;
+  m_base = (uint8_t*)p;
+
+#else
+  std::string d = dir;
+  if (d.empty ())
+  {
+    const char* tmp_dir = std::getenv ("TMPDIR");
+    d = tmp_dir != nullptr ? tmp_dir : "/tmp";
+  }
+
+  std::string name = d + "/3dview_XXXXXX";
+  m_fd = mkstemp (&name[0]);
+  if (m_fd < 0)
+    throw std::runtime_error ("mapped_arena: can't create file in " + d);
+
+  // nobody else needs to see the file.  it's deleted when it's closed.
+  unlink (name.c_str ());
+
+  // extending the file with ftruncate doesn't allocate any disk space.
+  void* p = MAP_FAILED;
+  if (ftruncate (m_fd, (off_t)m_capacity) == 0)
+    p = mmap (nullptr, m_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+
+  if (p == MAP_FAILED)
+  {
+    close (m_fd);
+    throw std::runtime_error ("mapped_arena: can't map file");
+  }
+
+  // the tiles are accessed in no particular order.  read-ahead of the
+  // neighbouring pages is mostly wasted.
+  madvise (p, m_capacity, MADV_RANDOM);
+
+  m_base = (uint8_t*)p;
+#endif
+
+  m_chunk_state.resize ((m_capacity + chunk_size - 1) / chunk_size, 0);
+
+  std::cout << "mapped_arena " << (m_capacity >> 20) << " MByte"
+	    << " in " << d
+	    << ", resident budget " << (m_resident_budget >> 20) << " MByte"
+	    << std::endl;
+}
+
+mapped_arena::mapped_arena (size_t capacity)
+: m_anonymous (true)
+{
+  m_capacity = std::max<size_t> (alignment, (capacity + alignment - 1) / alignment * alignment);
+
+#ifdef WIN32
+  // the chunks are committed when they are touched.
+  void* p = VirtualAlloc (nullptr, m_capacity, MEM_RESERVE, PAGE_NOACCESS);
+  if (p == nullptr)
+    throw std::bad_alloc ();
+#else
+  void* p = mmap (nullptr, m_capacity, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::bad_alloc ();
+#endif
+
+  m_base = (uint8_t*)p;
+  m_chunk_state.resize ((m_capacity + chunk_size - 1) / chunk_size, 0);
+}
+
+mapped_arena::~mapped_arena (void)
+{
+#ifdef WIN32
+  if (m_anonymous)
+    VirtualFree (m_base, 0, MEM_RELEASE);
+  else
+  {
+    UnmapViewOfFile (m_base);
+    CloseHandle ((HANDLE)m_mapping);
+    CloseHandle ((HANDLE)m_file);
+  }
+#else
+  munmap (m_base, m_capacity);
+  if (!m_anonymous)
+    close (m_fd);
+#endif
+}
+
+size_t mapped_arena::resident (void) const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return std::min (m_num_resident * chunk_size, m_capacity);
+}
+
+void* mapped_arena::allocate (size_t size)
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  size_t sz = (size + alignment - 1) / alignment * alignment;
+  if (sz > m_capacity - m_used)
+    throw std::bad_alloc ();
+
+  void* p = m_base + m_used;
+  m_used += sz;
+  return p;
+}
+
+void mapped_arena::release_chunk (size_t i)
+{
+  uint8_t* p = m_base + i * chunk_size;
+  size_t sz = std::min (chunk_size, m_capacity - i * chunk_size);
+
+#ifdef WIN32
+  // unlocking pages which are not locked removes them from the working set.
+  VirtualUnlock (p, sz);
+#else
+  // for a shared file mapping the contents are kept in the file.
+  madvise (p, sz, MADV_DONTNEED);
+#endif
+}
+
+void mapped_arena::discard (void* ptr, size_t size)
+{
+  // only whole pages can be released.
+  const size_t page_size = 4096;
+  const size_t offset = (uint8_t*)ptr - m_base;
+  const size_t begin = (offset + page_size - 1) / page_size * page_size;
+  const size_t end = std::min (offset + size, m_capacity) / page_size * page_size;
+
+  if ((uint8_t*)ptr < m_base || begin >= end)
+    return;
+
+#ifdef WIN32
+  if (m_anonymous)
+    VirtualAlloc (m_base + begin, end - begin, MEM_RESET, PAGE_READWRITE);
+  else
+    VirtualUnlock (m_base + begin, end - begin);
+#else
+  madvise (m_base + begin, end - begin, MADV_DONTNEED);
+#endif
+}
+
+void mapped_arena::touch (const void* ptr, size_t size)
+{
+#ifdef WIN32
+  const bool track = m_resident_budget != 0 || m_anonymous;
+#else
+  const bool track = m_resident_budget != 0;
+#endif
+
+  if (!track || size == 0
+      || (const uint8_t*)ptr < m_base || (const uint8_t*)ptr >= m_base + m_capacity)
+    return;
+
+  const size_t offset = (const uint8_t*)ptr - m_base;
+  const size_t first = offset / chunk_size;
+  const size_t last = std::min ((offset + size - 1) / chunk_size, m_chunk_state.size () - 1);
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  bool fault_in = false;
+
+  for (size_t i = first; i <= last; ++i)
+  {
+    auto& st = m_chunk_state[i];
+
+#ifdef WIN32
+    if (m_anonymous && !(st & chunk_committed))
+    {
+      if (VirtualAlloc (m_base + i * chunk_size, std::min (chunk_size, m_capacity - i * chunk_size),
+			MEM_COMMIT, PAGE_READWRITE) == nullptr)
+	throw std::bad_alloc ();
+      st |= chunk_committed;
+    }
+#endif
+
+    if (!(st & chunk_resident))
+    {
+      m_num_resident += 1;
+      fault_in = true;
+    }
+    st |= chunk_resident | chunk_referenced;
+  }
+
+#ifndef WIN32
+  // the range is needed right away.  start reading it in one go instead of
+  // page by page on the page faults.
+  if (fault_in && !m_anonymous)
+  {
+    const size_t page_size = 4096;
+    const size_t begin = offset / page_size * page_size;
+    madvise (m_base + begin, std::min (offset + size, m_capacity) - begin, MADV_WILLNEED);
+  }
+#else
+  (void)fault_in;
+#endif
+
+  // release the chunks which haven't been touched since the clock hand
+  // passed them the last time.
+  const size_t budget_chunks = std::max<size_t> (1, m_resident_budget / chunk_size);
+
+  while (m_resident_budget != 0 && m_num_resident > budget_chunks)
+  {
+    auto& st = m_chunk_state[m_clock_hand];
+
+    if (st & chunk_referenced)
+      st &= ~chunk_referenced;
+    else if (st & chunk_resident)
+    {
+      release_chunk (m_clock_hand);
+      st &= ~chunk_resident;
+      m_num_resident -= 1;
+    }
+
+    m_clock_hand = (m_clock_hand + 1) % m_chunk_state.size ();
+  }
+}
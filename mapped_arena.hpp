@@ -0,0 +1,99 @@
+#ifndef includeguard_mapped_arena_hpp_includeguard
+#define includeguard_mapped_arena_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <mutex>
+
+// a memory arena which is backed by a temporary file that is mapped into
+// memory.  the file is sparse, so only the parts that have been written
+// take up disk space.  the file is deleted when the arena is destroyed.
+//
+// an arena can also be anonymous (not file backed).  then the memory is
+// only reserved and physical memory is allocated when the memory is
+// accessed the first time.  unaccessed memory reads as zero.  anonymous
+// arenas have no resident budget.
+//
+// the arena keeps track of which chunks of the memory have been accessed
+// recently.  if more than 'resident_budget' bytes have been accessed, the
+// least recently used chunks are released from physical memory (the
+// contents are kept in the file).  this keeps the resident set of the
+// process bounded, even if the arena is much larger than the physical
+// memory.
+//
+// users of the arena have to announce accesses with 'touch'.  accessing
+// memory without announcing it is OK, but the chunks are not accounted for
+// and might be released while they are being used, which is slow but not
+// incorrect.
+
+class mapped_arena
+{
+public:
+  // the granularity of the resident memory tracking.
+  static constexpr size_t chunk_size = 1 << 20;
+
+  // allocations are aligned to this.
+  static constexpr size_t alignment = 64 * 1024;
+
+  // create the file in 'dir' with 'capacity' bytes.  if 'dir' is empty the
+  // system's temporary directory is used.  a 'resident_budget' of 0 means
+  // unlimited.  throws std::runtime_error if the file can't be created or
+  // mapped.
+  mapped_arena (const std::string& dir, size_t capacity, size_t resident_budget);
+
+  // create an anonymous arena.  throws std::bad_alloc if the address space
+  // can't be reserved.
+  explicit mapped_arena (size_t capacity);
+
+  ~mapped_arena (void);
+
+  mapped_arena (const mapped_arena&) = delete;
+  mapped_arena& operator = (const mapped_arena&) = delete;
+
+  size_t capacity (void) const { return m_capacity; }
+  size_t resident_budget (void) const { return m_resident_budget; }
+
+  // the amount of memory that has been accessed and not released since.
+  size_t resident (void) const;
+
+  // allocate a block of memory from the arena.  the memory is initially
+  // zero.  throws std::bad_alloc if the arena is full.
+  void* allocate (size_t size);
+
+  // announce an access to the memory range.  might release other chunks.
+  // for anonymous arenas on windows, this commits the memory, so the memory
+  // must not be accessed without calling this first.
+  // can be called from multiple threads.
+  void touch (const void* ptr, size_t size);
+
+  // release the physical memory of the range.  the contents of the range
+  // are undefined afterwards.  the range must be announced with 'touch'
+  // before it is used again.
+  void discard (void* ptr, size_t size);
+
+private:
+  uint8_t* m_base = nullptr;
+  size_t m_capacity = 0;
+  size_t m_used = 0;
+  size_t m_resident_budget = 0;
+  bool m_anonymous = false;
+
+#ifdef WIN32
+  void* m_file = nullptr;
+  void* m_mapping = nullptr;
+#else
+  int m_fd = -1;
+#endif
+
+  // clock (second chance) replacement of the chunks.
+  mutable std::mutex m_mutex;
+  std::vector<uint8_t> m_chunk_state;
+  size_t m_num_resident = 0;
+  size_t m_clock_hand = 0;
+
+  void release_chunk (size_t i);
+};
+
+#endif // includeguard_mapped_arena_hpp_includeguard
@@ -0,0 +1,113 @@
+
+#include <algorithm>
+
+#include "minmax_pyramid.hpp"
+#include "cpu_image.hpp"
+
+using utils::vec2;
+
+minmax_pyramid::minmax_pyramid (const vec2<unsigned int>& size)
+: m_size (size)
+{
+  if (empty ())
+    return;
+
+  vec2<unsigned int> n = (size + (cell_size - 1)) / cell_size;
+
+  while (true)
+  {
+    m_level.emplace_back ((size_t)n.x * n.y, vec2<float> (0, 0));
+    m_level_size.push_back (n);
+
+    if (n.x == 1 && n.y == 1)
+      break;
+
+    n = (n + 1u) / 2u;
+  }
+}
+
+void minmax_pyramid::update (const cpu_image& img, const vec2<unsigned int>& tl,
+			     const vec2<unsigned int>& br)
+{
+  if (empty ())
+    return;
+
+  auto c_tl = std::min (tl / cell_size, m_level_size[0]);
+  auto c_br = std::min ((br + (cell_size - 1)) / cell_size, m_level_size[0]);
+
+  if (c_tl.x >= c_br.x || c_tl.y >= c_br.y)
+    return;
+
+  for (unsigned int y = c_tl.y; y < c_br.y; ++y)
+    for (unsigned int x = c_tl.x; x < c_br.x; ++x)
+    {
+      const vec2<unsigned int> c (x, y);
+      m_level[0][x + y * m_level_size[0].x] = img.min_max (c * cell_size, c * cell_size + cell_size);
+    }
+
+  for (unsigned int k = 1; k < m_level.size (); ++k)
+  {
+    c_tl = c_tl / 2u;
+    c_br = (c_br + 1u) / 2u;
+
+    const auto& below = m_level[k - 1];
+    const auto& below_size = m_level_size[k - 1];
+
+    for (unsigned int y = c_tl.y; y < c_br.y; ++y)
+      for (unsigned int x = c_tl.x; x < c_br.x; ++x)
+      {
+	const unsigned int x1 = std::min (x * 2 + 2, below_size.x);
+	const unsigned int y1 = std::min (y * 2 + 2, below_size.y);
+
+	vec2<float> r = below[x * 2 + y * 2 * below_size.x];
+
+	for (unsigned int yy = y * 2; yy < y1; ++yy)
+	  for (unsigned int xx = x * 2; xx < x1; ++xx)
+	  {
+	    const auto& v = below[xx + yy * below_size.x];
+	    r.x = std::min (r.x, v.x);
+	    r.y = std::max (r.y, v.y);
+	  }
+
+	m_level[k][x + y * m_level_size[k].x] = r;
+      }
+  }
+}
+
+vec2<float> minmax_pyramid::range (const vec2<unsigned int>& tl,
+				   const vec2<unsigned int>& br) const
+{
+  if (empty ())
+    return { 0, 0 };
+
+  auto c_tl = std::min (tl / cell_size, m_level_size[0]);
+  auto c_br = std::min ((br + (cell_size - 1)) / cell_size, m_level_size[0]);
+
+  if (c_tl.x >= c_br.x || c_tl.y >= c_br.y)
+    return { 0, 0 };
+
+  // go up until the area spans at most 2 nodes in each direction.
+  unsigned int k = 0;
+
+  while (k + 1 < m_level.size () && (c_br.x - c_tl.x > 2 || c_br.y - c_tl.y > 2))
+  {
+    c_tl = c_tl / 2u;
+    c_br = (c_br + 1u) / 2u;
+    k += 1;
+  }
+
+  const auto& lvl = m_level[k];
+  const unsigned int stride = m_level_size[k].x;
+
+  vec2<float> r = lvl[c_tl.x + c_tl.y * stride];
+
+  for (unsigned int y = c_tl.y; y < c_br.y; ++y)
+    for (unsigned int x = c_tl.x; x < c_br.x; ++x)
+    {
+      const auto& v = lvl[x + y * stride];
+      r.x = std::min (r.x, v.x);
+      r.y = std::max (r.y, v.y);
+    }
+
+  return r;
+}
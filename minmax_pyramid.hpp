@@ -0,0 +1,55 @@
+#ifndef includeguard_minmax_pyramid_hpp_includeguard
+#define includeguard_minmax_pyramid_hpp_includeguard
+
+#include <vector>
+
+#include "utils/vec_mat.hpp"
+
+class cpu_image;
+
+// the minimum and maximum pixel values of a single channel image on
+// multiple scales, for finding the value range of any area in constant time.
+//
+// level 0 holds the range of each cell of cell_size x cell_size pixels.
+// each node of the next level holds the range of 2x2 nodes of the level
+// below, up to a single node for the whole image.
+//
+// the ranges are (min, max) in the units of the stored pixel values.
+//
+// all coordinates are in pixels of the image.
+
+class minmax_pyramid
+{
+public:
+  static constexpr unsigned int cell_size = 32;
+
+  minmax_pyramid (void) = default;
+
+  // all values are initially zero, like the pixels of a new cpu_image.
+  explicit minmax_pyramid (const utils::vec2<unsigned int>& size);
+
+  const utils::vec2<unsigned int>& size (void) const { return m_size; }
+  bool empty (void) const { return m_size.x == 0 || m_size.y == 0; }
+
+  // recalculate the ranges of the cells which intersect the area (tl, br)
+  // from the pixels of 'img' and update the levels above.
+  void update (const cpu_image& img, const utils::vec2<unsigned int>& tl,
+	       const utils::vec2<unsigned int>& br);
+
+  // the range of the values in the area (tl, br).  the area is clipped to
+  // the image.  the range is looked up from at most 2x2 nodes of the level
+  // whose nodes are at least half as large as the area.  thus it contains
+  // all values of the area, but also those of some pixels around it.
+  // an empty area has the range (0, 0).
+  utils::vec2<float> range (const utils::vec2<unsigned int>& tl,
+			    const utils::vec2<unsigned int>& br) const;
+
+private:
+  utils::vec2<unsigned int> m_size = { 0 };
+
+  // the nodes of each level, row by row.
+  std::vector<std::vector<utils::vec2<float>>> m_level;
+  std::vector<utils::vec2<unsigned int>> m_level_size;
+};
+
+#endif // includeguard_minmax_pyramid_hpp_includeguard
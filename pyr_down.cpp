@@ -0,0 +1,911 @@
+
+#include <cstdint>
+#include <utility>
+
+#include "pyr_down.hpp"
+
+#if defined (__i386__) || defined (__x86_64__) || defined (_M_IX86) || defined (_M_X64)
+  #define PYR_DOWN_X86 1
+  #include <immintrin.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>
+  #endif
+#endif
+
+// the simd kernels are compiled for their instruction set individually, so
+// that the rest of the program doesn't need to be built for it.
+#if defined (__GNUC__)
+  #define PYR_DOWN_TARGET(x) __attribute__ ((target (x)))
+#else
+  #define PYR_DOWN_TARGET(x)
+#endif
+
+using img::pixel_format;
+
+namespace pyr_down
+{
+
+// ----------------------------------------------------------------------------
+// scalar kernels.  they define the results of the simd kernels, which are
+// also used to process the remaining pixels at the end of each row.
+//
+//   integer formats:  (a + b + c + d + 2) / 4
+//   float formats:    ((a + c) + (b + d)) * 0.25, with a,b from the top row
+//                     and c,d from the bottom row.
+//   r5_g6_b5:         each channel like an integer format.
+//
+// the converting kernels average in the source format and convert the result:
+//
+//   rgba8 -> r5_g6_b5:  round (v * (2^n - 1) / 255) for n bits.
+//   r32f -> r16ui:      clamped to 0 .. 65535 and rounded half up.  NaN is 0.
+//
+// notice that the evaluation order of the float version must not be changed,
+// or the simd kernels will produce different results.
+
+static inline void
+rgba8_row_scalar (const uint8_t* s0, const uint8_t* s1, uint8_t* d,
+		  unsigned int x, unsigned int w)
+{
+  for (; x < w; ++x)
+    for (unsigned int c = 0; c < 4; ++c)
+      d[x*4 + c] = (uint8_t)((s0[x*8 + c] + s0[x*8 + 4 + c]
+			      + s1[x*8 + c] + s1[x*8 + 4 + c] + 2) >> 2);
+}
+
+static inline void
+r16ui_row_scalar (const uint16_t* s0, const uint16_t* s1, uint16_t* d,
+		  unsigned int x, unsigned int w)
+{
+  for (; x < w; ++x)
+    d[x] = (uint16_t)(((uint32_t)s0[x*2 + 0] + s0[x*2 + 1]
+		       + s1[x*2 + 0] + s1[x*2 + 1] + 2) >> 2);
+}
+
+static inline void
+r32f_row_scalar (const float* s0, const float* s1, float* d,
+		 unsigned int x, unsigned int w)
+{
+  for (; x < w; ++x)
+    d[x] = ((s0[x*2 + 0] + s1[x*2 + 0]) + (s0[x*2 + 1] + s1[x*2 + 1])) * 0.25f;
+}
+
+static inline void
+r5_g6_b5_row_scalar (const uint16_t* s0, const uint16_t* s1, uint16_t* d,
+		     unsigned int x, unsigned int w)
+{
+  for (; x < w; ++x)
+  {
+    const unsigned int a = s0[x*2 + 0], b = s0[x*2 + 1];
+    const unsigned int c = s1[x*2 + 0], e = s1[x*2 + 1];
+
+    auto avg = [&] (unsigned int shift, unsigned int mask)
+    {
+      return ((((a >> shift) & mask) + ((b >> shift) & mask)
+	       + ((c >> shift) & mask) + ((e >> shift) & mask) + 2) >> 2) << shift;
+    };
+
+    d[x] = (uint16_t)(avg (11, 31) | avg (5, 63) | avg (0, 31));
+  }
+}
+
+// round (v * max / 255) for v = 0 .. 255 and max < 256.
+static inline unsigned int unorm8_to_bits (unsigned int v, unsigned int max)
+{
+  const unsigned int t = v * max + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static inline void
+rgba8_r5_g6_b5_row_scalar (const uint8_t* s0, const uint8_t* s1, uint16_t* d,
+			   unsigned int x, unsigned int w)
+{
+  for (; x < w; ++x)
+  {
+    unsigned int v[3];
+    for (unsigned int c = 0; c < 3; ++c)
+      v[c] = (s0[x*8 + c] + s0[x*8 + 4 + c] + s1[x*8 + c] + s1[x*8 + 4 + c] + 2) >> 2;
+
+    d[x] = (uint16_t)((unorm8_to_bits (v[0], 31) << 11)
+		      | (unorm8_to_bits (v[1], 63) << 5)
+		      | unorm8_to_bits (v[2], 31));
+  }
+}
+
+static inline uint16_t float_to_r16ui (float v)
+{
+  v = v > 0.0f ? v : 0.0f;
+  v = v < 65535.0f ? v : 65535.0f;
+  return (uint16_t)(int32_t)(v + 0.5f);
+}
+
+static inline void
+r32f_r16ui_row_scalar (const float* s0, const float* s1, uint16_t* d,
+		       unsigned int x, unsigned int w)
+{
+  for (; x < w; ++x)
+    d[x] = float_to_r16ui (((s0[x*2 + 0] + s1[x*2 + 0]) + (s0[x*2 + 1] + s1[x*2 + 1])) * 0.25f);
+}
+
+template <typename S, typename D,
+	  void (*RowFunc) (const S*, const S*, D*, unsigned int, unsigned int)>
+static void
+kernel_scalar (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	       unsigned int w, unsigned int h)
+{
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const S*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const S*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (D*)((char*)dst + y * dst_bpl);
+
+    RowFunc (s0, s1, d, 0, w);
+  }
+}
+
+#ifdef PYR_DOWN_X86
+
+// ----------------------------------------------------------------------------
+// SSE2 kernels
+
+PYR_DOWN_TARGET ("sse2") static void
+rgba8_sse2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	    unsigned int w, unsigned int h)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i two = _mm_set1_epi16 (2);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint8_t*)src + (y*2 + 0) * src_bpl;
+    auto s1 = (const uint8_t*)src + (y*2 + 1) * src_bpl;
+    auto d = (uint8_t*)dst + y * dst_bpl;
+
+    unsigned int x = 0;
+
+    // 8 source pixels per row -> 4 destination pixels.
+    for (; x + 4 <= w; x += 4)
+    {
+      __m128i a0 = _mm_loadu_si128 ((const __m128i*)(s0 + x*8));
+      __m128i a1 = _mm_loadu_si128 ((const __m128i*)(s0 + x*8 + 16));
+      __m128i b0 = _mm_loadu_si128 ((const __m128i*)(s1 + x*8));
+      __m128i b1 = _mm_loadu_si128 ((const __m128i*)(s1 + x*8 + 16));
+
+      // vertical sums as 16 bit values, 2 source pixels per register.
+      __m128i v01 = _mm_add_epi16 (_mm_unpacklo_epi8 (a0, zero), _mm_unpacklo_epi8 (b0, zero));
+      __m128i v23 = _mm_add_epi16 (_mm_unpackhi_epi8 (a0, zero), _mm_unpackhi_epi8 (b0, zero));
+      __m128i v45 = _mm_add_epi16 (_mm_unpacklo_epi8 (a1, zero), _mm_unpacklo_epi8 (b1, zero));
+      __m128i v67 = _mm_add_epi16 (_mm_unpackhi_epi8 (a1, zero), _mm_unpackhi_epi8 (b1, zero));
+
+      // horizontal sums of neighbouring source pixels.
+      __m128i d01 = _mm_add_epi16 (_mm_unpacklo_epi64 (v01, v23), _mm_unpackhi_epi64 (v01, v23));
+      __m128i d23 = _mm_add_epi16 (_mm_unpacklo_epi64 (v45, v67), _mm_unpackhi_epi64 (v45, v67));
+
+      d01 = _mm_srli_epi16 (_mm_add_epi16 (d01, two), 2);
+      d23 = _mm_srli_epi16 (_mm_add_epi16 (d23, two), 2);
+
+      _mm_storeu_si128 ((__m128i*)(d + x*4), _mm_packus_epi16 (d01, d23));
+    }
+
+    rgba8_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+PYR_DOWN_TARGET ("sse2") static void
+r16ui_sse2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	    unsigned int w, unsigned int h)
+{
+  const __m128i lo_mask = _mm_set1_epi32 (0xFFFF);
+  const __m128i two = _mm_set1_epi32 (2);
+  const __m128i bias32 = _mm_set1_epi32 (0x8000);
+  const __m128i bias16 = _mm_set1_epi16 ((short)0x8000);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint16_t*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const uint16_t*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 16 source pixels per row -> 8 destination pixels.
+    for (; x + 8 <= w; x += 8)
+    {
+      __m128i a0 = _mm_loadu_si128 ((const __m128i*)(s0 + x*2));
+      __m128i a1 = _mm_loadu_si128 ((const __m128i*)(s0 + x*2 + 8));
+      __m128i b0 = _mm_loadu_si128 ((const __m128i*)(s1 + x*2));
+      __m128i b1 = _mm_loadu_si128 ((const __m128i*)(s1 + x*2 + 8));
+
+      // horizontal sums of pixel pairs as 32 bit values.
+      __m128i lo = _mm_add_epi32 (_mm_add_epi32 (_mm_and_si128 (a0, lo_mask), _mm_srli_epi32 (a0, 16)),
+				  _mm_add_epi32 (_mm_and_si128 (b0, lo_mask), _mm_srli_epi32 (b0, 16)));
+      __m128i hi = _mm_add_epi32 (_mm_add_epi32 (_mm_and_si128 (a1, lo_mask), _mm_srli_epi32 (a1, 16)),
+				  _mm_add_epi32 (_mm_and_si128 (b1, lo_mask), _mm_srli_epi32 (b1, 16)));
+
+      lo = _mm_srli_epi32 (_mm_add_epi32 (lo, two), 2);
+      hi = _mm_srli_epi32 (_mm_add_epi32 (hi, two), 2);
+
+      // there is no unsigned 32 -> 16 bit pack in SSE2.  the values are
+      // max. 0xFFFF, so bias them into the signed range and back.
+      __m128i r = _mm_packs_epi32 (_mm_sub_epi32 (lo, bias32), _mm_sub_epi32 (hi, bias32));
+      _mm_storeu_si128 ((__m128i*)(d + x), _mm_xor_si128 (r, bias16));
+    }
+
+    r16ui_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+PYR_DOWN_TARGET ("sse2") static void
+r32f_sse2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	   unsigned int w, unsigned int h)
+{
+  const __m128 quarter = _mm_set1_ps (0.25f);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const float*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const float*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (float*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 8 source pixels per row -> 4 destination pixels.
+    for (; x + 4 <= w; x += 4)
+    {
+      __m128 v0 = _mm_add_ps (_mm_loadu_ps (s0 + x*2), _mm_loadu_ps (s1 + x*2));
+      __m128 v1 = _mm_add_ps (_mm_loadu_ps (s0 + x*2 + 4), _mm_loadu_ps (s1 + x*2 + 4));
+
+      __m128 even = _mm_shuffle_ps (v0, v1, _MM_SHUFFLE (2, 0, 2, 0));
+      __m128 odd = _mm_shuffle_ps (v0, v1, _MM_SHUFFLE (3, 1, 3, 1));
+
+      _mm_storeu_ps (d + x, _mm_mul_ps (_mm_add_ps (even, odd), quarter));
+    }
+
+    r32f_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+// average one channel of r5_g6_b5 pixels.  the horizontal sums of the pixel
+// pairs are done by madd as 32 bit values.
+PYR_DOWN_TARGET ("sse2") static inline __m128i
+r5_g6_b5_channel_sse2 (__m128i a0, __m128i a1, __m128i b0, __m128i b1,
+		       int shift, unsigned int mask)
+{
+  const __m128i ones = _mm_set1_epi16 (1);
+  const __m128i two = _mm_set1_epi32 (2);
+  const __m128i m = _mm_set1_epi16 ((short)mask);
+
+  __m128i v0 = _mm_add_epi16 (_mm_and_si128 (_mm_srli_epi16 (a0, shift), m),
+			      _mm_and_si128 (_mm_srli_epi16 (b0, shift), m));
+  __m128i v1 = _mm_add_epi16 (_mm_and_si128 (_mm_srli_epi16 (a1, shift), m),
+			      _mm_and_si128 (_mm_srli_epi16 (b1, shift), m));
+
+  __m128i lo = _mm_srli_epi32 (_mm_add_epi32 (_mm_madd_epi16 (v0, ones), two), 2);
+  __m128i hi = _mm_srli_epi32 (_mm_add_epi32 (_mm_madd_epi16 (v1, ones), two), 2);
+
+  return _mm_slli_epi16 (_mm_packs_epi32 (lo, hi), shift);
+}
+
+PYR_DOWN_TARGET ("sse2") static void
+r5_g6_b5_sse2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	       unsigned int w, unsigned int h)
+{
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint16_t*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const uint16_t*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 16 source pixels per row -> 8 destination pixels.
+    for (; x + 8 <= w; x += 8)
+    {
+      __m128i a0 = _mm_loadu_si128 ((const __m128i*)(s0 + x*2));
+      __m128i a1 = _mm_loadu_si128 ((const __m128i*)(s0 + x*2 + 8));
+      __m128i b0 = _mm_loadu_si128 ((const __m128i*)(s1 + x*2));
+      __m128i b1 = _mm_loadu_si128 ((const __m128i*)(s1 + x*2 + 8));
+
+      __m128i r = _mm_or_si128 (_mm_or_si128 (r5_g6_b5_channel_sse2 (a0, a1, b0, b1, 11, 31),
+					      r5_g6_b5_channel_sse2 (a0, a1, b0, b1, 5, 63)),
+				r5_g6_b5_channel_sse2 (a0, a1, b0, b1, 0, 31));
+      _mm_storeu_si128 ((__m128i*)(d + x), r);
+    }
+
+    r5_g6_b5_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+// convert 2 rgba8 pixels with 16 bit channels to r5_g6_b5.  the results are
+// in the low 16 bits of each 64 bit half.
+PYR_DOWN_TARGET ("sse2") static inline __m128i
+rgba8_to_r5_g6_b5_sse2 (__m128i v)
+{
+  const __m128i round = _mm_set1_epi16 (128);
+  const __m128i bits_max = _mm_setr_epi16 (31, 63, 31, 0, 31, 63, 31, 0);
+  const __m128i bits_pos = _mm_setr_epi16 (1 << 11, 1 << 5, 1, 0, 1 << 11, 1 << 5, 1, 0);
+
+  __m128i t = _mm_add_epi16 (_mm_mullo_epi16 (v, bits_max), round);
+  t = _mm_srli_epi16 (_mm_add_epi16 (t, _mm_srli_epi16 (t, 8)), 8);
+  t = _mm_mullo_epi16 (t, bits_pos);
+
+  return _mm_or_si128 (_mm_or_si128 (t, _mm_srli_epi64 (t, 16)), _mm_srli_epi64 (t, 32));
+}
+
+PYR_DOWN_TARGET ("sse2") static void
+rgba8_r5_g6_b5_sse2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+		     unsigned int w, unsigned int h)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i two = _mm_set1_epi16 (2);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint8_t*)src + (y*2 + 0) * src_bpl;
+    auto s1 = (const uint8_t*)src + (y*2 + 1) * src_bpl;
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 8 source pixels per row -> 4 destination pixels.
+    for (; x + 4 <= w; x += 4)
+    {
+      __m128i a0 = _mm_loadu_si128 ((const __m128i*)(s0 + x*8));
+      __m128i a1 = _mm_loadu_si128 ((const __m128i*)(s0 + x*8 + 16));
+      __m128i b0 = _mm_loadu_si128 ((const __m128i*)(s1 + x*8));
+      __m128i b1 = _mm_loadu_si128 ((const __m128i*)(s1 + x*8 + 16));
+
+      // the same averaging as rgba8_sse2.
+      __m128i v01 = _mm_add_epi16 (_mm_unpacklo_epi8 (a0, zero), _mm_unpacklo_epi8 (b0, zero));
+      __m128i v23 = _mm_add_epi16 (_mm_unpackhi_epi8 (a0, zero), _mm_unpackhi_epi8 (b0, zero));
+      __m128i v45 = _mm_add_epi16 (_mm_unpacklo_epi8 (a1, zero), _mm_unpacklo_epi8 (b1, zero));
+      __m128i v67 = _mm_add_epi16 (_mm_unpackhi_epi8 (a1, zero), _mm_unpackhi_epi8 (b1, zero));
+
+      __m128i d01 = _mm_add_epi16 (_mm_unpacklo_epi64 (v01, v23), _mm_unpackhi_epi64 (v01, v23));
+      __m128i d23 = _mm_add_epi16 (_mm_unpacklo_epi64 (v45, v67), _mm_unpackhi_epi64 (v45, v67));
+
+      d01 = rgba8_to_r5_g6_b5_sse2 (_mm_srli_epi16 (_mm_add_epi16 (d01, two), 2));
+      d23 = rgba8_to_r5_g6_b5_sse2 (_mm_srli_epi16 (_mm_add_epi16 (d23, two), 2));
+
+      // gather the 4 results as 32 bit values and pack them.  the sign
+      // extension makes the signed pack keep the 16 bit values as they are.
+      __m128i r = _mm_unpacklo_epi64 (_mm_shuffle_epi32 (d01, _MM_SHUFFLE (3, 1, 2, 0)),
+				      _mm_shuffle_epi32 (d23, _MM_SHUFFLE (3, 1, 2, 0)));
+      r = _mm_srai_epi32 (_mm_slli_epi32 (r, 16), 16);
+
+      _mm_storel_epi64 ((__m128i*)(d + x), _mm_packs_epi32 (r, r));
+    }
+
+    rgba8_r5_g6_b5_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+// 8 source pixels of each row -> 4 destination pixels as 32 bit integers.
+// notice that max returns the second operand if the first one is NaN.
+PYR_DOWN_TARGET ("sse2") static inline __m128i
+r32f_r16ui_avg_sse2 (const float* s0, const float* s1)
+{
+  const __m128 quarter = _mm_set1_ps (0.25f);
+  const __m128 zero = _mm_setzero_ps ();
+  const __m128 max_val = _mm_set1_ps (65535.0f);
+  const __m128 half = _mm_set1_ps (0.5f);
+
+  __m128 v0 = _mm_add_ps (_mm_loadu_ps (s0), _mm_loadu_ps (s1));
+  __m128 v1 = _mm_add_ps (_mm_loadu_ps (s0 + 4), _mm_loadu_ps (s1 + 4));
+
+  __m128 even = _mm_shuffle_ps (v0, v1, _MM_SHUFFLE (2, 0, 2, 0));
+  __m128 odd = _mm_shuffle_ps (v0, v1, _MM_SHUFFLE (3, 1, 3, 1));
+
+  __m128 r = _mm_mul_ps (_mm_add_ps (even, odd), quarter);
+  r = _mm_min_ps (_mm_max_ps (r, zero), max_val);
+
+  return _mm_cvttps_epi32 (_mm_add_ps (r, half));
+}
+
+PYR_DOWN_TARGET ("sse2") static void
+r32f_r16ui_sse2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+		 unsigned int w, unsigned int h)
+{
+  const __m128i bias32 = _mm_set1_epi32 (0x8000);
+  const __m128i bias16 = _mm_set1_epi16 ((short)0x8000);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const float*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const float*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 16 source pixels per row -> 8 destination pixels.
+    for (; x + 8 <= w; x += 8)
+    {
+      __m128i lo = r32f_r16ui_avg_sse2 (s0 + x*2, s1 + x*2);
+      __m128i hi = r32f_r16ui_avg_sse2 (s0 + x*2 + 8, s1 + x*2 + 8);
+
+      __m128i r = _mm_packs_epi32 (_mm_sub_epi32 (lo, bias32), _mm_sub_epi32 (hi, bias32));
+      _mm_storeu_si128 ((__m128i*)(d + x), _mm_xor_si128 (r, bias16));
+    }
+
+    r32f_r16ui_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+// ----------------------------------------------------------------------------
+// AVX2 kernels
+// notice that most AVX2 operations work on two independent 128 bit lanes,
+// so the results have to be permuted back into the right order.
+
+PYR_DOWN_TARGET ("avx2") static void
+rgba8_avx2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	    unsigned int w, unsigned int h)
+{
+  const __m256i two = _mm256_set1_epi16 (2);
+  const __m256i order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint8_t*)src + (y*2 + 0) * src_bpl;
+    auto s1 = (const uint8_t*)src + (y*2 + 1) * src_bpl;
+    auto d = (uint8_t*)dst + y * dst_bpl;
+
+    unsigned int x = 0;
+
+    // 16 source pixels per row -> 8 destination pixels.
+    for (; x + 8 <= w; x += 8)
+    {
+      __m256i a0 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*8));
+      __m256i a1 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*8 + 32));
+      __m256i b0 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*8));
+      __m256i b1 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*8 + 32));
+
+      // vertical sums as 16 bit values.
+      // v0: (px0 px1 | px2 px3)  v1: (px4 px5 | px6 px7)  etc.
+      __m256i v0 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (a0)),
+				     _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (b0)));
+      __m256i v1 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (a0, 1)),
+				     _mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (b0, 1)));
+      __m256i v2 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (a1)),
+				     _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (b1)));
+      __m256i v3 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (a1, 1)),
+				     _mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (b1, 1)));
+
+      // horizontal sums.
+      // d0: (dst0 dst2 | dst1 dst3)  d1: (dst4 dst6 | dst5 dst7)
+      __m256i d0 = _mm256_add_epi16 (_mm256_unpacklo_epi64 (v0, v1), _mm256_unpackhi_epi64 (v0, v1));
+      __m256i d1 = _mm256_add_epi16 (_mm256_unpacklo_epi64 (v2, v3), _mm256_unpackhi_epi64 (v2, v3));
+
+      d0 = _mm256_srli_epi16 (_mm256_add_epi16 (d0, two), 2);
+      d1 = _mm256_srli_epi16 (_mm256_add_epi16 (d1, two), 2);
+
+      // packed: (dst0 dst2 dst4 dst6 | dst1 dst3 dst5 dst7)
+      __m256i r = _mm256_permutevar8x32_epi32 (_mm256_packus_epi16 (d0, d1), order);
+      _mm256_storeu_si256 ((__m256i*)(d + x*4), r);
+    }
+
+    rgba8_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+PYR_DOWN_TARGET ("avx2") static void
+r16ui_avx2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	    unsigned int w, unsigned int h)
+{
+  const __m256i lo_mask = _mm256_set1_epi32 (0xFFFF);
+  const __m256i two = _mm256_set1_epi32 (2);
+  const __m256i bias32 = _mm256_set1_epi32 (0x8000);
+  const __m256i bias16 = _mm256_set1_epi16 ((short)0x8000);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint16_t*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const uint16_t*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 32 source pixels per row -> 16 destination pixels.
+    for (; x + 16 <= w; x += 16)
+    {
+      __m256i a0 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*2));
+      __m256i a1 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*2 + 16));
+      __m256i b0 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*2));
+      __m256i b1 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*2 + 16));
+
+      // lo: (dst0..3 | dst4..7)  hi: (dst8..11 | dst12..15)
+      __m256i lo = _mm256_add_epi32 (_mm256_add_epi32 (_mm256_and_si256 (a0, lo_mask), _mm256_srli_epi32 (a0, 16)),
+				     _mm256_add_epi32 (_mm256_and_si256 (b0, lo_mask), _mm256_srli_epi32 (b0, 16)));
+      __m256i hi = _mm256_add_epi32 (_mm256_add_epi32 (_mm256_and_si256 (a1, lo_mask), _mm256_srli_epi32 (a1, 16)),
+				     _mm256_add_epi32 (_mm256_and_si256 (b1, lo_mask), _mm256_srli_epi32 (b1, 16)));
+
+      lo = _mm256_srli_epi32 (_mm256_add_epi32 (lo, two), 2);
+      hi = _mm256_srli_epi32 (_mm256_add_epi32 (hi, two), 2);
+
+      // packed: (dst0..3 dst8..11 | dst4..7 dst12..15)
+      __m256i r = _mm256_packs_epi32 (_mm256_sub_epi32 (lo, bias32), _mm256_sub_epi32 (hi, bias32));
+      r = _mm256_permute4x64_epi64 (_mm256_xor_si256 (r, bias16), _MM_SHUFFLE (3, 1, 2, 0));
+      _mm256_storeu_si256 ((__m256i*)(d + x), r);
+    }
+
+    r16ui_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+PYR_DOWN_TARGET ("avx2") static void
+r32f_avx2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	   unsigned int w, unsigned int h)
+{
+  const __m256 quarter = _mm256_set1_ps (0.25f);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const float*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const float*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (float*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 16 source pixels per row -> 8 destination pixels.
+    for (; x + 8 <= w; x += 8)
+    {
+      __m256 v0 = _mm256_add_ps (_mm256_loadu_ps (s0 + x*2), _mm256_loadu_ps (s1 + x*2));
+      __m256 v1 = _mm256_add_ps (_mm256_loadu_ps (s0 + x*2 + 8), _mm256_loadu_ps (s1 + x*2 + 8));
+
+      __m256 even = _mm256_shuffle_ps (v0, v1, _MM_SHUFFLE (2, 0, 2, 0));
+      __m256 odd = _mm256_shuffle_ps (v0, v1, _MM_SHUFFLE (3, 1, 3, 1));
+
+      // sum: (dst0 dst1 dst4 dst5 | dst2 dst3 dst6 dst7)
+      __m256 r = _mm256_mul_ps (_mm256_add_ps (even, odd), quarter);
+      r = _mm256_castpd_ps (_mm256_permute4x64_pd (_mm256_castps_pd (r), _MM_SHUFFLE (3, 1, 2, 0)));
+      _mm256_storeu_ps (d + x, r);
+    }
+
+    r32f_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+// see r5_g6_b5_channel_sse2.
+// packed: (dst0..3 dst8..11 | dst4..7 dst12..15)
+PYR_DOWN_TARGET ("avx2") static inline __m256i
+r5_g6_b5_channel_avx2 (__m256i a0, __m256i a1, __m256i b0, __m256i b1,
+		       int shift, unsigned int mask)
+{
+  const __m256i ones = _mm256_set1_epi16 (1);
+  const __m256i two = _mm256_set1_epi32 (2);
+  const __m256i m = _mm256_set1_epi16 ((short)mask);
+
+  __m256i v0 = _mm256_add_epi16 (_mm256_and_si256 (_mm256_srli_epi16 (a0, shift), m),
+				 _mm256_and_si256 (_mm256_srli_epi16 (b0, shift), m));
+  __m256i v1 = _mm256_add_epi16 (_mm256_and_si256 (_mm256_srli_epi16 (a1, shift), m),
+				 _mm256_and_si256 (_mm256_srli_epi16 (b1, shift), m));
+
+  __m256i lo = _mm256_srli_epi32 (_mm256_add_epi32 (_mm256_madd_epi16 (v0, ones), two), 2);
+  __m256i hi = _mm256_srli_epi32 (_mm256_add_epi32 (_mm256_madd_epi16 (v1, ones), two), 2);
+
+  return _mm256_slli_epi16 (_mm256_packs_epi32 (lo, hi), shift);
+}
+
+PYR_DOWN_TARGET ("avx2") static void
+r5_g6_b5_avx2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+	       unsigned int w, unsigned int h)
+{
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint16_t*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const uint16_t*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 32 source pixels per row -> 16 destination pixels.
+    for (; x + 16 <= w; x += 16)
+    {
+      __m256i a0 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*2));
+      __m256i a1 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*2 + 16));
+      __m256i b0 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*2));
+      __m256i b1 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*2 + 16));
+
+      __m256i r = _mm256_or_si256 (_mm256_or_si256 (r5_g6_b5_channel_avx2 (a0, a1, b0, b1, 11, 31),
+						    r5_g6_b5_channel_avx2 (a0, a1, b0, b1, 5, 63)),
+				   r5_g6_b5_channel_avx2 (a0, a1, b0, b1, 0, 31));
+      r = _mm256_permute4x64_epi64 (r, _MM_SHUFFLE (3, 1, 2, 0));
+      _mm256_storeu_si256 ((__m256i*)(d + x), r);
+    }
+
+    r5_g6_b5_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+// see rgba8_to_r5_g6_b5_sse2.
+PYR_DOWN_TARGET ("avx2") static inline __m256i
+rgba8_to_r5_g6_b5_avx2 (__m256i v)
+{
+  const __m256i round = _mm256_set1_epi16 (128);
+  const __m256i bits_max = _mm256_setr_epi16 (31, 63, 31, 0, 31, 63, 31, 0,
+					      31, 63, 31, 0, 31, 63, 31, 0);
+  const __m256i bits_pos = _mm256_setr_epi16 (1 << 11, 1 << 5, 1, 0, 1 << 11, 1 << 5, 1, 0,
+					      1 << 11, 1 << 5, 1, 0, 1 << 11, 1 << 5, 1, 0);
+
+  __m256i t = _mm256_add_epi16 (_mm256_mullo_epi16 (v, bits_max), round);
+  t = _mm256_srli_epi16 (_mm256_add_epi16 (t, _mm256_srli_epi16 (t, 8)), 8);
+  t = _mm256_mullo_epi16 (t, bits_pos);
+
+  return _mm256_or_si256 (_mm256_or_si256 (t, _mm256_srli_epi64 (t, 16)),
+			  _mm256_srli_epi64 (t, 32));
+}
+
+PYR_DOWN_TARGET ("avx2") static void
+rgba8_r5_g6_b5_avx2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+		     unsigned int w, unsigned int h)
+{
+  const __m256i two = _mm256_set1_epi16 (2);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const uint8_t*)src + (y*2 + 0) * src_bpl;
+    auto s1 = (const uint8_t*)src + (y*2 + 1) * src_bpl;
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 16 source pixels per row -> 8 destination pixels.
+    for (; x + 8 <= w; x += 8)
+    {
+      __m256i a0 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*8));
+      __m256i a1 = _mm256_loadu_si256 ((const __m256i*)(s0 + x*8 + 32));
+      __m256i b0 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*8));
+      __m256i b1 = _mm256_loadu_si256 ((const __m256i*)(s1 + x*8 + 32));
+
+      // the same averaging as rgba8_avx2.
+      __m256i v0 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (a0)),
+				     _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (b0)));
+      __m256i v1 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (a0, 1)),
+				     _mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (b0, 1)));
+      __m256i v2 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (a1)),
+				     _mm256_cvtepu8_epi16 (_mm256_castsi256_si128 (b1)));
+      __m256i v3 = _mm256_add_epi16 (_mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (a1, 1)),
+				     _mm256_cvtepu8_epi16 (_mm256_extracti128_si256 (b1, 1)));
+
+      // d0: (dst0 dst2 | dst1 dst3)  d1: (dst4 dst6 | dst5 dst7)
+      __m256i d0 = _mm256_add_epi16 (_mm256_unpacklo_epi64 (v0, v1), _mm256_unpackhi_epi64 (v0, v1));
+      __m256i d1 = _mm256_add_epi16 (_mm256_unpacklo_epi64 (v2, v3), _mm256_unpackhi_epi64 (v2, v3));
+
+      d0 = rgba8_to_r5_g6_b5_avx2 (_mm256_srli_epi16 (_mm256_add_epi16 (d0, two), 2));
+      d1 = rgba8_to_r5_g6_b5_avx2 (_mm256_srli_epi16 (_mm256_add_epi16 (d1, two), 2));
+
+      // 32 bit values: (dst0 dst2 dst4 dst6 | dst1 dst3 dst5 dst7)
+      __m256i r = _mm256_unpacklo_epi64 (_mm256_shuffle_epi32 (d0, _MM_SHUFFLE (3, 1, 2, 0)),
+					 _mm256_shuffle_epi32 (d1, _MM_SHUFFLE (3, 1, 2, 0)));
+      r = _mm256_srai_epi32 (_mm256_slli_epi32 (r, 16), 16);
+      r = _mm256_packs_epi32 (r, r);
+
+      _mm_storeu_si128 ((__m128i*)(d + x),
+			_mm_unpacklo_epi16 (_mm256_castsi256_si128 (r),
+					    _mm256_extracti128_si256 (r, 1)));
+    }
+
+    rgba8_r5_g6_b5_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+// 16 source pixels of each row -> 8 destination pixels as 32 bit integers
+// in the order (dst0 dst1 dst4 dst5 | dst2 dst3 dst6 dst7).
+PYR_DOWN_TARGET ("avx2") static inline __m256i
+r32f_r16ui_avg_avx2 (const float* s0, const float* s1)
+{
+  const __m256 quarter = _mm256_set1_ps (0.25f);
+  const __m256 zero = _mm256_setzero_ps ();
+  const __m256 max_val = _mm256_set1_ps (65535.0f);
+  const __m256 half = _mm256_set1_ps (0.5f);
+
+  __m256 v0 = _mm256_add_ps (_mm256_loadu_ps (s0), _mm256_loadu_ps (s1));
+  __m256 v1 = _mm256_add_ps (_mm256_loadu_ps (s0 + 8), _mm256_loadu_ps (s1 + 8));
+
+  __m256 even = _mm256_shuffle_ps (v0, v1, _MM_SHUFFLE (2, 0, 2, 0));
+  __m256 odd = _mm256_shuffle_ps (v0, v1, _MM_SHUFFLE (3, 1, 3, 1));
+
+  __m256 r = _mm256_mul_ps (_mm256_add_ps (even, odd), quarter);
+  r = _mm256_min_ps (_mm256_max_ps (r, zero), max_val);
+
+  return _mm256_cvttps_epi32 (_mm256_add_ps (r, half));
+}
+
+PYR_DOWN_TARGET ("avx2") static void
+r32f_r16ui_avx2 (const void* src, unsigned int src_bpl, void* dst, unsigned int dst_bpl,
+		 unsigned int w, unsigned int h)
+{
+  const __m256i bias32 = _mm256_set1_epi32 (0x8000);
+  const __m256i bias16 = _mm256_set1_epi16 ((short)0x8000);
+  const __m256i order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+
+  for (unsigned int y = 0; y < h; ++y)
+  {
+    auto s0 = (const float*)((const char*)src + (y*2 + 0) * src_bpl);
+    auto s1 = (const float*)((const char*)src + (y*2 + 1) * src_bpl);
+    auto d = (uint16_t*)((char*)dst + y * dst_bpl);
+
+    unsigned int x = 0;
+
+    // 32 source pixels per row -> 16 destination pixels.
+    for (; x + 16 <= w; x += 16)
+    {
+      __m256i lo = r32f_r16ui_avg_avx2 (s0 + x*2, s1 + x*2);
+      __m256i hi = r32f_r16ui_avg_avx2 (s0 + x*2 + 16, s1 + x*2 + 16);
+
+      // packed: (dst0 dst1 dst4 dst5 dst8 dst9 dst12 dst13 | dst2 dst3 dst6 dst7 ...)
+      __m256i r = _mm256_packs_epi32 (_mm256_sub_epi32 (lo, bias32), _mm256_sub_epi32 (hi, bias32));
+      r = _mm256_xor_si256 (r, bias16);
+
+      // 32 bit pairs: (0 1 | 4 5 | 8 9 | 12 13 || 2 3 | 6 7 | 10 11 | 14 15)
+      r = _mm256_permutevar8x32_epi32 (r, order);
+      _mm256_storeu_si256 ((__m256i*)(d + x), r);
+    }
+
+    r32f_r16ui_row_scalar (s0, s1, d, x, w);
+  }
+}
+
+#endif // PYR_DOWN_X86
+
+// ----------------------------------------------------------------------------
+
+const char* isa_name (isa i)
+{
+  switch (i)
+  {
+    case isa::scalar: return "scalar";
+    case isa::sse2: return "sse2";
+    case isa::avx2: return "avx2";
+    default: return "unknown";
+  }
+}
+
+static isa detect_isa (void)
+{
+#if defined (PYR_DOWN_X86) && defined (__GNUC__)
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    return isa::avx2;
+  if (__builtin_cpu_supports ("sse2"))
+    return isa::sse2;
+
+#elif defined (PYR_DOWN_X86) && defined (_MSC_VER)
+  int r[4];
+  __cpuid (r, 0);
+  const int max_leaf = r[0];
+
+  __cpuid (r, 1);
+  const bool sse2 = (r[3] & (1 << 26)) != 0;
+  const bool osxsave_avx = (r[2] & (1 << 27)) != 0 && (r[2] & (1 << 28)) != 0;
+
+  if (osxsave_avx && max_leaf >= 7 && (_xgetbv (0) & 6) == 6)
+  {
+    __cpuidex (r, 7, 0);
+    if ((r[1] & (1 << 5)) != 0)
+      return isa::avx2;
+  }
+  if (sse2)
+    return isa::sse2;
+#endif
+
+  return isa::scalar;
+}
+
+isa best_isa (void)
+{
+  static const isa val = detect_isa ();
+  return val;
+}
+
+kernel find_kernel (pixel_format pf, isa i)
+{
+  if (i > best_isa ())
+    return nullptr;
+
+  switch (pf)
+  {
+    case pixel_format::rgba8:
+      switch (i)
+      {
+	case isa::scalar: return kernel_scalar<uint8_t, uint8_t, rgba8_row_scalar>;
+#ifdef PYR_DOWN_X86
+	case isa::sse2: return rgba8_sse2;
+	case isa::avx2: return rgba8_avx2;
+#endif
+	default: return nullptr;
+      }
+
+    case pixel_format::r16ui:
+      switch (i)
+      {
+	case isa::scalar: return kernel_scalar<uint16_t, uint16_t, r16ui_row_scalar>;
+#ifdef PYR_DOWN_X86
+	case isa::sse2: return r16ui_sse2;
+	case isa::avx2: return r16ui_avx2;
+#endif
+	default: return nullptr;
+      }
+
+    case pixel_format::r32f:
+      switch (i)
+      {
+	case isa::scalar: return kernel_scalar<float, float, r32f_row_scalar>;
+#ifdef PYR_DOWN_X86
+	case isa::sse2: return r32f_sse2;
+	case isa::avx2: return r32f_avx2;
+#endif
+	default: return nullptr;
+      }
+
+    case pixel_format::r5_g6_b5:
+      switch (i)
+      {
+	case isa::scalar: return kernel_scalar<uint16_t, uint16_t, r5_g6_b5_row_scalar>;
+#ifdef PYR_DOWN_X86
+	case isa::sse2: return r5_g6_b5_sse2;
+	case isa::avx2: return r5_g6_b5_avx2;
+#endif
+	default: return nullptr;
+      }
+
+    default:
+      return nullptr;
+  }
+}
+
+kernel find_kernel (pixel_format src_pf, pixel_format dst_pf, isa i)
+{
+  if (src_pf == dst_pf)
+    return find_kernel (src_pf, i);
+
+  if (i > best_isa ())
+    return nullptr;
+
+  if (src_pf == pixel_format::rgba8 && dst_pf == pixel_format::r5_g6_b5)
+    switch (i)
+    {
+      case isa::scalar: return kernel_scalar<uint8_t, uint16_t, rgba8_r5_g6_b5_row_scalar>;
+#ifdef PYR_DOWN_X86
+      case isa::sse2: return rgba8_r5_g6_b5_sse2;
+      case isa::avx2: return rgba8_r5_g6_b5_avx2;
+#endif
+      default: return nullptr;
+    }
+
+  if (src_pf == pixel_format::r32f && dst_pf == pixel_format::r16ui)
+    switch (i)
+    {
+      case isa::scalar: return kernel_scalar<float, uint16_t, r32f_r16ui_row_scalar>;
+#ifdef PYR_DOWN_X86
+      case isa::sse2: return r32f_r16ui_sse2;
+      case isa::avx2: return r32f_r16ui_avx2;
+#endif
+      default: return nullptr;
+    }
+
+  return nullptr;
+}
+
+void reduce (const img::image& src, img::image&& dst)
+{
+  auto k = find_kernel (src.format (), dst.format ());
+
+  if (k == nullptr
+      || src.size ().x < dst.size ().x * 2 || src.size ().y < dst.size ().y * 2)
+  {
+    if (src.format () == dst.format ())
+      src.pyr_down_to (std::move (dst));
+    else
+    {
+      // reduce and convert separately.
+      img::image tmp (src.format (), dst.size ());
+      src.pyr_down_to (tmp);
+      tmp.copy_to (dst, { 0, 0 });
+    }
+    return;
+  }
+
+  k (src.data (), src.bytes_per_line (), dst.data (), dst.bytes_per_line (),
+     dst.size ().x, dst.size ().y);
+}
+
+} // namespace pyr_down
@@ -0,0 +1,56 @@
+#ifndef includeguard_pyr_down_hpp_includeguard
+#define includeguard_pyr_down_hpp_includeguard
+
+#include "img/image.hpp"
+
+// 2x2 averaging kernels for building the mipmap pyramid.
+// there is a dedicated kernel for every pixel format the pyramid uses.  each
+// kernel has a scalar version and simd versions, which are selected at runtime
+// depending on what the cpu supports.  the simd versions produce exactly the
+// same results as the scalar version.
+// some kernels also convert the pixel format for storing the lower detail
+// levels in a more compact format.
+// formats without a dedicated kernel fall back to img::image::pyr_down_to.
+
+namespace pyr_down
+{
+
+enum class isa
+{
+  scalar = 0,
+  sse2,
+  avx2,
+
+  count
+};
+
+const char* isa_name (isa i);
+
+// the best instruction set supported by the cpu.  determined once at runtime.
+isa best_isa (void);
+
+// a kernel reduces a source region of (dst_width*2) x (dst_height*2) pixels
+// into a destination region of dst_width x dst_height pixels.
+// source and destination have the pixel formats the kernel was made for.
+typedef void (*kernel) (const void* src, unsigned int src_bytes_per_line,
+			void* dst, unsigned int dst_bytes_per_line,
+			unsigned int dst_width, unsigned int dst_height);
+
+// returns nullptr if there is no kernel for the pixel format and instruction
+// set.  requesting an instruction set which is not supported by the cpu
+// also returns nullptr.
+kernel find_kernel (img::pixel_format pf, isa i = best_isa ());
+
+// the same for a kernel which converts from 'src_pf' to 'dst_pf'.  there
+// are kernels for rgba8 -> r5_g6_b5 and r32f -> r16ui.
+kernel find_kernel (img::pixel_format src_pf, img::pixel_format dst_pf,
+		    isa i = best_isa ());
+
+// reduce 'src' into 'dst' with the best available kernel.  the size of
+// 'src' must be at least 2x the size of 'dst'.  if the pixel formats are
+// different, the pixels are converted.
+void reduce (const img::image& src, img::image&& dst);
+
+} // namespace pyr_down
+
+#endif // includeguard_pyr_down_hpp_includeguard
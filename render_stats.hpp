@@ -0,0 +1,107 @@
+#ifndef includeguard_render_stats_hpp_includeguard
+#define includeguard_render_stats_hpp_includeguard
+
+#include <cstdint>
+#include <atomic>
+
+// counters of what the viewer is doing.  they are written by the render
+// thread and by the image updates and can be read from any other thread at
+// any time.  all accesses are relaxed atomic operations, which are cheap
+// enough to keep the counters enabled in release builds.  the values of
+// one frame are not read consistently with each other.
+//
+// the 'last_...' counters are of the last frame or update.  the others are
+// totals, unless noted otherwise.
+
+struct render_stats
+{
+  typedef std::atomic<uint64_t> counter;
+
+  // the detail levels beyond this are counted in the last entry.
+  static constexpr unsigned int max_lod_levels = 16;
+
+  // frames.
+  counter num_frames { 0 };
+  counter last_frame_usec { 0 };
+
+  // the tile selection of the last frame.  the visible tiles per detail
+  // level (0 = full resolution) and the number of tiles which were tested
+  // for visibility.
+  counter last_visible_tiles[max_lod_levels] = { };
+  counter last_candidate_tiles { 0 };
+  counter last_missing_tiles { 0 };
+
+  // the texture cache.  one lookup per visible tile and frame, also with
+  // the wireframe on.
+  counter texture_cache_hits { 0 };
+  counter texture_cache_misses { 0 };
+  counter texture_cache_evictions { 0 };
+
+  // the lookups of cached tiles whose texels have changed and which are
+  // drawn with the old textures while they are refreshed.
+  counter texture_stale_hits { 0 };
+
+  // the missing and prefetched tiles which were uploaded from the staging
+  // tier of the texture cache without preparing them again.
+  counter texture_staging_hits { 0 };
+
+  // current values.  the prefetch requests of the texture cache, see
+  // tile_cache::prefetch_stats.
+  counter prefetch_requests { 0 };
+  counter prefetch_hits { 0 };
+  counter prefetch_late { 0 };
+  counter prefetch_unused { 0 };
+
+  counter upload_bytes { 0 };
+  counter last_upload_bytes { 0 };
+
+  // current values.  the graphics card memory of the texture cache, the
+  // memory of its staging tier and the cpu memory of the image's detail
+  // levels, uncompressed.
+  counter gpu_texture_bytes { 0 };
+  counter staged_texture_bytes { 0 };
+  counter cpu_image_bytes { 0 };
+
+  // current values.  the pinned texture tiles of the lower detail levels
+  // and those of them which are in the texture cache.
+  counter pinned_textures { 0 };
+  counter pinned_textures_cached { 0 };
+
+  // image updates.  the updated pixels and the time of the update calls.
+  // the pyramid time is the time of writing and reducing the detail
+  // levels, summed over the color and height images, which are updated in
+  // parallel.
+  counter num_updates { 0 };
+  counter ingest_pixels { 0 };
+  counter ingest_usec { 0 };
+  counter pyramid_usec { 0 };
+
+  // the prepared height textures which are not constant, those which are
+  // stored with fewer bits and the texture bytes saved by that.  the
+  // largest height error of a quantized texture so far, in millionths of
+  // the height unit.
+  counter height_textures { 0 };
+  counter quantized_height_textures { 0 };
+  counter quantized_height_bytes_saved { 0 };
+  counter max_height_error_millionths { 0 };
+
+  // the prepared color textures which are bc1 compressed, those which had
+  // to be encoded (the others were cached) and the time of encoding them,
+  // summed over the workers.
+  counter compressed_color_textures { 0 };
+  counter color_textures_encoded { 0 };
+  counter color_encode_usec { 0 };
+
+  static void add (counter& c, uint64_t val) { c.fetch_add (val, std::memory_order_relaxed); }
+  static void set (counter& c, uint64_t val) { c.store (val, std::memory_order_relaxed); }
+  static uint64_t get (const counter& c) { return c.load (std::memory_order_relaxed); }
+
+  static void set_max (counter& c, uint64_t val)
+  {
+    uint64_t cur = c.load (std::memory_order_relaxed);
+    while (cur < val && !c.compare_exchange_weak (cur, val, std::memory_order_relaxed))
+      ;
+  }
+};
+
+#endif // includeguard_render_stats_hpp_includeguard
@@ -4,10 +4,13 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <cmath>
 
 #include "test_scene1.hpp"
 #include "tiled_image.hpp"
 #include "simple_3dbox.hpp"
+#include "render_stats.hpp"
 
 #include "s_expr/s_expr.hpp"
 #include "utils/math.hpp"
@@ -50,7 +53,7 @@ test_scene1::test_scene1 (const char* file_desc_file)
       unsigned int w = i (1).as<unsigned int> ();
       unsigned int h = i (2).as<unsigned int> ();
       std::cout << "creating new image with size: " << w << " x " << h << std::endl;
-      m_image = std::make_unique<tiled_image> (vec2<unsigned int> (w, h), m_use_uint16_heightmap);
+      create_image ({ w, h });
 
       m_image->set_heightmap_palette (
       {
@@ -122,10 +125,171 @@ void test_scene1::reset_view (void)
 void test_scene1::resize_image (const vec2<unsigned int>& size)
 {
   std::cout << "creating new image with size: " << size.x << " x " << size.y << std::endl;
-  m_image = std::make_unique<tiled_image> (size, m_use_uint16_heightmap);
+  create_image (size);
   reset_view ();
 }
 
+void test_scene1::create_image (const vec2<unsigned int>& size)
+{
+  tiled_image::storage_params storage;
+  storage.layout = m_use_bricked_image_layout ? cpu_image::layout::bricked
+					      : cpu_image::layout::linear;
+  storage.file_backed = m_use_file_backed_image;
+  storage.backing_file_dir = m_backing_file_dir;
+  storage.resident_budget = m_resident_budget;
+  storage.compressed_tier_budget = m_compressed_tier_budget;
+
+  if (m_compact_levels_from > 0)
+  {
+    storage.level_formats.resize (tiled_image::lod_levels_for_size (size));
+
+    for (unsigned int i = m_compact_levels_from; i < storage.level_formats.size (); ++i)
+    {
+      storage.level_formats[i].color = img::pixel_format::r5_g6_b5;
+      storage.level_formats[i].height = img::pixel_format::r16ui;
+    }
+  }
+
+  // release the old image first, in case it's a huge one.
+  m_image = nullptr;
+  m_image = std::make_unique<tiled_image> (size, m_use_uint16_heightmap, storage);
+  m_image->set_lazy_mipmaps (m_use_lazy_mipmaps);
+  m_image->set_texture_upload_budget (m_upload_budget_bytes, m_upload_budget_seconds);
+  m_image->set_texture_cache_budget (m_texture_cache_budget);
+  m_image->set_texture_staging_budget (m_texture_staging_budget);
+  m_image->set_pinned_texture_levels (m_pinned_texture_levels);
+  m_image->set_max_height_error (m_max_height_error);
+  m_image->set_compressed_color_textures (m_compressed_color_textures);
+  m_image->set_texture_eviction_policy (m_texture_eviction_policy);
+  m_image->set_texture_trace (m_texture_trace);
+  m_image->set_stats (m_stats);
+}
+
+void test_scene1::set_stats (render_stats* val)
+{
+  m_stats = val;
+
+  if (m_image != nullptr)
+    m_image->set_stats (val);
+}
+
+void test_scene1::set_use_file_backed_image (bool val, const std::string& dir,
+					     size_t resident_budget)
+{
+  m_use_file_backed_image = val;
+  m_backing_file_dir = dir;
+  m_resident_budget = resident_budget;
+}
+
+void test_scene1::set_use_lazy_mipmaps (bool val)
+{
+  m_use_lazy_mipmaps = val;
+
+  if (m_image != nullptr)
+    m_image->set_lazy_mipmaps (val);
+}
+
+void test_scene1::set_texture_upload_budget (size_t max_bytes, double max_seconds)
+{
+  m_upload_budget_bytes = max_bytes;
+  m_upload_budget_seconds = max_seconds;
+
+  if (m_image != nullptr)
+    m_image->set_texture_upload_budget (max_bytes, max_seconds);
+}
+
+void test_scene1::set_texture_cache_budget (size_t val)
+{
+  m_texture_cache_budget = val;
+
+  if (m_image != nullptr)
+    m_image->set_texture_cache_budget (val);
+}
+
+void test_scene1::set_texture_staging_budget (size_t val)
+{
+  m_texture_staging_budget = val;
+
+  if (m_image != nullptr)
+    m_image->set_texture_staging_budget (val);
+}
+
+void test_scene1::set_pinned_texture_levels (unsigned int val)
+{
+  m_pinned_texture_levels = val;
+
+  if (m_image != nullptr)
+    m_image->set_pinned_texture_levels (val);
+}
+
+void test_scene1::set_max_height_error (float val)
+{
+  m_max_height_error = val;
+
+  if (m_image != nullptr)
+    m_image->set_max_height_error (val);
+}
+
+void test_scene1::set_compressed_color_textures (bool val)
+{
+  m_compressed_color_textures = val;
+
+  if (m_image != nullptr)
+    m_image->set_compressed_color_textures (val);
+}
+
+void test_scene1::set_texture_eviction_policy (eviction_policy::kind val)
+{
+  m_texture_eviction_policy = val;
+
+  if (m_image != nullptr)
+    m_image->set_texture_eviction_policy (val);
+}
+
+void test_scene1::set_texture_trace (const std::string& filename)
+{
+  m_texture_trace = filename;
+
+  if (m_image != nullptr)
+    m_image->set_texture_trace (filename);
+}
+
+void test_scene1::prefetch (const mat4<double>& viewport_trv, bool en_heightmap, double dt)
+{
+  // the mouse events don't arrive every frame.  smooth the velocity over a
+  // few frames and forget it after a pause.
+  if (dt > 0 && dt < 0.5)
+  {
+    const double k = std::min (1.0, dt / 0.1);
+    m_img_pos_velocity += ((m_img_pos - m_last_img_pos) / dt - m_img_pos_velocity) * k;
+    m_zoom_velocity += ((m_zoom - m_last_zoom) / dt - m_zoom_velocity) * k;
+  }
+  else
+  {
+    m_img_pos_velocity = { 0 };
+    m_zoom_velocity = 0;
+  }
+
+  m_last_img_pos = m_img_pos;
+  m_last_zoom = m_zoom;
+
+  // the image positions are in -1..+1 units.  below about a pixel there's
+  // nothing new to see.
+  auto&& pos_delta = m_img_pos_velocity * prefetch_lookahead;
+  const double zoom_delta = m_zoom_velocity * prefetch_lookahead;
+
+  if (!m_use_prefetch
+      || (std::abs (pos_delta.x) < 0.001 && std::abs (pos_delta.y) < 0.001
+	  && std::abs (zoom_delta) < 0.001))
+    return;
+
+  const float zoom = std::min (10.0f, std::max (-10.0f, m_zoom + (float)zoom_delta));
+
+  // a smaller zoom value is closer to the image.
+  m_image->prefetch (calc_cam_trv (zoom, m_tilt_angle, m_img_pos + pos_delta),
+		     m_last_proj_trv, viewport_trv, zoom_delta < 0, en_heightmap);
+}
+
 void test_scene1::set_tilt_angle (float val)
 {
   m_tilt_angle = std::min (80.0f, std::max (0.0f, val));
@@ -280,6 +444,20 @@ void test_scene1::render (unsigned int width, unsigned int height,
 
   m_last_screen_size = { width, height };
 
+  // the time since the last frame.  'delta_time' is not used for that,
+  // because it depends on how the caller measures it.
+  const auto now = std::chrono::steady_clock::now ();
+  const double dt = m_last_render_time != std::chrono::steady_clock::time_point ()
+		    ? std::chrono::duration<double> (now - m_last_render_time).count ()
+		    : 0.0;
+  m_last_render_time = now;
+
+  if (m_stats != nullptr)
+  {
+    render_stats::add (m_stats->num_frames, 1);
+    render_stats::set (m_stats->last_frame_usec, (uint64_t)(dt * 1000000));
+  }
+
   vec2<float> aspect = width > height
 		       ? vec2<float> (1, (float)width / -(float)height)
 		       : vec2<float> ((float)height / (float)width, -1);
@@ -309,6 +487,8 @@ void test_scene1::render (unsigned int width, unsigned int height,
     m_image->render (cam_trv, m_last_proj_trv, viewport_trv,
 		     en_wireframe, en_stairs_mode, en_debug_dist,
 		     en_heightmap);
+
+    prefetch (viewport_trv, en_heightmap, dt);
   }
 
   gl_check_log_error ();
@@ -4,10 +4,13 @@
 
 #include <chrono>
 #include <memory>
+#include <string>
 #include "utils/vec_mat.hpp"
+#include "eviction_policy.hpp"
 
 class tiled_image;
 class simple_3dbox;
+struct render_stats;
 
 class test_scene1
 {
@@ -57,6 +60,64 @@ public:
   void set_use_uint16_heightmap (bool val = true) { m_use_uint16_heightmap = val; }
   bool use_uint16_heightmap (void) const { return m_use_uint16_heightmap; }
 
+  void set_use_bricked_image_layout (bool val = true) { m_use_bricked_image_layout = val; }
+  bool use_bricked_image_layout (void) const { return m_use_bricked_image_layout; }
+
+  // see tiled_image::storage_params.
+  void set_use_file_backed_image (bool val, const std::string& dir = std::string (),
+				  size_t resident_budget = 0);
+  bool use_file_backed_image (void) const { return m_use_file_backed_image; }
+
+  // see tiled_image::storage_params.  0 = no compression.
+  void set_compressed_tier_budget (size_t val) { m_compressed_tier_budget = val; }
+  size_t compressed_tier_budget (void) const { return m_compressed_tier_budget; }
+
+  // the first detail level which is stored in compact formats (rgb565
+  // colors, r16ui heights).  0 = none.  see tiled_image::storage_params.
+  void set_compact_levels_from (unsigned int val) { m_compact_levels_from = val; }
+  unsigned int compact_levels_from (void) const { return m_compact_levels_from; }
+
+  void set_use_lazy_mipmaps (bool val = true);
+  bool use_lazy_mipmaps (void) const { return m_use_lazy_mipmaps; }
+
+  // see tiled_image::set_texture_upload_budget.
+  void set_texture_upload_budget (size_t max_bytes, double max_seconds);
+
+  // see tiled_image::set_texture_cache_budget.
+  void set_texture_cache_budget (size_t val);
+
+  // see tiled_image::set_texture_staging_budget.
+  void set_texture_staging_budget (size_t val);
+
+  // see tiled_image::set_pinned_texture_levels.
+  void set_pinned_texture_levels (unsigned int val);
+
+  // see tiled_image::set_max_height_error.
+  void set_max_height_error (float val);
+
+  // see tiled_image::set_compressed_color_textures.
+  void set_compressed_color_textures (bool val);
+
+  // see tiled_image::set_texture_eviction_policy.
+  void set_texture_eviction_policy (eviction_policy::kind val);
+
+  // see tiled_image::set_texture_trace.
+  void set_texture_trace (const std::string& filename);
+
+  // if enabled, the textures for the view which is expected after
+  // 'prefetch_lookahead' seconds of the current scrolling and zooming are
+  // requested ahead of time.  enabled by default.
+  void set_use_prefetch (bool val = true) { m_use_prefetch = val; }
+  bool use_prefetch (void) const { return m_use_prefetch; }
+
+  static constexpr double prefetch_lookahead = 0.3;
+
+  // count the frames and the rendering and updates of the images in 'val',
+  // which must outlive the scene or be replaced first.  null = no counting
+  // (the default).  see render_stats.
+  void set_stats (render_stats* val);
+  render_stats* stats (void) const { return m_stats; }
+
 private:
   std::unique_ptr<tiled_image> m_image;
   std::vector<simple_3dbox> m_boxes;
@@ -72,6 +133,59 @@ private:
   // with a 16 bit heightmap instead of 32 bit float heightmap.
   bool m_use_uint16_heightmap = false;
 
+  // if set to true, the next image creation/resize will create an image
+  // which stores the mipmap levels as bricks (texture tiles).
+  bool m_use_bricked_image_layout = false;
+
+  // if set to true, the next image creation/resize will create an image
+  // which is stored in a memory mapped file.
+  bool m_use_file_backed_image = false;
+  std::string m_backing_file_dir;
+  size_t m_resident_budget = 0;
+
+  // if not 0, the next image creation/resize will create an image which
+  // compresses the tiles which haven't been used recently.
+  size_t m_compressed_tier_budget = 0;
+
+  // if not 0, the next image creation/resize will create an image which
+  // stores the detail levels starting with this one in compact formats.
+  unsigned int m_compact_levels_from = 0;
+
+  // if set to true, the lower mipmap levels of the image are updated only
+  // when needed.  applies to the current image and the next images.
+  bool m_use_lazy_mipmaps = false;
+
+  // the limits of the texture uploads per frame.  applies to the current
+  // image and the next images.
+  size_t m_upload_budget_bytes = 0;
+  double m_upload_budget_seconds = 0.004;
+
+  // the gpu memory for the textures of the image.  applies to the current
+  // image and the next images.
+  size_t m_texture_cache_budget = 128 << 20;
+  size_t m_texture_staging_budget = 128 << 20;
+  unsigned int m_pinned_texture_levels = 5;
+
+  // the error of the height textures which are stored with fewer bits.
+  // applies to the current image and the next images.
+  float m_max_height_error = 0;
+  bool m_compressed_color_textures = false;
+  eviction_policy::kind m_texture_eviction_policy = eviction_policy::lru;
+  std::string m_texture_trace;
+
+  // the camera motion per second, smoothed over a few frames.  used to
+  // predict the view for prefetching.
+  bool m_use_prefetch = true;
+  utils::vec2<double> m_img_pos_velocity = { 0 };
+  double m_zoom_velocity = 0;
+  utils::vec2<double> m_last_img_pos = { 0 };
+  float m_last_zoom = 1;
+  std::chrono::steady_clock::time_point m_last_render_time;
+
+  render_stats* m_stats = nullptr;
+
+  void prefetch (const utils::mat4<double>& viewport_trv, bool en_heightmap, double dt);
+
   // example calibration data
   // XYZ size of 1 pixel = 18.3 x 18.3 x 1 micrometers
   float m_z_scale = 1.0f/18.3f;
@@ -83,6 +197,8 @@ private:
 
   unsigned int m_next_boxid = 0;
 
+  void create_image (const utils::vec2<unsigned int>& size);
+
   utils::mat4<double> calc_cam_trv (float zoom, float tilt_angle,
 				    const utils::vec2<double>& scroll) const;
 };
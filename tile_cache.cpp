@@ -0,0 +1,1162 @@
+
+#include <iostream>
+#include <exception>
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+
+#include "tile_cache.hpp"
+#include "worker_pool.hpp"
+#include "cpu_image.hpp"
+#include "bc1_codec.hpp"
+#include "render_stats.hpp"
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+  #define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+tile_cache::upload_budget::upload_budget (size_t max_bytes, double max_seconds)
+: m_max_bytes (max_bytes), m_has_deadline (max_seconds > 0)
+{
+  if (m_has_deadline)
+    m_deadline = std::chrono::steady_clock::now ()
+		 + std::chrono::duration_cast<std::chrono::steady_clock::duration> (
+			std::chrono::duration<double> (max_seconds));
+}
+
+bool tile_cache::upload_budget::exhausted (void) const
+{
+  if (m_max_bytes > 0 && m_bytes >= m_max_bytes)
+    return true;
+
+  return m_has_deadline && std::chrono::steady_clock::now () >= m_deadline;
+}
+
+// ----------------------------------------------------------------------------
+
+namespace
+{
+
+// binds a texture for uploading it and restores the texture which was bound
+// to the active unit before, e.g. a texture of the current frame.
+class scoped_texture_binding
+{
+public:
+  scoped_texture_binding (unsigned int name)
+  {
+    GLint prev = 0;
+    glGetIntegerv (GL_TEXTURE_BINDING_2D, &prev);
+    m_prev = (GLuint)prev;
+
+    glBindTexture (GL_TEXTURE_2D, name);
+  }
+
+  ~scoped_texture_binding (void)
+  {
+    glBindTexture (GL_TEXTURE_2D, m_prev);
+  }
+
+  scoped_texture_binding (const scoped_texture_binding&) = delete;
+  scoped_texture_binding& operator = (const scoped_texture_binding&) = delete;
+
+private:
+  GLuint m_prev;
+};
+
+} // anonymous namespace
+
+tile_cache::block_texture::block_texture (const utils::vec2<unsigned int>& size)
+: m_size (size)
+{
+  GLuint name = 0;
+  glGenTextures (1, &name);
+  m_name = name;
+
+  scoped_texture_binding binding (m_name);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+  const std::vector<uint8_t> zero (bc1_codec::encoded_size (size), 0);
+  glCompressedTexImage2D (GL_TEXTURE_2D, 0, GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+			  size.x, size.y, 0, (GLsizei)zero.size (), zero.data ());
+}
+
+tile_cache::block_texture::~block_texture (void)
+{
+  if (m_name != 0)
+  {
+    GLuint name = m_name;
+    glDeleteTextures (1, &name);
+  }
+}
+
+tile_cache::block_texture::block_texture (block_texture&& rhs)
+: m_name (rhs.m_name), m_size (rhs.m_size)
+{
+  rhs.m_name = 0;
+  rhs.m_size = { 0, 0 };
+}
+
+tile_cache::block_texture&
+tile_cache::block_texture::operator = (block_texture&& rhs)
+{
+  if (this != &rhs)
+  {
+    std::swap (m_name, rhs.m_name);
+    std::swap (m_size, rhs.m_size);
+  }
+  return *this;
+}
+
+bool tile_cache::block_texture::supported (void)
+{
+  static const bool val = [] (void)
+  {
+    const char* ext = (const char*)glGetString (GL_EXTENSIONS);
+    return ext != nullptr
+	   && (std::strstr (ext, "GL_EXT_texture_compression_s3tc") != nullptr
+	       || std::strstr (ext, "GL_EXT_texture_compression_dxt1") != nullptr);
+  } ();
+
+  return val;
+}
+
+void tile_cache::block_texture::upload (const uint8_t* blocks,
+					const utils::vec2<unsigned int>& pos,
+					const utils::vec2<unsigned int>& size)
+{
+  scoped_texture_binding binding (m_name);
+  glCompressedTexSubImage2D (GL_TEXTURE_2D, 0, pos.x, pos.y, size.x, size.y,
+			     GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+			     (GLsizei)bc1_codec::encoded_size (size), blocks);
+}
+
+void tile_cache::block_texture::bind (unsigned int unit) const
+{
+  glActiveTexture (GL_TEXTURE0 + unit);
+  glBindTexture (GL_TEXTURE_2D, m_name);
+}
+
+// ----------------------------------------------------------------------------
+
+void tile_cache::texel_rect::add (const utils::vec2<unsigned int>& a_tl,
+				  const utils::vec2<unsigned int>& a_br)
+{
+  if (empty ())
+  {
+    tl = a_tl;
+    br = a_br;
+  }
+  else
+  {
+    tl = std::min (tl, a_tl);
+    br = std::max (br, a_br);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+tile_cache::tile_cache (worker_pool& workers, prepare_func prepare, size_t max_bytes,
+			unsigned int tile_size)
+: m_workers (workers), m_prepare (std::move (prepare)), m_max_bytes (max_bytes),
+  m_tile_size (tile_size)
+{
+  m_slots_per_row = std::max (1u, page_size / tile_size);
+  m_policy = eviction_policy::create (eviction_policy::lru);
+}
+
+tile_cache::~tile_cache (void)
+{
+  // the posted jobs which haven't started yet find no request and return.
+  std::unique_lock<std::mutex> lock (m_mutex);
+  m_requests.clear ();
+  m_queue.clear ();
+  m_prefetch_queue.clear ();
+  m_idle.wait (lock, [this] (void) { return m_num_jobs == 0; });
+}
+
+void tile_cache::set_max_bytes (size_t val)
+{
+  m_max_bytes = val;
+  clear ();
+}
+
+void tile_cache::set_eviction_policy (eviction_policy::kind k, eviction_policy::cost_func cost)
+{
+  clear ();
+  m_policy = eviction_policy::create (k, std::move (cost));
+}
+
+void tile_cache::set_max_staged_bytes (size_t val)
+{
+  m_max_staged_bytes = val;
+
+  while (m_staged_bytes > m_max_staged_bytes)
+    unstage (m_staged.key (m_staged.lru_back ()));
+}
+
+size_t tile_cache::page_bytes (img::pixel_format format, bool compressed) const
+{
+  const utils::vec2<unsigned int> sz (page_texture_size ());
+
+  return compressed ? bc1_codec::encoded_size (sz)
+		    : cpu_image::storage_size (format, sz, cpu_image::layout::linear);
+}
+
+size_t tile_cache::page_bytes (void) const
+{
+  size_t r = 0;
+  for (auto&& p : m_pages)
+    r += page_bytes (p.format, p.compressed);
+
+  return r;
+}
+
+void tile_cache::begin_frame (void)
+{
+  // the constant textures are not deleted during a frame, because their
+  // slots are still in use.
+  if (m_num_constant_textures >= max_constant_textures)
+  {
+    m_constant_textures.clear ();
+    m_num_constant_textures = 0;
+  }
+
+  if (m_trace != nullptr)
+    *m_trace << "f\n";
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_frame += 1;
+}
+
+size_t tile_cache::num_requests (void) const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_requests.size () + m_staged_queue.size ();
+}
+
+tile_cache::prefetch_stats tile_cache::get_prefetch_stats (void) const
+{
+  std::lock_guard<std::mutex> lock (m_mutex);
+  return m_prefetch_stats;
+}
+
+tile_cache::slot tile_cache::make_slot (const texture_ref& t)
+{
+  slot s;
+  s.value_scale = t.value_scale;
+  s.value_offset = t.value_offset;
+
+  if (t.constant)
+    s.tex = &constant_texture (t.format, t.value);
+  else
+  {
+    if (t.compressed)
+      s.block_tex = &m_pages[t.page].block_tex;
+    else
+      s.tex = &m_pages[t.page].tex;
+
+    s.pos = utils::vec2<unsigned int> (t.slot % m_slots_per_row, t.slot / m_slots_per_row)
+	    * m_tile_size;
+  }
+
+  return s;
+}
+
+void tile_cache::use (tile_handle h, tile_slots& out)
+{
+  auto&& e = m_tiles[h];
+
+  if (e.evictable () && e.last_used != m_frame)
+    m_policy->touch (m_tiles.key (h), e.last_used + 1 != m_frame);
+
+  e.last_used = m_frame;
+
+  // the old texels are drawn until the refreshed ones are uploaded.
+  if (e.stale ())
+  {
+    if (m_stats != nullptr)
+      render_stats::add (m_stats->texture_stale_hits, 1);
+
+    if (!e.refresh_requested)
+    {
+      std::lock_guard<std::mutex> lock (m_mutex);
+      post_refresh (h);
+    }
+  }
+
+  for (unsigned int t = 0; t < textures_per_tile; ++t)
+    out[t] = make_slot (e.textures[t]);
+}
+
+bool tile_cache::get_cached (uint64_t key, tile_slots& out)
+{
+  const tile_handle h = m_tiles.find (key);
+  if (h == m_tiles.npos)
+    return false;
+
+  use (h, out);
+  return true;
+}
+
+bool tile_cache::get (uint64_t key, tile_slots& out)
+{
+  const tile_handle h = m_tiles.find (key);
+  if (h != m_tiles.npos)
+  {
+    if (m_tiles[h].prefetched)
+    {
+      m_tiles[h].prefetched = false;
+
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_prefetch_stats.num_hits += 1;
+    }
+
+    if (m_stats != nullptr)
+      render_stats::add (m_stats->texture_cache_hits, 1);
+
+    use (h, out);
+    return true;
+  }
+
+  if (m_stats != nullptr)
+    render_stats::add (m_stats->texture_cache_misses, 1);
+
+  request_missing (key);
+  return false;
+}
+
+void tile_cache::request_missing (uint64_t key)
+{
+  if (m_tiles.find (key) != m_tiles.npos || request_staged (key, false))
+    return;
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto r = m_requests.find (key);
+  if (r != m_requests.end ())
+  {
+    r->second.last_frame = m_frame;
+
+    // the prefetched or pinned tile is needed now.  move it to the front.
+    if (r->second.prefetch)
+    {
+      r->second.prefetch = false;
+      if (!r->second.pinned)
+	m_prefetch_stats.num_late += 1;
+
+      if (!r->second.started)
+	post_job (key, false);
+    }
+
+    return;
+  }
+
+  post_request (key, false);
+}
+
+void tile_cache::trace_use (uint64_t key)
+{
+  if (m_trace != nullptr)
+    *m_trace << std::hex << key << std::dec << "\n";
+}
+
+void tile_cache::prefetch (uint64_t key)
+{
+  if (m_tiles.find (key) != m_tiles.npos || request_staged (key, true))
+    return;
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto r = m_requests.find (key);
+  if (r != m_requests.end ())
+  {
+    r->second.last_frame = m_frame;
+    return;
+  }
+
+  post_request (key, true);
+  m_prefetch_stats.num_requests += 1;
+}
+
+void tile_cache::post_request (uint64_t key, bool prefetch)
+{
+  // m_mutex is locked.
+  auto&& r = m_requests[key];
+  r = request ();
+  r.serial = ++m_serial;
+  r.last_frame = m_frame;
+  r.prefetch = prefetch;
+
+  post_job (key, prefetch);
+}
+
+void tile_cache::post_refresh (tile_handle h)
+{
+  // m_mutex is locked.
+  auto&& e = m_tiles[h];
+  const uint64_t key = m_tiles.key (h);
+
+  post_request (key, false);
+
+  auto&& r = m_requests[key];
+  r.refresh = true;
+  for (unsigned int t = 0; t < textures_per_tile; ++t)
+    r.dirty[t] = e.textures[t].dirty;
+
+  e.refresh_requested = true;
+}
+
+void tile_cache::post_job (uint64_t key, bool prefetch)
+{
+  // m_mutex is locked.
+  (prefetch ? m_prefetch_queue : m_queue).push_back (key);
+  m_num_jobs += 1;
+
+  m_workers.post ([this] (void) { prepare_next (); });
+}
+
+void tile_cache::prepare_next (void)
+{
+  uint64_t key = 0;
+  uint64_t serial = 0;
+
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+
+    bool found = false;
+
+    while (!found && (!m_queue.empty () || !m_prefetch_queue.empty ()))
+    {
+      auto&& q = !m_queue.empty () ? m_queue : m_prefetch_queue;
+      key = q.front ();
+      q.pop_front ();
+
+      auto r = m_requests.find (key);
+      if (r == m_requests.end () || r->second.started)
+	continue;
+
+      // not needed anymore.
+      if (!r->second.refresh && !r->second.pinned
+	  && m_frame - r->second.last_frame > max_request_age)
+      {
+	if (r->second.prefetch)
+	  m_prefetch_stats.num_unused += 1;
+
+	m_requests.erase (r);
+	continue;
+      }
+
+      r->second.started = true;
+      serial = r->second.serial;
+      found = true;
+    }
+
+    if (!found)
+    {
+      if (--m_num_jobs == 0)
+	m_idle.notify_all ();
+      return;
+    }
+  }
+
+  result res;
+  res.key = key;
+  res.serial = serial;
+
+  bool ok = true;
+
+  try
+  {
+    m_prepare (key, res.data);
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "exception when preparing texture tile: " << e.what () << std::endl;
+    ok = false;
+  }
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto r = m_requests.find (key);
+  const bool valid = r != m_requests.end () && r->second.serial == serial;
+
+  if (!ok)
+  {
+    if (valid)
+      m_requests.erase (r);
+  }
+  else if (valid && r->second.prefetch)
+    m_prefetch_results.push_back (std::move (res));
+  else
+    m_results.push_back (std::move (res));
+
+  if (--m_num_jobs == 0)
+    m_idle.notify_all ();
+}
+
+bool tile_cache::upload_next (upload_budget& budget)
+{
+  // the staged tiles are ready before the prepared ones.
+  while (!m_staged_queue.empty () && !budget.exhausted ())
+  {
+    const uint64_t key = m_staged_queue.front ();
+    m_staged_queue.pop_front ();
+
+    const staged_handle s = m_staged.find (key);
+    if (s == m_staged.npos || !m_staged[s].queued)
+      continue;
+
+    auto&& st = m_staged[s];
+    st.queued = false;
+
+    if (m_tiles.find (key) != m_tiles.npos)
+      continue;
+
+    // not needed anymore.
+    if (m_frame - st.last_frame > max_request_age && m_pinned.find (key) == m_pinned.npos)
+    {
+      if (st.prefetch)
+      {
+	std::lock_guard<std::mutex> lock (m_mutex);
+	m_prefetch_stats.num_unused += 1;
+      }
+      continue;
+    }
+
+    m_staged.lru_push_front (s);
+    add (key, st.data, st.prefetch, budget);
+    return true;
+  }
+
+  result res;
+  request req;
+
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+
+    if ((m_results.empty () && m_prefetch_results.empty ()) || budget.exhausted ())
+      return false;
+
+    auto&& q = !m_results.empty () ? m_results : m_prefetch_results;
+    res = std::move (q.front ());
+    q.pop_front ();
+
+    // the tile has been erased while it was prepared.
+    auto r = m_requests.find (res.key);
+    if (r == m_requests.end () || r->second.serial != res.serial)
+      return true;
+
+    req = r->second;
+    m_requests.erase (r);
+  }
+
+  // a tile is only requested if it's not in the cache, unless it's
+  // refreshed.  if it has been evicted meanwhile, it's added again.
+  const tile_handle h = m_tiles.find (res.key);
+  if (h != m_tiles.npos)
+    refresh (h, res, req, budget);
+  else
+    add (res.key, res.data, req.prefetch, budget);
+
+  // the textures are prepared completely, also for refreshing.
+  stage (res.key, std::move (res.data));
+  return true;
+}
+
+void tile_cache::add (uint64_t key, const tile_data& data, bool prefetched,
+		      upload_budget& budget)
+{
+  tile_entry e;
+  e.uses_slots = false;
+  e.pinned = m_pinned.find (key) != m_pinned.npos;
+  e.prefetched = prefetched && !e.pinned;
+  e.last_used = m_frame;
+  e.refresh_requested = false;
+
+  for (unsigned int t = 0; t < textures_per_tile; ++t)
+  {
+    auto&& d = data[t];
+    auto&& tr = e.textures[t];
+
+    tr.format = d.format;
+    tr.constant = d.constant;
+    tr.value = d.value;
+    tr.compressed = d.compressed && !d.constant;
+    tr.value_scale = d.value_scale;
+    tr.value_offset = d.value_offset;
+    tr.page = 0;
+    tr.slot = 0;
+    tr.generation = d.generation;
+    tr.latest = d.generation;
+    tr.dirty = texel_rect ();
+
+    if (d.constant)
+      continue;
+
+    // the slots of the tile's other textures are not in the eviction
+    // policy yet and are not evicted.
+    auto&& s = allocate_slot (d.format, tr.compressed);
+    tr.page = s.first;
+    tr.slot = s.second;
+    e.uses_slots = true;
+
+    texel_rect r;
+    r.br = utils::vec2<unsigned int> (m_tile_size);
+    upload (tr, d, r, budget);
+  }
+
+  if (e.evictable ())
+    m_policy->insert (key);
+
+  if (e.pinned)
+    m_num_pinned_cached += 1;
+
+  m_tiles.insert (key, e);
+}
+
+bool tile_cache::request_staged (uint64_t key, bool prefetch)
+{
+  const staged_handle s = m_staged.find (key);
+  if (s == m_staged.npos)
+    return false;
+
+  auto&& st = m_staged[s];
+  st.last_frame = m_frame;
+
+  if (st.queued)
+  {
+    // the prefetched tile is needed now.
+    if (st.prefetch && !prefetch)
+    {
+      st.prefetch = false;
+
+      std::lock_guard<std::mutex> lock (m_mutex);
+      m_prefetch_stats.num_late += 1;
+    }
+    return true;
+  }
+
+  st.queued = true;
+  st.prefetch = prefetch;
+  m_staged_queue.push_back (key);
+
+  if (m_stats != nullptr)
+    render_stats::add (m_stats->texture_staging_hits, 1);
+
+  if (prefetch && m_pinned.find (key) == m_pinned.npos)
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_prefetch_stats.num_requests += 1;
+  }
+
+  return true;
+}
+
+void tile_cache::stage (uint64_t key, tile_data&& data)
+{
+  unstage (key);
+
+  // the size of an entry is counted too, so that the number of tiles with
+  // only constant textures is limited.
+  size_t bytes = sizeof (staged_tile);
+  for (auto&& d : data)
+    if (!d.constant)
+      bytes += d.compressed ? d.blocks.size ()
+			    : (size_t)d.pixels.bytes_per_line () * d.pixels.size ().y;
+
+  if (bytes > m_max_staged_bytes)
+    return;
+
+  while (m_staged_bytes + bytes > m_max_staged_bytes)
+    unstage (m_staged.key (m_staged.lru_back ()));
+
+  staged_tile st;
+  st.data = std::move (data);
+  st.bytes = bytes;
+
+  m_staged.lru_push_front (m_staged.insert (key, std::move (st)));
+  m_staged_bytes += bytes;
+}
+
+void tile_cache::unstage (uint64_t key)
+{
+  const staged_handle s = m_staged.find (key);
+  if (s == m_staged.npos)
+    return;
+
+  // a queued tile is requested again, if it's still needed.
+  m_staged_bytes -= m_staged[s].bytes;
+  m_staged.erase (s);
+}
+
+void tile_cache::refresh (tile_handle h, result& res, const request& req,
+			  upload_budget& budget)
+{
+  // the tile is not evicted when a slot is allocated for it.  evicting
+  // other tiles doesn't move the entry.
+  auto&& e = m_tiles[h];
+  const bool was_evictable = e.evictable ();
+  m_refreshing = h;
+
+  e.uses_slots = false;
+
+  for (unsigned int t = 0; t < textures_per_tile; ++t)
+  {
+    auto&& d = res.data[t];
+    auto&& tr = e.textures[t];
+
+    if (!req.dirty[t].empty ())
+    {
+      if (d.constant)
+      {
+	// the slot is not needed anymore.
+	if (!tr.constant)
+	  m_pages[tr.page].free_slots.push_back (tr.slot);
+
+	tr.format = d.format;
+	tr.constant = true;
+	tr.value = d.value;
+	tr.compressed = false;
+      }
+      else
+      {
+	// a constant texture or a texture in another format gets a new
+	// slot and is uploaded completely, like one whose texel values are
+	// mapped differently.  otherwise only the changed texels are
+	// uploaded.
+	texel_rect r = req.dirty[t];
+
+	if (tr.constant || tr.format != d.format || tr.compressed != d.compressed)
+	{
+	  if (!tr.constant)
+	    m_pages[tr.page].free_slots.push_back (tr.slot);
+
+	  auto&& s = allocate_slot (d.format, d.compressed);
+	  tr.format = d.format;
+	  tr.constant = false;
+	  tr.compressed = d.compressed;
+	  tr.page = s.first;
+	  tr.slot = s.second;
+
+	  r.tl = { 0, 0 };
+	  r.br = utils::vec2<unsigned int> (m_tile_size);
+	}
+	else if (tr.value_scale != d.value_scale || tr.value_offset != d.value_offset)
+	{
+	  r.tl = { 0, 0 };
+	  r.br = utils::vec2<unsigned int> (m_tile_size);
+	}
+
+	upload (tr, d, r, budget);
+      }
+
+      tr.value_scale = d.value_scale;
+      tr.value_offset = d.value_offset;
+
+      // the texture stays stale if it has changed again since its texels
+      // were read, and is refreshed again when it's used.
+      tr.generation = d.generation;
+      if (tr.generation >= tr.latest)
+	tr.dirty = texel_rect ();
+    }
+
+    e.uses_slots |= !tr.constant;
+  }
+
+  e.refresh_requested = false;
+  m_refreshing = m_tiles.npos;
+
+  if (e.evictable () && !was_evictable)
+    m_policy->insert (res.key);
+  else if (!e.evictable () && was_evictable)
+    m_policy->erase (res.key);
+}
+
+void tile_cache::upload (const texture_ref& tr, const texture_data& d, texel_rect r,
+			 upload_budget& budget)
+{
+  auto&& p = m_pages[tr.page];
+  const utils::vec2<unsigned int> pos = make_slot (tr).pos;
+
+  if (!d.compressed)
+  {
+    // the textures are not bigger than the slots.
+    r.br = std::min (r.br, d.pixels.size ());
+    if (r.empty ())
+      return;
+
+    const auto& px = d.pixels;
+    const size_t bpp = cpu_image::storage_size (d.format, { 1, 1 }, cpu_image::layout::linear);
+    const auto sz = r.br - r.tl;
+
+    p.tex.upload ((const char*)px.data () + (size_t)r.tl.y * px.bytes_per_line () + r.tl.x * bpp,
+		  utils::vec2<int> (pos + r.tl), sz, px.bytes_per_line ());
+    budget.consume ((size_t)sz.x * sz.y * bpp);
+    return;
+  }
+
+  // whole blocks.  the blocks of a part of the texture are copied together.
+  const unsigned int bs = bc1_codec::block_size;
+
+  r.tl = r.tl / bs * bs;
+  r.br = std::min ((r.br + (bs - 1)) / bs * bs, utils::vec2<unsigned int> (m_tile_size));
+  if (r.empty ())
+    return;
+
+  const auto sz = r.br - r.tl;
+  const size_t row_bytes = bc1_codec::encoded_size ({ m_tile_size, bs });
+  const size_t sub_row_bytes = bc1_codec::encoded_size ({ sz.x, bs });
+  const uint8_t* src = d.blocks.data () + (r.tl.y / bs) * row_bytes
+		       + bc1_codec::encoded_size ({ r.tl.x, bs });
+
+  if (sz.x == m_tile_size)
+    p.block_tex.upload (src, pos + r.tl, sz);
+  else
+  {
+    std::vector<uint8_t> tmp (bc1_codec::encoded_size (sz));
+    for (unsigned int y = 0; y < sz.y / bs; ++y)
+      std::memcpy (tmp.data () + y * sub_row_bytes, src + y * row_bytes, sub_row_bytes);
+
+    p.block_tex.upload (tmp.data (), pos + r.tl, sz);
+  }
+
+  budget.consume (bc1_codec::encoded_size (sz));
+}
+
+void tile_cache::update (uint64_t key, texture_index t, const utils::vec2<unsigned int>& tl,
+			 const utils::vec2<unsigned int>& br, uint64_t generation)
+{
+  update (t, { { key, tl, br, generation } });
+}
+
+void tile_cache::update (texture_index t, const std::vector<tile_update>& tiles)
+{
+  // the tiles which are neither requested nor cached are skipped.  the
+  // mutex is locked only twice for all tiles.
+  std::vector<tile_handle> refreshed;
+
+  for (auto&& u : tiles)
+    unstage (u.key);
+
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+
+    for (auto&& u : tiles)
+    {
+      // the cached tile is stale.  it's drawn with the old texels until
+      // it's refreshed.
+      const tile_handle h = m_tiles.find (u.key);
+      if (h != m_tiles.npos)
+      {
+	auto&& tr = m_tiles[h].textures[t];
+	tr.dirty.add (u.tl, u.br);
+	tr.latest = std::max (tr.latest, u.generation);
+      }
+
+      // the texels might have been read already.  prepare the tile again.
+      auto r = m_requests.find (u.key);
+      if (r != m_requests.end ())
+      {
+	r->second.dirty[t].add (u.tl, u.br);
+
+	if (r->second.started)
+	{
+	  r->second.serial = ++m_serial;
+	  r->second.started = false;
+	  post_job (u.key, r->second.prefetch);
+	}
+	continue;
+      }
+
+      // not in view.  it's refreshed when it's used again.
+      if (h == m_tiles.npos
+	  || (!m_tiles[h].pinned && m_frame - m_tiles[h].last_used > max_request_age))
+	continue;
+
+      // a tile can be in the list more than once.
+      if (!m_tiles[h].refresh_requested)
+      {
+	m_tiles[h].refresh_requested = true;
+	refreshed.push_back (h);
+      }
+    }
+  }
+
+  if (refreshed.empty ())
+    return;
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  // the workers see the requests when the mutex is unlocked.
+  for (tile_handle h : refreshed)
+    post_refresh (h);
+}
+
+void tile_cache::release (tile_handle h)
+{
+  auto&& e = m_tiles[h];
+
+  if (e.prefetched)
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_prefetch_stats.num_unused += 1;
+  }
+
+  for (auto&& t : e.textures)
+    if (!t.constant)
+      m_pages[t.page].free_slots.push_back (t.slot);
+
+  if (e.evictable ())
+    m_policy->erase (m_tiles.key (h));
+
+  if (e.pinned)
+    m_num_pinned_cached -= 1;
+
+  m_tiles.erase (h);
+}
+
+tile_cache::tile_handle tile_cache::eviction_candidate (void)
+{
+  if (m_policy->empty ())
+    return m_tiles.npos;
+
+  tile_handle h = m_tiles.find (m_policy->victim ());
+  if (h != m_refreshing)
+    return h;
+
+  // the refreshed tile is in use.  it's moved away from the end of the
+  // policy's order, so that the next tile is evicted instead of adding a
+  // page over the budget.
+  m_policy->touch (m_tiles.key (h), false);
+
+  h = m_tiles.find (m_policy->victim ());
+  return h != m_refreshing ? h : m_tiles.npos;
+}
+
+std::pair<unsigned int, unsigned int>
+tile_cache::allocate_slot (img::pixel_format format, bool compressed)
+{
+  const unsigned int slots_per_page = m_slots_per_row * m_slots_per_row;
+
+  while (true)
+  {
+    bool have_page = false;
+
+    for (unsigned int i = 0; i < m_pages.size (); ++i)
+      if (m_pages[i].format == format && m_pages[i].compressed == compressed)
+      {
+	have_page = true;
+
+	if (!m_pages[i].free_slots.empty ())
+	{
+	  const unsigned int s = m_pages[i].free_slots.back ();
+	  m_pages[i].free_slots.pop_back ();
+	  return { i, s };
+	}
+      }
+
+    // a new page, if the budget allows it or if there is no page of this
+    // format yet.  otherwise an unused page of another format.  if there is
+    // nothing to evict, the budget is too small for the tile.
+    page* p = nullptr;
+    tile_handle victim = m_tiles.npos;
+
+    const bool fits = page_bytes () + page_bytes (format, compressed) <= m_max_bytes;
+
+    if (!fits)
+      for (auto&& pp : m_pages)
+	if (pp.free_slots.size () == slots_per_page)
+	{
+	  p = &pp;
+	  break;
+	}
+
+    if (p == nullptr && have_page && !fits)
+      victim = eviction_candidate ();
+
+    if (p == nullptr && (!have_page || fits || victim == m_tiles.npos))
+    {
+      m_pages.emplace_back ();
+      p = &m_pages.back ();
+    }
+
+    if (p != nullptr)
+    {
+      p->format = format;
+      p->compressed = compressed;
+
+      if (compressed)
+      {
+	p->tex = gl::texture ();
+	p->block_tex = block_texture (utils::vec2<unsigned int> (page_texture_size ()));
+      }
+      else
+      {
+	p->block_tex = block_texture ();
+	p->tex = gl::texture (format, utils::vec2<unsigned int> (page_texture_size ()));
+	p->tex.set_address_mode_u (gl::texture::clamp);
+	p->tex.set_address_mode_v (gl::texture::clamp);
+	p->tex.set_min_filter (gl::texture::linear);
+	p->tex.set_mag_filter (gl::texture::linear);
+      }
+
+      // the first slots are used first.
+      p->free_slots.clear ();
+      for (unsigned int s = slots_per_page; s-- > 0; )
+	p->free_slots.push_back (s);
+
+      continue;
+    }
+
+    // evict a tile.  if its slots have other formats, keep going until a
+    // slot or a whole page is free.
+    release (victim);
+
+    if (m_stats != nullptr)
+      render_stats::add (m_stats->texture_cache_evictions, 1);
+  }
+}
+
+void tile_cache::pin (uint64_t key)
+{
+  if (m_pinned.find (key) != m_pinned.npos)
+    return;
+
+  m_pinned.insert (key, 0);
+
+  const tile_handle h = m_tiles.find (key);
+  if (h != m_tiles.npos)
+  {
+    auto&& e = m_tiles[h];
+    if (e.evictable ())
+      m_policy->erase (key);
+
+    e.pinned = true;
+    e.prefetched = false;
+    m_num_pinned_cached += 1;
+    return;
+  }
+
+  if (request_staged (key, true))
+    return;
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto r = m_requests.find (key);
+  if (r == m_requests.end ())
+  {
+    post_request (key, true);
+    r = m_requests.find (key);
+  }
+
+  r->second.pinned = true;
+}
+
+void tile_cache::unpin (uint64_t key)
+{
+  const auto p = m_pinned.find (key);
+  if (p == m_pinned.npos)
+    return;
+
+  m_pinned.erase (p);
+
+  const tile_handle h = m_tiles.find (key);
+  if (h != m_tiles.npos)
+  {
+    auto&& e = m_tiles[h];
+    e.pinned = false;
+    m_num_pinned_cached -= 1;
+
+    if (e.evictable ())
+      m_policy->insert (key);
+    return;
+  }
+
+  // the request ages from now on.
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto r = m_requests.find (key);
+  if (r != m_requests.end () && r->second.pinned)
+  {
+    r->second.pinned = false;
+    r->second.last_frame = m_frame;
+  }
+}
+
+void tile_cache::unpin_all (void)
+{
+  std::vector<uint64_t> keys;
+  keys.reserve (m_pinned.size ());
+  m_pinned.for_each ([&] (uint64_t key, char) { keys.push_back (key); });
+
+  for (uint64_t key : keys)
+    unpin (key);
+}
+
+void tile_cache::erase (uint64_t key)
+{
+  const auto p = m_pinned.find (key);
+  if (p != m_pinned.npos)
+    m_pinned.erase (p);
+
+  const tile_handle h = m_tiles.find (key);
+  if (h != m_tiles.npos)
+    release (h);
+
+  unstage (key);
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+
+  auto r = m_requests.find (key);
+  if (r != m_requests.end ())
+  {
+    if (r->second.prefetch && !r->second.pinned)
+      m_prefetch_stats.num_unused += 1;
+
+    m_requests.erase (r);
+  }
+}
+
+void tile_cache::clear (void)
+{
+  m_tiles.clear ();
+  m_policy->clear ();
+  m_refreshing = m_tiles.npos;
+  m_pinned.clear ();
+  m_num_pinned_cached = 0;
+  m_pages.clear ();
+
+  m_staged.clear ();
+  m_staged_queue.clear ();
+  m_staged_bytes = 0;
+
+  m_constant_textures.clear ();
+  m_num_constant_textures = 0;
+
+  std::lock_guard<std::mutex> lock (m_mutex);
+  m_requests.clear ();
+}
+
+const gl::texture& tile_cache::constant_texture (img::pixel_format format, uint64_t value)
+{
+  auto&& textures = m_constant_textures[value];
+
+  for (auto&& t : textures)
+    if (t.format () == format)
+      return t;
+
+  textures.emplace_back (format, utils::vec2<unsigned int> (1, 1));
+  m_num_constant_textures += 1;
+
+  auto&& tex = textures.back ();
+  tex.set_address_mode_u (gl::texture::clamp);
+  tex.set_address_mode_v (gl::texture::clamp);
+  tex.set_min_filter (gl::texture::nearest);
+  tex.set_mag_filter (gl::texture::nearest);
+  tex.upload (&value, { 0, 0 }, { 1, 1 }, sizeof (value));
+
+  return tex;
+}
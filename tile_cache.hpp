@@ -0,0 +1,536 @@
+#ifndef includeguard_tile_cache_hpp_includeguard
+#define includeguard_tile_cache_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <map>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <iosfwd>
+
+#include "utils/vec_mat.hpp"
+#include "gl/gl.hpp"
+#include "img/image.hpp"
+#include "tile_map.hpp"
+#include "eviction_policy.hpp"
+
+class worker_pool;
+struct render_stats;
+
+// the gpu textures of the texture tiles of an image.  each tile has a color
+// and a height texture, which are cached, loaded and evicted together.
+//
+// the textures are stored in slots of a few big atlas page textures, one
+// format per page.  a cached texture is a page and the texel position of its
+// slot in the page.  the pages are created once and the slots of evicted
+// tiles are reused, so that the tiles of a frame can be drawn with few
+// texture binds.  the pages are limited by a budget in bytes, which is
+// computed from the texture formats.
+//
+// a missing tile is not loaded when it's asked for.  instead the tile is
+// prepared on a worker thread into staging images, which are ready to be
+// uploaded.  the render thread uploads the prepared tiles within a budget
+// per frame.  until then the tile is reported as missing.
+//
+// color textures can also be uploaded as bc1 compressed blocks, which are
+// stored in pages of their own.
+//
+// textures whose texels all have the same value are not uploaded.  they
+// share 1x1 textures of that value with the other constant textures and
+// don't count against the budget.
+//
+// requests which haven't been repeated for a few frames are dropped before
+// they are prepared, e.g. when the view has moved on.
+//
+// the tiles are evicted in the order of an eviction policy, by default
+// lru.  a use is counted at most once per frame, and a tile which has been
+// used in the previous frame too is not reused in the sense of the policy.
+//
+// tiles can be prefetched, i.e. requested before they are needed.  such
+// requests are prepared and uploaded after all other requests.
+//
+// when the texels of a cached tile change, the tile is prepared again and
+// only the changed texels are uploaded into its slots.  the tile stays in
+// the cache with the old texels until then, i.e. it's drawn stale while
+// it's refreshed in the background, and all its textures are swapped at
+// once in 'upload_next'.  a tile which is in view is refreshed right
+// away, one which is not when it's used again.  the textures record the
+// generation of the texels they were prepared from (see 'update'), so
+// that a tile is only considered up to date when the refreshed textures
+// are at least as new as the last change.
+//
+// the prepared textures of the uploaded tiles are kept in ram, in a staging
+// tier with a budget of its own.  when an evicted tile is needed again, its
+// textures are uploaded from there instead of preparing them again, e.g.
+// when the view goes back and forth between distant parts of a big image.
+// changed tiles are dropped from the staging tier.
+//
+// tiles can be pinned, e.g. those which are needed whenever the whole image
+// is in view.  a pinned tile is requested at low priority until it's
+// ready.  then it stays in the cache and is refreshed when it changes, also
+// when it's not in view.  the pinned tiles count against the budget.  if
+// they take all of it, the pages exceed the budget.
+//
+// all functions have to be called on the render thread.  the worker pool
+// must outlive the cache.
+
+class tile_cache
+{
+public:
+  // the textures of a tile.
+  enum texture_index
+  {
+    color = 0,
+    height = 1,
+
+    textures_per_tile
+  };
+
+  struct texture_data
+  {
+    // the texture format.
+    img::pixel_format format;
+
+    // if set, all texels have the same value, which is stored in the lower
+    // bytes of 'value'.
+    bool constant = false;
+    uint64_t value = 0;
+
+    // otherwise the texels of the whole texture tile.
+    img::image pixels;
+
+    // if set, the texels are bc1 blocks in 'blocks' instead of 'pixels'.
+    // 'format' is the format of the texels before they were compressed.
+    bool compressed = false;
+    std::vector<uint8_t> blocks;
+
+    // the sampled texel values are mapped to 'value * value_scale +
+    // value_offset' when they are used, e.g. for textures which are stored
+    // with fewer bits.
+    float value_scale = 1;
+    float value_offset = 0;
+
+    // the generation of the texels which have been read, see 'update'.
+    uint64_t generation = 0;
+  };
+
+  typedef std::array<texture_data, textures_per_tile> tile_data;
+
+  // prepares the textures of the tile 'key'.  runs on a worker thread.
+  typedef std::function<void (uint64_t key, tile_data& out)> prepare_func;
+
+  // the limits of the uploads in one frame.  0 means no limit.
+  class upload_budget
+  {
+  public:
+    upload_budget (size_t max_bytes, double max_seconds);
+
+    bool exhausted (void) const;
+    void consume (size_t bytes) { m_bytes += bytes; }
+
+    size_t bytes (void) const { return m_bytes; }
+
+  private:
+    size_t m_bytes = 0;
+    size_t m_max_bytes;
+    bool m_has_deadline;
+    std::chrono::steady_clock::time_point m_deadline;
+  };
+
+  // an atlas page texture of bc1 blocks, which gl::texture doesn't
+  // support.  needs the GL_EXT_texture_compression_s3tc extension.
+  class block_texture
+  {
+  public:
+    block_texture (void) = default;
+    explicit block_texture (const utils::vec2<unsigned int>& size);
+    ~block_texture (void);
+
+    block_texture (block_texture&& rhs);
+    block_texture& operator = (block_texture&& rhs);
+
+    // whether the graphics card can do it.  needs a gl context.
+    static bool supported (void);
+
+    bool empty (void) const { return m_name == 0; }
+    const utils::vec2<unsigned int>& size (void) const { return m_size; }
+
+    // upload the blocks of the texels [pos, pos + size), which are
+    // multiples of the block size.  the blocks are stored row by row
+    // without gaps.
+    void upload (const uint8_t* blocks, const utils::vec2<unsigned int>& pos,
+		 const utils::vec2<unsigned int>& size);
+
+    void bind (unsigned int unit) const;
+
+  private:
+    unsigned int m_name = 0;
+    utils::vec2<unsigned int> m_size = { 0, 0 };
+  };
+
+  // where a texture is stored.  both textures are null if the tile is not
+  // ready.
+  struct slot
+  {
+    const gl::texture* tex = nullptr;
+    utils::vec2<unsigned int> pos = { 0, 0 };
+
+    // the page, if the texture is compressed.  'tex' is null then.
+    const block_texture* block_tex = nullptr;
+
+    // see texture_data.
+    float value_scale = 1;
+    float value_offset = 0;
+
+    explicit operator bool (void) const { return tex != nullptr || block_tex != nullptr; }
+
+    // identifies the texture for avoiding redundant binds.
+    const void* texture (void) const
+    {
+      return tex != nullptr ? (const void*)tex : (const void*)block_tex;
+    }
+
+    void bind (unsigned int unit) const
+    {
+      if (tex != nullptr)
+	tex->bind (unit);
+      else
+	block_tex->bind (unit);
+    }
+  };
+
+  typedef std::array<slot, textures_per_tile> tile_slots;
+
+  struct prefetch_stats
+  {
+    // the prefetched tiles.
+    uint64_t num_requests = 0;
+
+    // the prefetched tiles which were ready when they were needed.
+    uint64_t num_hits = 0;
+
+    // the prefetched tiles which were needed before they were ready.
+    uint64_t num_late = 0;
+
+    // the prefetched tiles which were dropped or evicted without being
+    // needed.
+    uint64_t num_unused = 0;
+
+    double hit_rate (void) const
+    {
+      return num_requests > 0 ? (double)num_hits / (double)num_requests : 0.0;
+    }
+  };
+
+  // the number of frames a request is kept without being repeated.
+  static constexpr unsigned int max_request_age = 2;
+
+  // the width and height of the atlas pages in texels.
+  static constexpr unsigned int page_size = 1024;
+
+  // the textures are 'tile_size' x 'tile_size' texels.  the atlas pages use
+  // at most 'max_bytes' bytes, but there is at least one page per format.
+  tile_cache (worker_pool& workers, prepare_func prepare, size_t max_bytes,
+	      unsigned int tile_size);
+  ~tile_cache (void);
+
+  tile_cache (const tile_cache&) = delete;
+  tile_cache& operator = (const tile_cache&) = delete;
+
+  // change the budget of the atlas pages.  all cached tiles are dropped.
+  void set_max_bytes (size_t val);
+  size_t max_bytes (void) const { return m_max_bytes; }
+
+  // the bytes of the atlas pages which have been created.
+  size_t page_bytes (void) const;
+
+  // change the budget of the staging tier in bytes.  0 disables it, which
+  // is the default.
+  void set_max_staged_bytes (size_t val);
+  size_t max_staged_bytes (void) const { return m_max_staged_bytes; }
+
+  // the bytes of the staged tiles.
+  size_t staged_bytes (void) const { return m_staged_bytes; }
+
+  // change the eviction policy of the atlas pages.  'cost' gives the cost
+  // of loading a tile again, see eviction_policy.  all cached tiles are
+  // dropped.
+  void set_eviction_policy (eviction_policy::kind k, eviction_policy::cost_func cost = nullptr);
+  eviction_policy::kind get_eviction_policy (void) const { return m_policy->get_kind (); }
+
+  // write the keys of the tiles which are drawn to 'out', for replaying
+  // them with different policies and budgets offline.  each frame starts
+  // with a line "f", followed by a line with the key in hex for each
+  // 'trace_use'.  null = no tracing.
+  void set_trace (std::ostream* out) { m_trace = out; }
+
+  // the textures of the tile are drawn in this frame.  the caller reports
+  // each drawn tile once, also if it's drawn with the textures of another
+  // tile.
+  void trace_use (uint64_t key);
+
+  // the width and height of the atlas page textures.  a multiple of the
+  // tile size.
+  unsigned int page_texture_size (void) const { return m_slots_per_row * m_tile_size; }
+
+  // start a new frame.  the requests of the previous frames age.
+  void begin_frame (void);
+
+  // the slots of the textures of the tile.  if the tile is not ready yet,
+  // it is requested and false is returned.  the slots are valid until the
+  // next call of 'begin_frame' or 'upload_next'.
+  bool get (uint64_t key, tile_slots& out);
+
+  // like 'get', but a missing tile is not requested.
+  bool get_cached (uint64_t key, tile_slots& out);
+
+  // request the tile if it's not in the cache, like 'get' does, but
+  // without counting a lookup, e.g. for a tile which is not drawn.
+  void request_missing (uint64_t key);
+
+  // request the tile at low priority if it's not in the cache.  like other
+  // requests, it's dropped if it isn't repeated for a few frames.
+  void prefetch (uint64_t key);
+
+  // upload the next prepared tile if the budget allows it.  returns false
+  // if there is nothing more to do.
+  bool upload_next (upload_budget& budget);
+
+  // the texels in the rectangle [tl, br) of the texture 't' of the tile
+  // have changed.  the rectangle is in texels of the texture.  'generation'
+  // is the version of the changed texels, which grows with each change and
+  // is reported by the prepare function in texture_data.  a cached tile is
+  // refreshed in place, right away if it has been used in the last frames
+  // or is pinned, otherwise when it's used again.  preparations which are
+  // in progress are restarted.
+  void update (uint64_t key, texture_index t, const utils::vec2<unsigned int>& tl,
+	       const utils::vec2<unsigned int>& br, uint64_t generation = 0);
+
+  struct tile_update
+  {
+    uint64_t key;
+    utils::vec2<unsigned int> tl;
+    utils::vec2<unsigned int> br;
+    uint64_t generation;
+  };
+
+  // like the other 'update' for many tiles at once, e.g. all tiles of a
+  // changed region of the image.
+  void update (texture_index t, const std::vector<tile_update>& tiles);
+
+  // keep the tile in the cache, see above.
+  void pin (uint64_t key);
+
+  // the tile is evicted like the others again.
+  void unpin (uint64_t key);
+  void unpin_all (void);
+
+  // the pinned tiles and those of them which are in the cache.
+  size_t num_pinned (void) const { return m_pinned.size (); }
+  size_t num_pinned_cached (void) const { return m_num_pinned_cached; }
+
+  // forget the tile, also if it's pinned.  preparations which are in
+  // progress are discarded.
+  void erase (uint64_t key);
+
+  // forget all tiles, also the pinned ones, and release the atlas pages.
+  void clear (void);
+
+  // the number of requested tiles which are not ready yet.
+  size_t num_requests (void) const;
+
+  prefetch_stats get_prefetch_stats (void) const;
+
+  // count the lookups, evictions and uploads in 'val'.  null = no counting.
+  void set_stats (render_stats* val) { m_stats = val; }
+
+private:
+  // the number of shared constant textures after which they are recreated.
+  static constexpr unsigned int max_constant_textures = 1024;
+
+  worker_pool& m_workers;
+  prepare_func m_prepare;
+  size_t m_max_bytes;
+  unsigned int m_tile_size;
+  unsigned int m_slots_per_row;
+
+  struct page
+  {
+    // the pages of compressed textures use 'block_tex' instead of 'tex'.
+    img::pixel_format format;
+    bool compressed;
+
+    gl::texture tex;
+    block_texture block_tex;
+
+    // the indices of the unused slots.
+    std::vector<unsigned int> free_slots;
+  };
+
+  std::vector<page> m_pages;
+
+  struct texel_rect
+  {
+    utils::vec2<unsigned int> tl = { 0, 0 };
+    utils::vec2<unsigned int> br = { 0, 0 };
+
+    bool empty (void) const { return tl.x >= br.x || tl.y >= br.y; }
+    void add (const utils::vec2<unsigned int>& a_tl, const utils::vec2<unsigned int>& a_br);
+  };
+
+  struct texture_ref
+  {
+    img::pixel_format format;
+
+    // either a constant texture or a slot.
+    bool constant;
+    uint64_t value;
+    bool compressed;
+
+    float value_scale;
+    float value_offset;
+
+    unsigned int page;
+    unsigned int slot;
+
+    // the generation of the uploaded texels and of the last change, and
+    // the texels which have changed since the upload.
+    uint64_t generation;
+    uint64_t latest;
+    texel_rect dirty;
+  };
+
+  struct tile_entry
+  {
+    std::array<texture_ref, textures_per_tile> textures;
+
+    bool uses_slots;
+    bool pinned;
+
+    // prefetched and not used yet.
+    bool prefetched;
+
+    // the frame in which the tile has been used last.
+    uint64_t last_used;
+
+    // a refresh has been requested.
+    bool refresh_requested;
+
+    // only these tiles are in the eviction policy.
+    bool evictable (void) const { return uses_slots && !pinned; }
+
+    // the textures have changed since they were uploaded.
+    bool stale (void) const
+    {
+      for (auto&& t : textures)
+	if (!t.dirty.empty ())
+	  return true;
+      return false;
+    }
+  };
+
+  typedef tile_map<tile_entry>::handle tile_handle;
+  tile_map<tile_entry> m_tiles;
+
+  std::unique_ptr<eviction_policy> m_policy;
+
+  // the tile which is refreshed, which must not be evicted.
+  tile_handle m_refreshing = tile_map<tile_entry>::npos;
+
+  std::ostream* m_trace = nullptr;
+
+  // the pinned tiles, also those which are not ready yet.
+  tile_map<char> m_pinned;
+  size_t m_num_pinned_cached = 0;
+
+  // the shared constant textures by value, one for each format.
+  std::map<uint64_t, std::list<gl::texture>> m_constant_textures;
+  unsigned int m_num_constant_textures = 0;
+
+  // the staging tier.  all staged tiles are in the lru list of the map.
+  struct staged_tile
+  {
+    tile_data data;
+    size_t bytes = 0;
+
+    // the tile has been asked for and is in 'm_staged_queue'.
+    bool queued = false;
+    bool prefetch = false;
+    uint64_t last_frame = 0;
+  };
+
+  typedef tile_map<staged_tile>::handle staged_handle;
+  tile_map<staged_tile> m_staged;
+  std::deque<uint64_t> m_staged_queue;
+  size_t m_max_staged_bytes = 0;
+  size_t m_staged_bytes = 0;
+
+  // the requests and the prepared tiles are shared with the workers.
+  struct request
+  {
+    uint64_t serial = 0;
+    uint64_t last_frame = 0;
+    bool prefetch = false;
+    bool started = false;
+
+    // a cached tile which is refreshed or a pinned tile.  such requests
+    // don't age.
+    bool refresh = false;
+    bool pinned = false;
+    std::array<texel_rect, textures_per_tile> dirty;
+  };
+
+  struct result
+  {
+    uint64_t key;
+    uint64_t serial;
+    tile_data data;
+  };
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_idle;
+  std::map<uint64_t, request> m_requests;
+
+  // the requested keys in the order they are prepared.  a worker job is
+  // posted for each entry.  the entries whose requests are gone or
+  // already started are skipped.
+  std::deque<uint64_t> m_queue;
+  std::deque<uint64_t> m_prefetch_queue;
+
+  std::deque<result> m_results;
+  std::deque<result> m_prefetch_results;
+  uint64_t m_frame = 0;
+  uint64_t m_serial = 0;
+  unsigned int m_num_jobs = 0;
+
+  prefetch_stats m_prefetch_stats;
+  render_stats* m_stats = nullptr;
+
+  void use (tile_handle h, tile_slots& out);
+  void add (uint64_t key, const tile_data& data, bool prefetched, upload_budget& budget);
+  bool request_staged (uint64_t key, bool prefetch);
+  void stage (uint64_t key, tile_data&& data);
+  void unstage (uint64_t key);
+  void post_request (uint64_t key, bool prefetch);
+  void post_refresh (tile_handle h);
+  void post_job (uint64_t key, bool prefetch);
+  void prepare_next (void);
+  void refresh (tile_handle h, result& res, const request& req, upload_budget& budget);
+  void upload (const texture_ref& tr, const texture_data& d, texel_rect r,
+	       upload_budget& budget);
+  void release (tile_handle h);
+  std::pair<unsigned int, unsigned int> allocate_slot (img::pixel_format format, bool compressed);
+  tile_handle eviction_candidate (void);
+  size_t page_bytes (img::pixel_format format, bool compressed) const;
+  slot make_slot (const texture_ref& t);
+  const gl::texture& constant_texture (img::pixel_format format, uint64_t value);
+};
+
+#endif // includeguard_tile_cache_hpp_includeguard
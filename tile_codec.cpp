@@ -0,0 +1,408 @@
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "tile_codec.hpp"
+
+using utils::vec2;
+using img::pixel_format;
+
+namespace tile_codec
+{
+
+// ----------------------------------------------------------------------------
+// lz77 codec.  the compressed data is a sequence of
+//
+//   token          4 bits literal length, 4 bits match length - min_match.
+//                  15 means that the length continues in the next bytes.
+//   [length]       255 + 255 + ... + remainder
+//   literals
+//   offset         16 bit little endian, distance of the match.
+//   [length]       same as above for the match length.
+//
+// the last sequence has only literals and ends exactly at the end of the
+// uncompressed data.
+
+static constexpr unsigned int min_match = 4;
+static constexpr unsigned int hash_bits = 13;
+static constexpr size_t max_offset = 65535;
+
+static inline uint32_t read32 (const uint8_t* p)
+{
+  uint32_t v;
+  std::memcpy (&v, p, 4);
+  return v;
+}
+
+static inline uint64_t read64 (const uint8_t* p)
+{
+  uint64_t v;
+  std::memcpy (&v, p, 8);
+  return v;
+}
+
+static inline uint32_t hash4 (uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+static void put_length (std::vector<uint8_t>& out, size_t len)
+{
+  for (; len >= 255; len -= 255)
+    out.push_back (255);
+  out.push_back ((uint8_t)len);
+}
+
+static void
+put_sequence (std::vector<uint8_t>& out, const uint8_t* literals, size_t literal_len,
+	      size_t offset, size_t match_len)
+{
+  const size_t ml = match_len > 0 ? match_len - min_match : 0;
+
+  out.push_back ((uint8_t)((std::min<size_t> (literal_len, 15) << 4)
+			   | std::min<size_t> (ml, 15)));
+  if (literal_len >= 15)
+    put_length (out, literal_len - 15);
+
+  out.insert (out.end (), literals, literals + literal_len);
+
+  if (match_len == 0)
+    return;
+
+  out.push_back ((uint8_t)(offset & 0xFF));
+  out.push_back ((uint8_t)(offset >> 8));
+
+  if (ml >= 15)
+    put_length (out, ml - 15);
+}
+
+void compress (const uint8_t* src, size_t src_size, std::vector<uint8_t>& out)
+{
+  std::vector<uint32_t> table (1 << hash_bits, 0);
+
+  size_t i = 0;
+  size_t anchor = 0;
+
+  while (i + min_match <= src_size)
+  {
+    const uint32_t v = read32 (src + i);
+    const uint32_t h = hash4 (v);
+    const size_t cand = table[h];
+    table[h] = (uint32_t)i;
+
+    if (cand >= i || i - cand > max_offset || read32 (src + cand) != v)
+    {
+      // skip faster over data which doesn't compress.
+      i += 1 + ((i - anchor) >> 5);
+      continue;
+    }
+
+    size_t len = min_match;
+    while (i + len + 8 <= src_size && read64 (src + cand + len) == read64 (src + i + len))
+      len += 8;
+    while (i + len < src_size && src[cand + len] == src[i + len])
+      len += 1;
+
+    put_sequence (out, src + anchor, i - anchor, i - cand, len);
+
+    i += len;
+    anchor = i;
+  }
+
+  if (anchor < src_size)
+    put_sequence (out, src + anchor, src_size - anchor, 0, 0);
+}
+
+bool decompress (const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size)
+{
+  const uint8_t* ip = src;
+  const uint8_t* const ip_end = src + src_size;
+  uint8_t* op = dst;
+  uint8_t* const op_end = dst + dst_size;
+
+  auto get_length = [&] (size_t& len)
+  {
+    uint8_t b;
+    do
+    {
+      if (ip == ip_end)
+	return false;
+      b = *ip++;
+      len += b;
+    } while (b == 255);
+    return true;
+  };
+
+  while (op < op_end)
+  {
+    if (ip == ip_end)
+      return false;
+
+    const uint8_t token = *ip++;
+
+    size_t literal_len = token >> 4;
+    if (literal_len == 15 && !get_length (literal_len))
+      return false;
+
+    if (literal_len > (size_t)(ip_end - ip) || literal_len > (size_t)(op_end - op))
+      return false;
+
+    std::memcpy (op, ip, literal_len);
+    op += literal_len;
+    ip += literal_len;
+
+    if (op == op_end)
+      break;
+
+    if (ip_end - ip < 2)
+      return false;
+
+    const size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+
+    size_t match_len = token & 15;
+    if (match_len == 15 && !get_length (match_len))
+      return false;
+    match_len += min_match;
+
+    if (offset == 0 || offset > (size_t)(op - dst) || match_len > (size_t)(op_end - op))
+      return false;
+
+    const uint8_t* m = op - offset;
+
+    if (offset >= match_len)
+    {
+      std::memcpy (op, m, match_len);
+      op += match_len;
+    }
+    else
+    {
+      // overlapping match, e.g. a run of the same value.  the pattern
+      // before 'op' repeats with a period of 'offset', so it can be copied
+      // in growing chunks.
+      size_t copied = 0;
+      while (copied < match_len)
+      {
+	const size_t n = std::min (offset + copied, match_len - copied);
+	std::memcpy (op + copied, m, n);
+	copied += n;
+      }
+      op += match_len;
+    }
+  }
+
+  return ip == ip_end;
+}
+
+// ----------------------------------------------------------------------------
+// prediction.  each channel of a pixel is predicted from the left, top and
+// top-left neighbours as left + top - top_left (a plane through the
+// neighbours).  the residual is computed modulo the channel width and stored
+// zigzag encoded (0, -1, 1, -2, 2 ... -> 0, 1, 2, 3, 4 ...).  float channels
+// are predicted on their bit patterns, which is lossless.
+//
+// the residual is the horizontal difference of the vertical differences,
+// which makes decoding a running sum and a vectorizable addition.
+
+enum : uint8_t
+{
+  method_stored = 0,
+  method_predict_lz = 1
+};
+
+struct element_layout
+{
+  unsigned int bytes;
+  unsigned int channels;
+};
+
+static element_layout get_element_layout (pixel_format pf)
+{
+  switch (pf)
+  {
+    case pixel_format::r8:
+    case pixel_format::r8ui:
+      return { 1, 1 };
+
+    case pixel_format::rgb8:
+    case pixel_format::bgr8:
+      return { 1, 3 };
+
+    case pixel_format::rgba8:
+      return { 1, 4 };
+
+    case pixel_format::r16:
+    case pixel_format::r16ui:
+    case pixel_format::r5_g6_b5:
+      return { 2, 1 };
+
+    case pixel_format::r32f:
+      return { 4, 1 };
+
+    case pixel_format::rgba32f:
+      return { 4, 4 };
+
+    default:
+      throw std::invalid_argument ("tile_codec: unsupported pixel format");
+  }
+}
+
+template <typename T> static inline T
+zigzag (T r)
+{
+  return (T)((T)(r << 1) ^ (T)(0 - (r >> (sizeof (T) * 8 - 1))));
+}
+
+template <typename T> static inline T
+unzigzag (T z)
+{
+  return (T)((T)(z >> 1) ^ (T)(0 - (z & 1)));
+}
+
+template <typename T, unsigned int channels> static void
+to_planes (const uint8_t* pixels, unsigned int bytes_per_line,
+	   const vec2<unsigned int>& size, uint8_t* planes)
+{
+  const size_t plane_size = (size_t)size.x * size.y;
+
+  for (unsigned int y = 0; y < size.y; ++y)
+  {
+    const T* row = (const T*)(pixels + (size_t)y * bytes_per_line);
+    const T* prev_row = y > 0 ? (const T*)(pixels + (size_t)(y-1) * bytes_per_line) : nullptr;
+    uint8_t* p = planes + (size_t)y * size.x;
+
+    T left[channels] = { };
+
+    for (unsigned int x = 0; x < size.x; ++x)
+      for (unsigned int c = 0; c < channels; ++c)
+      {
+	const unsigned int i = x * channels + c;
+	const T d = (T)(row[i] - (prev_row != nullptr ? prev_row[i] : 0));
+	const T z = zigzag ((T)(d - left[c]));
+	left[c] = d;
+
+	for (unsigned int k = 0; k < sizeof (T); ++k)
+	  p[(c * sizeof (T) + k) * plane_size + x] = (uint8_t)(z >> (k * 8));
+      }
+  }
+}
+
+template <typename T, unsigned int channels> static void
+from_planes (const uint8_t* planes, uint8_t* pixels, unsigned int bytes_per_line,
+	     const vec2<unsigned int>& size)
+{
+  const size_t plane_size = (size_t)size.x * size.y;
+
+  for (unsigned int y = 0; y < size.y; ++y)
+  {
+    T* row = (T*)(pixels + (size_t)y * bytes_per_line);
+    const T* prev_row = y > 0 ? (const T*)(pixels + (size_t)(y-1) * bytes_per_line) : nullptr;
+    const uint8_t* p = planes + (size_t)y * size.x;
+
+    // the differences to the previous row are the running sum of the
+    // residuals.  this is the only dependency between the pixels of a row.
+    T left[channels] = { };
+
+    for (unsigned int x = 0; x < size.x; ++x)
+      for (unsigned int c = 0; c < channels; ++c)
+      {
+	T z = 0;
+	for (unsigned int k = 0; k < sizeof (T); ++k)
+	  z |= (T)((T)p[(c * sizeof (T) + k) * plane_size + x] << (k * 8));
+
+	left[c] = (T)(left[c] + unzigzag (z));
+	row[x * channels + c] = left[c];
+      }
+
+    if (prev_row != nullptr)
+      for (unsigned int i = 0; i < size.x * channels; ++i)
+	row[i] = (T)(row[i] + prev_row[i]);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void encode (const void* pixels, unsigned int bytes_per_line,
+	     const vec2<unsigned int>& size, pixel_format pf,
+	     std::vector<uint8_t>& out)
+{
+  const auto el = get_element_layout (pf);
+  const size_t row_bytes = (size_t)size.x * el.bytes * el.channels;
+  const size_t raw_size = row_bytes * size.y;
+  const uint8_t* src = (const uint8_t*)pixels;
+
+  std::vector<uint8_t> planes (raw_size);
+
+  switch (el.bytes * 16 + el.channels)
+  {
+    case 0x11: to_planes<uint8_t, 1> (src, bytes_per_line, size, planes.data ()); break;
+    case 0x13: to_planes<uint8_t, 3> (src, bytes_per_line, size, planes.data ()); break;
+    case 0x14: to_planes<uint8_t, 4> (src, bytes_per_line, size, planes.data ()); break;
+    case 0x21: to_planes<uint16_t, 1> (src, bytes_per_line, size, planes.data ()); break;
+    case 0x41: to_planes<uint32_t, 1> (src, bytes_per_line, size, planes.data ()); break;
+    case 0x44: to_planes<uint32_t, 4> (src, bytes_per_line, size, planes.data ()); break;
+  }
+
+  const size_t start = out.size ();
+  out.push_back (method_predict_lz);
+  compress (planes.data (), raw_size, out);
+
+  if (out.size () - start - 1 < raw_size)
+    return;
+
+  out.resize (start);
+  out.push_back (method_stored);
+
+  for (unsigned int y = 0; y < size.y; ++y)
+  {
+    const uint8_t* row = src + (size_t)y * bytes_per_line;
+    out.insert (out.end (), row, row + row_bytes);
+  }
+}
+
+bool decode (const uint8_t* data, size_t data_size,
+	     void* pixels, unsigned int bytes_per_line,
+	     const vec2<unsigned int>& size, pixel_format pf)
+{
+  const auto el = get_element_layout (pf);
+  const size_t row_bytes = (size_t)size.x * el.bytes * el.channels;
+  const size_t raw_size = row_bytes * size.y;
+  uint8_t* dst = (uint8_t*)pixels;
+
+  if (data_size < 1)
+    return false;
+
+  if (data[0] == method_stored)
+  {
+    if (data_size != raw_size + 1)
+      return false;
+
+    for (unsigned int y = 0; y < size.y; ++y)
+      std::memcpy (dst + (size_t)y * bytes_per_line, data + 1 + y * row_bytes, row_bytes);
+
+    return true;
+  }
+
+  if (data[0] != method_predict_lz)
+    return false;
+
+  std::vector<uint8_t> planes (raw_size);
+
+  if (!decompress (data + 1, data_size - 1, planes.data (), raw_size))
+    return false;
+
+  switch (el.bytes * 16 + el.channels)
+  {
+    case 0x11: from_planes<uint8_t, 1> (planes.data (), dst, bytes_per_line, size); break;
+    case 0x13: from_planes<uint8_t, 3> (planes.data (), dst, bytes_per_line, size); break;
+    case 0x14: from_planes<uint8_t, 4> (planes.data (), dst, bytes_per_line, size); break;
+    case 0x21: from_planes<uint16_t, 1> (planes.data (), dst, bytes_per_line, size); break;
+    case 0x41: from_planes<uint32_t, 1> (planes.data (), dst, bytes_per_line, size); break;
+    case 0x44: from_planes<uint32_t, 4> (planes.data (), dst, bytes_per_line, size); break;
+  }
+
+  return true;
+}
+
+} // namespace tile_codec
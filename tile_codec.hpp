@@ -0,0 +1,46 @@
+#ifndef includeguard_tile_codec_hpp_includeguard
+#define includeguard_tile_codec_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "utils/vec_mat.hpp"
+#include "img/image.hpp"
+
+// lossless compression of texture tiles for keeping inactive parts of the
+// image in memory in compressed form.
+//
+// each channel of the pixels is first predicted from its neighbours.  the
+// prediction residuals are stored as unsigned numbers and split into byte
+// planes, so that the mostly zero high bytes of smooth height maps end up
+// next to each other.  the byte planes are then compressed with a simple
+// lz77 codec (similar to lz4), which is fast to decode.
+//
+// if the data doesn't compress, it's stored as it is.
+
+namespace tile_codec
+{
+
+// compress 'size' pixels of format 'pf' at 'pixels' and append the
+// compressed data to 'out'.  throws std::invalid_argument if the pixel
+// format is not supported.
+void encode (const void* pixels, unsigned int bytes_per_line,
+	     const utils::vec2<unsigned int>& size, img::pixel_format pf,
+	     std::vector<uint8_t>& out);
+
+// decompress data which was compressed with the same size and pixel format.
+// returns false if the data is corrupt.
+bool decode (const uint8_t* data, size_t data_size,
+	     void* pixels, unsigned int bytes_per_line,
+	     const utils::vec2<unsigned int>& size, img::pixel_format pf);
+
+// the lz77 codec on its own.  'decompress' needs the exact size of the
+// uncompressed data and returns false if the data is corrupt.
+void compress (const uint8_t* src, size_t src_size, std::vector<uint8_t>& out);
+
+bool decompress (const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size);
+
+} // namespace tile_codec
+
+#endif // includeguard_tile_codec_hpp_includeguard
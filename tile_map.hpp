@@ -0,0 +1,239 @@
+#ifndef includeguard_tile_map_hpp_includeguard
+#define includeguard_tile_map_hpp_includeguard
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+// a hash map from the 64 bit keys of tiles to values, with an lru list
+// through some of the entries.  it's used for the tiles of a cache, which
+// are looked up several times per frame.
+//
+// the values are stored in a pool of nodes, which are addressed by handles.
+// a handle stays valid until its entry is erased, also when other entries
+// are inserted or erased.  references to the values are invalidated by
+// inserting.  the keys are looked up by open addressing with linear probing
+// in a table of (key, handle) pairs, which is kept at most half full.  the
+// lru list is linked through the nodes, so that moving an entry to the
+// front doesn't allocate anything.
+
+template <typename T>
+class tile_map
+{
+public:
+  typedef unsigned int handle;
+  static constexpr handle npos = ~0u;
+
+  tile_map (void) = default;
+
+  size_t size (void) const { return m_size; }
+  bool empty (void) const { return m_size == 0; }
+
+  // returns npos if the key is not in the map.
+  handle find (uint64_t key) const
+  {
+    if (m_size == 0)
+      return npos;
+
+    for (size_t i = home (key); ; i = (i + 1) & m_mask)
+    {
+      if (m_buckets[i].node == npos)
+	return npos;
+      if (m_buckets[i].key == key)
+	return m_buckets[i].node;
+    }
+  }
+
+  // the key must not be in the map yet.  the entry is not in the lru list.
+  handle insert (uint64_t key, T val)
+  {
+    if ((m_size + 1) * 2 > m_buckets.size ())
+      rehash (m_buckets.empty () ? min_buckets : m_buckets.size () * 2);
+
+    handle h = m_free;
+    if (h != npos)
+      m_free = m_nodes[h].next;
+    else
+    {
+      h = (handle)m_nodes.size ();
+      m_nodes.emplace_back ();
+    }
+
+    node& n = m_nodes[h];
+    n.key = key;
+    n.value = std::move (val);
+    n.used = true;
+    n.linked = false;
+
+    size_t i = home (key);
+    while (m_buckets[i].node != npos)
+      i = (i + 1) & m_mask;
+
+    m_buckets[i].key = key;
+    m_buckets[i].node = h;
+    m_size += 1;
+
+    return h;
+  }
+
+  void erase (handle h)
+  {
+    node& n = m_nodes[h];
+    lru_remove (h);
+
+    // the entries after the erased one are shifted back, so that there are
+    // no gaps in their probe sequences.
+    size_t i = home (n.key);
+    while (m_buckets[i].node != h)
+      i = (i + 1) & m_mask;
+
+    for (size_t j = (i + 1) & m_mask; m_buckets[j].node != npos; j = (j + 1) & m_mask)
+    {
+      const size_t k = home (m_buckets[j].key);
+      if (((j - k) & m_mask) >= ((j - i) & m_mask))
+      {
+	m_buckets[i] = m_buckets[j];
+	i = j;
+      }
+    }
+
+    m_buckets[i].node = npos;
+    m_size -= 1;
+
+    n.value = T ();
+    n.used = false;
+    n.next = m_free;
+    m_free = h;
+  }
+
+  // keeps the memory of the table.
+  void clear (void)
+  {
+    for (auto&& b : m_buckets)
+      b.node = npos;
+
+    m_nodes.clear ();
+    m_size = 0;
+    m_free = npos;
+    m_lru_front = npos;
+    m_lru_back = npos;
+  }
+
+  uint64_t key (handle h) const { return m_nodes[h].key; }
+  T& operator [] (handle h) { return m_nodes[h].value; }
+  const T& operator [] (handle h) const { return m_nodes[h].value; }
+
+  // call 'func (key, value)' for all entries.
+  template <typename F> void for_each (F&& func)
+  {
+    for (auto&& n : m_nodes)
+      if (n.used)
+	func (n.key, n.value);
+  }
+
+  // the lru list.  moves the entry to the front, also if it's in the list
+  // already.
+  void lru_push_front (handle h)
+  {
+    if (m_nodes[h].linked)
+    {
+      if (m_lru_front == h)
+	return;
+      lru_remove (h);
+    }
+
+    node& n = m_nodes[h];
+    n.linked = true;
+    n.prev = npos;
+    n.next = m_lru_front;
+
+    if (m_lru_front != npos)
+      m_nodes[m_lru_front].prev = h;
+    else
+      m_lru_back = h;
+
+    m_lru_front = h;
+  }
+
+  // does nothing if the entry is not in the lru list.
+  void lru_remove (handle h)
+  {
+    node& n = m_nodes[h];
+    if (!n.linked)
+      return;
+
+    if (n.prev != npos)
+      m_nodes[n.prev].next = n.next;
+    else
+      m_lru_front = n.next;
+
+    if (n.next != npos)
+      m_nodes[n.next].prev = n.prev;
+    else
+      m_lru_back = n.prev;
+
+    n.linked = false;
+  }
+
+  bool lru_empty (void) const { return m_lru_back == npos; }
+
+  // the least recently used entry.  npos if the list is empty.
+  handle lru_back (void) const { return m_lru_back; }
+
+private:
+  static constexpr size_t min_buckets = 64;
+
+  struct node
+  {
+    uint64_t key = 0;
+    T value = T ();
+
+    // the lru list, or the next free node.
+    handle prev = npos;
+    handle next = npos;
+
+    bool used = false;
+    bool linked = false;
+  };
+
+  struct bucket
+  {
+    uint64_t key = 0;
+    handle node = npos;
+  };
+
+  std::vector<node> m_nodes;
+  std::vector<bucket> m_buckets;
+  size_t m_mask = 0;
+  size_t m_size = 0;
+
+  handle m_free = npos;
+  handle m_lru_front = npos;
+  handle m_lru_back = npos;
+
+  // the keys of neighbouring tiles differ only in a few bits.  a
+  // multiplicative hash spreads them over the table.
+  size_t home (uint64_t key) const
+  {
+    return (size_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & m_mask;
+  }
+
+  void rehash (size_t num_buckets)
+  {
+    std::vector<bucket> old (num_buckets);
+    std::swap (old, m_buckets);
+    m_mask = num_buckets - 1;
+
+    for (auto&& b : old)
+      if (b.node != npos)
+      {
+	size_t i = home (b.key);
+	while (m_buckets[i].node != npos)
+	  i = (i + 1) & m_mask;
+	m_buckets[i] = b;
+      }
+  }
+};
+
+#endif // includeguard_tile_map_hpp_includeguard
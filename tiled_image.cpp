@@ -35,11 +35,17 @@ use max texture size: 4096 x 4096
 #include <condition_variable>
 #include <chrono>
 #include <limits>
+#include <cmath>
 #include <iostream>
 #include <algorithm>
+#include <fstream>
 #include <experimental/numeric>
 
 #include "tiled_image.hpp"
+#include "mapped_arena.hpp"
+#include "bc1_codec.hpp"
+#include "encoded_tile_cache.hpp"
+#include "render_stats.hpp"
 #include "img/bmp_loader.hpp"
 #include "img/raw_loader.hpp"
 #include "utils/langcomp.hpp"
@@ -56,6 +62,23 @@ using img::load_bmp_image;
 using img::load_raw_image;
 using img::pixel_format;
 
+constexpr size_t tiled_image::encoded_color_tile_budget;
+
+// ----------------------------------------------------------------------------
+
+// result of clip_copy_area, same as the result of img::image::copy_to.
+struct tiled_image_copy_area
+{
+  vec2<unsigned int> src_top_left;
+  vec2<unsigned int> dst_top_left;
+  vec2<unsigned int> size;
+};
+
+static tiled_image_copy_area
+clip_copy_area (const vec2<unsigned int>& src_img_size,
+		const vec2<unsigned int>& src_xy, const vec2<unsigned int>& src_size,
+		const vec2<unsigned int>& dst_img_size, const vec2<int>& dst_xy);
+
 // ----------------------------------------------------------------------------
 
 struct tiled_image::texture_key
@@ -64,6 +87,7 @@ struct tiled_image::texture_key
   vec2<unsigned int> img_pos;
 
   // assume that image coorindates are max. 29 bits (536870912 x 536870912 pixels)
+  // and that there are max. 64 levels (see lod_levels_for_size).
   uint64_t packed;
 
   texture_key (void) = default;
@@ -76,6 +100,13 @@ struct tiled_image::texture_key
 	     | (((uint64_t)p.y & ((1u << 29)-1)) << (6+29));
   }
 
+  explicit texture_key (uint64_t p)
+  : lod (p & 63),
+    img_pos ((p >> 6) & ((1u << 29)-1), (p >> (6+29)) & ((1u << 29)-1)),
+    packed (p)
+  {
+  }
+
   bool operator < (const texture_key& rhs) const
   {
     return packed < rhs.packed;
@@ -546,7 +577,12 @@ struct tiled_image::shader : public gl::shader
   uniform< float, highp > zscale;
   uniform< vec2<float>, highp > tile_scale;
   uniform< vec2<float>, highp > texture_scale;
+  uniform< float, highp > texel_scale;
   uniform< vec2<float>, highp > texture_border;
+  uniform< vec2<float>, highp > color_texture_offset;
+  uniform< vec2<float>, highp > height_texture_offset;
+  uniform< float, highp > height_value_scale;
+  uniform< float, highp > height_value_offset;
 
   attribute< vec2<float>, highp > pos;
 
@@ -562,7 +598,12 @@ struct tiled_image::shader : public gl::shader
     named_parameter (zscale);
     named_parameter (tile_scale);
     named_parameter (texture_scale);
+    named_parameter (texel_scale);
     named_parameter (texture_border);
+    named_parameter (color_texture_offset);
+    named_parameter (height_texture_offset);
+    named_parameter (height_value_scale);
+    named_parameter (height_value_offset);
   }
 
   virtual std::vector<const char*> vertex_shader_text_str (void) override { return { linenum_prefix R"gltext(
@@ -575,10 +616,15 @@ struct tiled_image::shader : public gl::shader
       // but that requires min. gles 3
       vec2 p = abs (pos);
 
-      color_uv = (p + texture_border) * texture_scale;
-      vec2 z_uv = (p + texture_border + min (sign (pos), vec2 (0.0))) * texture_scale;
+      // with the textures of a lower detail level, the tile covers a part
+      // of the texture, which is scaled by 'texel_scale'.
+      color_uv = (p * texel_scale + texture_border + color_texture_offset) * texture_scale;
+      vec2 z_uv = ((p + min (sign (pos), vec2 (0.0))) * texel_scale
+		   + texture_border + height_texture_offset) * texture_scale;
 
-      float height = max (0.0, texture2D (height_texture, z_uv).r);
+      // the height texture of the tile might be stored with fewer bits.
+      float height = max (0.0, texture2D (height_texture, z_uv).r * height_value_scale
+			       + height_value_offset);
       gl_Position = mvp * vec4 (p * tile_scale, height * zscale + zbias, 1.0);
     }
 
@@ -627,9 +673,11 @@ struct tiled_image::heightmap_shader : public tiled_image::shader
       // but that requires min. gles 3
       vec2 p = abs (pos);
 
-      vec2 z_uv = (p + texture_border + min (sign (pos), vec2 (0.0))) * texture_scale;
+      vec2 z_uv = ((p + min (sign (pos), vec2 (0.0))) * texel_scale
+		   + texture_border + height_texture_offset) * texture_scale;
 
-      float height = clamp (texture2D (height_texture, z_uv).r,
+      float height = clamp (texture2D (height_texture, z_uv).r * height_value_scale
+			    + height_value_offset,
 			    heightmap_min_val, heightmap_max_val);
 
       color_uv = vec2 ((height - heightmap_min_val) * heightmap_texture_scale, 0.0);
@@ -657,108 +705,162 @@ std::shared_ptr<tiled_image::heightmap_shader> tiled_image::g_heightmap_shader;
 
 // ----------------------------------------------------------------------------
 
-void tiled_image::load_texture_tile::operator () (const texture_key& k, gl::texture& tex)
+void tiled_image::prepare_texture_tile (mipmap_pyramid& pyramid, std::mutex& mutex,
+					uint64_t key, tile_cache::texture_data& out)
 {
-//  std::cout << "load_texture_tile "
-//	    << k.lod << " " << k.img_pos.x << "," << k.img_pos.y << std::endl;
+  const texture_key k (key);
 
-  auto&& img = m_img.get ()[k.lod];
+  std::lock_guard<std::mutex> lock (mutex);
 
-  if (tex.empty () || tex.format () != img.texture_format ())
+  auto&& level = pyramid[k.lod];
+  out.format = level.texture_format ();
+  out.generation = pyramid.generation (k.lod, k.img_pos);
+
+  // this also brings the tile up to date in lazy mode.
+  if (pyramid.constant (k.lod, k.img_pos, out.value))
   {
-    tex = gl::texture (img.texture_format (), { texture_tile_size + texture_border * 2 });
-    tex.set_address_mode_u (gl::texture::clamp);
-    tex.set_address_mode_v (gl::texture::clamp);
-    tex.set_min_filter (gl::texture::linear);
-    tex.set_mag_filter (gl::texture::linear);
+    out.constant = true;
+    return;
   }
 
   // the image position in the key is in the lod=0 coordinate system.
-  // the actual position depends on the lod value.
-  auto&& subimg_pos_tl = vec2<int> (k.img_pos >> k.lod) - texture_border;
-  auto&& subimg_pos_br = subimg_pos_tl + texture_tile_size + texture_border * 2;
-
-  vec2<int> tex_pos (0);
+  // the actual position depends on the lod value.  the texel data is the
+  // same for the cpu image format and the texture format.
+  out.pixels = image (level.format (), { texture_tile_size + texture_border * 2 });
+  level.copy_tile ((k.img_pos >> k.lod) / texture_tile_size, out.pixels);
+}
 
-  bool replicate_top_edge = false;
-  bool replicate_left_edge = false;
-  bool replicate_bottom_edge = false;
-  bool replicate_right_edge = false;
+void tiled_image::compress_color_texture (tile_cache::texture_data& d, uint64_t key,
+					  encoded_tile_cache* encoded, uint64_t stamp,
+					  render_stats* stats)
+{
+  if (d.constant || d.pixels.format () != pixel_format::rgba8)
+    return;
 
-  // at the image edges we can't take any border pixels from
-  // the source image and thus have to replicate pixel stripes.
-  if (subimg_pos_tl.x < 0)
+  if (!encoded->find (key, d.blocks))
   {
-    tex_pos.x += 0 - subimg_pos_tl.x;
-    replicate_left_edge = true;
-  }
-  if (subimg_pos_tl.y < 0)
-  {
-    tex_pos.y += 0 - subimg_pos_tl.y;
-    replicate_top_edge = true;
+    const auto t0 = std::chrono::steady_clock::now ();
+
+    d.blocks.resize (bc1_codec::encoded_size (d.pixels.size ()));
+    bc1_codec::encode (d.pixels.data (), d.pixels.bytes_per_line (), d.pixels.size (),
+		       d.blocks.data ());
+    encoded->insert (key, d.blocks, stamp);
+
+    if (stats != nullptr)
+    {
+      render_stats::add (stats->color_textures_encoded, 1);
+      render_stats::add (stats->color_encode_usec,
+			 (uint64_t)std::chrono::duration_cast<std::chrono::microseconds> (
+				std::chrono::steady_clock::now () - t0).count ());
+    }
   }
 
-  if (subimg_pos_br.x >= (int)img.size ().x)
-    replicate_right_edge = true;
-  if (subimg_pos_br.y >= (int)img.size ().y)
-    replicate_bottom_edge = true;
+  if (stats != nullptr)
+    render_stats::add (stats->compressed_color_textures, 1);
+
+  d.compressed = true;
+  d.pixels = image ();
+}
+
+void tiled_image::quantize_height_texture (tile_cache::texture_data& d, float max_error,
+					   render_stats* stats)
+{
+  if (d.constant)
+    return;
+
+  if (stats != nullptr)
+    render_stats::add (stats->height_textures, 1);
 
-  auto&& subimg = img.subimg (subimg_pos_tl,
-			      { texture_tile_size + texture_border*2});
+  // the texels are floats or 16 bit integers, which are sampled
+  // normalized.  all texels are used, including the border.
+  const bool normalized = d.pixels.format () == pixel_format::r16ui;
+  const vec2<unsigned int> sz = d.pixels.size ();
 
-  tex.upload (subimg.data (), tex_pos, subimg.size (), subimg.bytes_per_line ());
+  std::vector<float> vals;
+  vals.reserve ((size_t)sz.x * sz.y);
 
-  // replicate more than 1 border pixel because of geometry skirt.
-  if (replicate_left_edge)
+  for (unsigned int y = 0; y < sz.y; ++y)
   {
-    auto&& i = img.subimg ({ 0, subimg_pos_tl.y }, { 1, texture_tile_size + texture_border*2 });
-    tex.upload (i.data (), { texture_border - 1, tex_pos.y }, i.size (), i.bytes_per_line ());
-    tex.upload (i.data (), { texture_border - 2, tex_pos.y }, i.size (), i.bytes_per_line ());
+    const char* line = (const char*)d.pixels.data () + (size_t)y * d.pixels.bytes_per_line ();
+    for (unsigned int x = 0; x < sz.x; ++x)
+      vals.push_back (normalized ? (float)((const uint16_t*)line)[x] : ((const float*)line)[x]);
   }
-  if (replicate_top_edge)
+
+  float min_val = std::numeric_limits<float>::infinity ();
+  float max_val = -min_val;
+  bool integers = true;
+
+  for (float v : vals)
   {
-    auto&& i = img.subimg ({ subimg_pos_tl.x, 0 }, { texture_tile_size + texture_border*2, 1 });
-    tex.upload (i.data (), { tex_pos.x, texture_border - 1 }, i.size (), i.bytes_per_line ());
-    tex.upload (i.data (), { tex_pos.x, texture_border - 2 }, i.size (), i.bytes_per_line ());
+    if (!std::isfinite (v))
+      return;
+
+    min_val = std::min (min_val, v);
+    max_val = std::max (max_val, v);
+    integers &= v == std::floor (v);
   }
-  if (replicate_right_edge)
+
+  const float range = max_val - min_val;
+
+  // try 8 and then 16 bits per texel.  the texel value q is sampled as
+  // q / max_q and mapped back to min_val + q * step.  integer heights in a
+  // small enough range are stored without loss.  16 bits don't save
+  // anything with 16 bit integer heights.
+  for (const unsigned int max_q : { 255u, 65535u })
   {
-    auto&& i = img.subimg ({ img.size ().x - 1, subimg_pos_tl.y }, { 1, texture_tile_size + texture_border*2 });
+    if (normalized && max_q == 65535)
+      break;
 
-    int d = subimg_pos_br.x - (int)img.size ().x - texture_border;
+    const bool lossless = integers && range <= max_q;
+    if (!lossless && !(max_error > 0))
+      continue;
 
-    tex.upload (i.data (), { texture_border + texture_tile_size - d, tex_pos.y },
-		i.size (), i.bytes_per_line ());
+    const float step = lossless || range == 0 ? 1.0f : range / max_q;
+    const float scale = max_q * step;
 
-    tex.upload (i.data (), { texture_border + texture_tile_size - d + 1, tex_pos.y },
-		i.size (), i.bytes_per_line ());
-  }
-  if (replicate_bottom_edge)
-  {
-    auto&& i = img.subimg ({ subimg_pos_tl.x, img.size ().y - 1 }, { texture_tile_size + texture_border*2, 1 });
+    image out (max_q == 255 ? pixel_format::r8 : pixel_format::r16ui, sz);
+    float err = 0;
 
-    int d = subimg_pos_br.y - (int)img.size ().y - texture_border;
+    for (unsigned int y = 0; y < sz.y && err <= max_error; ++y)
+    {
+      char* line = (char*)out.data () + (size_t)y * out.bytes_per_line ();
+      for (unsigned int x = 0; x < sz.x; ++x)
+      {
+	const float v = vals[(size_t)y * sz.x + x];
+	const float q = std::min (std::floor ((v - min_val) / step + 0.5f), (float)max_q);
 
-    tex.upload (i.data (), { tex_pos.x, texture_border + texture_tile_size - d },
-		i.size (), i.bytes_per_line ());
+	// like the vertex shader does it.
+	err = std::max (err, std::abs (min_val + q / max_q * scale - v));
 
-    tex.upload (i.data (), { tex_pos.x, texture_border + texture_tile_size - d + 1},
-		i.size (), i.bytes_per_line ());
-  }
-/*
-FIXME: replicate corners, too
-  if (replicate_bottom_edge && replicate_right_edge && 0)
-  {
-    auto&& i = img.subimg (vec2<int> (img.size ()) - 1, { 1 });
+	if (max_q == 255)
+	  ((uint8_t*)line)[x] = (uint8_t)q;
+	else
+	  ((uint16_t*)line)[x] = (uint16_t)q;
+      }
+    }
+
+    if (err > max_error)
+      continue;
 
-    auto&& d = subimg_pos_br - vec2<int> (img.size ()) - texture_border;
+    if (stats != nullptr)
+    {
+      render_stats::add (stats->quantized_height_textures, 1);
+      render_stats::add (stats->quantized_height_bytes_saved,
+			 cpu_image::storage_size (d.pixels.format (), sz, cpu_image::layout::linear)
+			 - cpu_image::storage_size (out.format (), sz, cpu_image::layout::linear));
+      render_stats::set_max (stats->max_height_error_millionths,
+			     (uint64_t)std::ceil (err * 1000000.0));
+    }
 
-    // have to replicate 1 corner pixel -> 4 corner pixels here ...
+    // the normalized 16 bit heights are sampled as h / 65535.
+    const float k = normalized ? 1.0f / 65535.0f : 1.0f;
 
-    tex.upload (i.data (), texture_border + texture_tile_size - d,
-		i.size (), i.bytes_per_line ());
+    d.format = max_q == 255 ? pixel_format::r8 : pixel_format::r16;
+    d.pixels = std::move (out);
+    d.value_scale = scale * k;
+    d.value_offset = min_val * k;
+    return;
   }
-*/
 }
 
 // ----------------------------------------------------------------------------
@@ -767,9 +869,11 @@ tiled_image::tiled_image (bool use_uint16_heightmap)
 : tiled_image (vec2<uint32_t> (0, 0), use_uint16_heightmap) { }
 
 tiled_image::tiled_image (const vec2<uint32_t>& size, bool use_uint16_heightmap)
-: m_size (size),
-  m_rgb_texture_cache (load_texture_tile (m_rgb_image), 1024),
-  m_height_texture_cache (load_texture_tile (m_height_image), 1024)
+: tiled_image (size, use_uint16_heightmap, storage_params ()) { }
+
+tiled_image::tiled_image (const vec2<uint32_t>& size, bool use_uint16_heightmap,
+			  const storage_params& storage)
+: m_size (size)
 {
   if (size.x == 0 || size.y == 0)
     return;
@@ -802,31 +906,110 @@ tiled_image::tiled_image (const vec2<uint32_t>& size, bool use_uint16_heightmap)
   //                     extend int to float
 
   const auto z_texture_cpu_format = use_uint16_heightmap ? pixel_format::r16ui : pixel_format::r32f;
-  const auto z_texture_gpu_format = use_uint16_heightmap ? pixel_format::r16 : pixel_format::r32f;
-  m_texture_z_scale = use_uint16_heightmap ? 65536.0f : 1.0f;
 
+  const unsigned int num_levels = lod_levels_for_size (size);
+
+  // the lower detail levels might use other formats.
+  std::vector<pixel_format> color_format (num_levels, pixel_format::invalid);
+  std::vector<pixel_format> height_format (num_levels, pixel_format::invalid);
+
+  m_texture_z_scale.resize (num_levels);
+  m_height_texel_scale.resize (num_levels);
+
+  for (unsigned int i = 0; i < num_levels; ++i)
+  {
+    if (i < storage.level_formats.size ())
+    {
+      color_format[i] = storage.level_formats[i].color;
+      height_format[i] = storage.level_formats[i].height;
+    }
+
+    if (color_format[i] == pixel_format::invalid)
+      color_format[i] = color_texture_format;
+
+    if (height_format[i] == pixel_format::invalid)
+      height_format[i] = z_texture_cpu_format;
+
+    if (color_format[i] != pixel_format::rgba8 && color_format[i] != pixel_format::r5_g6_b5)
+      throw std::invalid_argument ("tiled_image: unsupported color format");
+
+    if (height_format[i] != pixel_format::r32f && height_format[i] != pixel_format::r16ui)
+      throw std::invalid_argument ("tiled_image: unsupported height format");
+
+    const bool normalized = cpu_image::default_texture_format (height_format[i]) == pixel_format::r16;
+    m_texture_z_scale[i] = normalized ? 65536.0f : 1.0f;
+    m_height_texel_scale[i] = normalized ? 1.0f / 65535.0f : 1.0f;
+  }
+
+  // the tiles are compressed brick by brick.  with a file backed image the
+  // file is the tier for the inactive tiles already.
+  auto layout = storage.layout;
+
+  if (storage.compressed_tier_budget > 0 && !storage.file_backed)
+  {
+    // split the budget according to the pixel sizes.
+    const size_t rgb_bpp = cpu_image::storage_size (color_format[0], { 1, 1 },
+						    cpu_image::layout::linear);
+    const size_t height_bpp = cpu_image::storage_size (height_format[0], { 1, 1 },
+						       cpu_image::layout::linear);
+    const size_t rgb_budget = storage.compressed_tier_budget / (rgb_bpp + height_bpp) * rgb_bpp;
+
+    m_rgb_tier = std::make_unique<compressed_tier> (std::max<size_t> (rgb_budget, 1));
+    m_height_tier = std::make_unique<compressed_tier> (
+			std::max<size_t> (storage.compressed_tier_budget - rgb_budget, 1));
+
+    layout = cpu_image::layout::bricked;
+  }
+
+  // the mipmaps are not cleared.  the arena only reserves the memory and
+  // unwritten memory is zero.  thus creating an image takes the same time
+  // regardless of the image size.
   {
+    size_t capacity = 0;
+
     vec2<unsigned int> sz (size);
-    for (unsigned int i = 0; i < max_lod_level && sz.x > 0 && sz.y > 0;
+    for (unsigned int i = 0; i < num_levels && sz.x > 0 && sz.y > 0;
 	 ++i, sz /= 2)
     {
-      std::cout << "tiled_image new mipmap level " << sz.x << " x " << sz.y << std::endl;
-/*
-      // for lower levels, use lower color resolution images.
-      m_rgb_image[i] = image (sz.x <= 512 || sz.y <= 512
-			      ? pixel_format::rgb5
-			      : pixel_format::rgba8, sz);
-*/
-      m_rgb_image[i] = cpu_image (color_texture_format, sz, color_texture_format);
-      m_rgb_image[i].fill ({ 0 });
+      capacity += cpu_image::storage_size (color_format[i], sz, layout)
+		  + mapped_arena::alignment;
+      capacity += cpu_image::storage_size (height_format[i], sz, layout)
+		  + mapped_arena::alignment;
+    }
+
+    m_arena = storage.file_backed
+	      ? std::make_unique<mapped_arena> (storage.backing_file_dir, capacity,
+						storage.resident_budget)
+	      : std::make_unique<mapped_arena> (capacity);
+  }
 
-      m_height_image[i] = cpu_image (z_texture_cpu_format, sz, z_texture_gpu_format);
-      m_height_image[i].fill ({ 0 });
+  m_rgb_image.resize (num_levels);
+  m_height_image.resize (num_levels);
+
+  {
+    vec2<unsigned int> sz (size);
+    for (unsigned int i = 0; i < num_levels && sz.x > 0 && sz.y > 0;
+	 ++i, sz /= 2)
+    {
+      std::cout << "tiled_image new mipmap level " << sz.x << " x " << sz.y
+		<< " " << color_format[i] << " " << height_format[i] << std::endl;
+
+      m_rgb_image[i] = cpu_image (color_format[i], sz,
+				  cpu_image::default_texture_format (color_format[i]),
+				  layout, m_arena.get (), m_rgb_tier.get ());
+
+      m_height_image[i] = cpu_image (height_format[i], sz,
+				     cpu_image::default_texture_format (height_format[i]),
+				     layout, m_arena.get (), m_height_tier.get ());
     }
   }
 
+  m_height_range = minmax_pyramid (size);
+
   // setup tiles
-  for (unsigned int i = 0; i < max_lod_level; ++i)
+  m_tiles.resize (num_levels);
+
+  for (unsigned int i = 0; i < num_levels; ++i)
   {
     const auto physical_tile_size = tile_grid_size << i;
 
@@ -847,7 +1030,7 @@ tiled_image::tiled_image (const vec2<uint32_t>& size, bool use_uint16_heightmap)
   }
 
   // link tiles
-  for (unsigned int i = max_lod_level-1; i > 0; --i)
+  for (unsigned int i = num_levels-1; i > 0; --i)
   {
     const auto physical_tile_size = tile_grid_size << i;
     auto num_tiles = (size + (physical_tile_size-1)) / physical_tile_size;
@@ -887,38 +1070,77 @@ tiled_image::tiled_image (const vec2<uint32_t>& size, bool use_uint16_heightmap)
       }
   }
 
+  // one job prepares both textures of a tile.  the two workers prepare
+  // any of the requested tiles, two tiles at a time.
+  m_workers = std::make_unique<worker_pool> (2);
+  create_texture_cache ();
 }
 
 
+unsigned int tiled_image::lod_levels_for_size (const vec2<uint32_t>& size)
+{
+  if (size.x == 0 || size.y == 0)
+    return 0;
+
+  // the texture keys can address up to 64 levels.
+  unsigned int n = 1;
+  while (n < 64 && (uint64_t)tile_grid_size << (n - 1) < std::max (size.x, size.y))
+    n += 1;
+
+  return n;
+}
+
 tiled_image::tiled_image (tiled_image&& rhs)
-: m_size (std::move (rhs.m_size)),
-  m_rgb_image (std::move (rhs.m_rgb_image)),
-  m_height_image (std::move (rhs.m_height_image)),
-  m_shader (std::move (rhs.m_shader)),
-  m_heightmap_shader (std::move (rhs.m_heightmap_shader)),
-  m_tiles (std::move (rhs.m_tiles)),
-  m_rgb_texture_cache (std::move (rhs.m_rgb_texture_cache)),
-  m_height_texture_cache (std::move (rhs.m_height_texture_cache)),
-  m_candidate_tiles (std::move (rhs.m_candidate_tiles)),
-  m_visible_tiles (std::move (rhs.m_visible_tiles))
+: tiled_image ()
 {
-  rhs.m_size = { 0 };
+  *this = std::move (rhs);
 }
 
 tiled_image& tiled_image::operator = (tiled_image&& rhs)
 {
   if (this != &rhs)
   {
+    // the workers must not use the mipmaps while they are moved.  the
+    // textures are reloaded by the new caches.
+    m_texture_cache = nullptr;
+    rhs.m_texture_cache = nullptr;
+
     m_size = std::move (rhs.m_size);
+    m_texture_z_scale = rhs.m_texture_z_scale;
+    m_height_texel_scale = rhs.m_height_texel_scale;
     m_rgb_image = std::move (rhs.m_rgb_image);
     m_height_image = std::move (rhs.m_height_image);
+    m_height_range = std::move (rhs.m_height_range);
+    m_arena = std::move (rhs.m_arena);
+    m_rgb_tier = std::move (rhs.m_rgb_tier);
+    m_height_tier = std::move (rhs.m_height_tier);
     m_shader = std::move (rhs.m_shader);
     m_heightmap_shader = std::move (rhs.m_heightmap_shader);
     m_tiles = std::move (rhs.m_tiles);
-    m_rgb_texture_cache = std::move (rhs.m_rgb_texture_cache);
-    m_height_texture_cache = std::move (rhs.m_height_texture_cache);
+    m_workers = std::move (rhs.m_workers);
+    m_upload_budget_bytes = rhs.m_upload_budget_bytes;
+    m_upload_budget_seconds = rhs.m_upload_budget_seconds;
+    m_texture_cache_budget = rhs.m_texture_cache_budget;
+    m_texture_staging_budget = rhs.m_texture_staging_budget;
+    m_pinned_texture_levels = rhs.m_pinned_texture_levels;
+    m_max_height_error = rhs.m_max_height_error;
+    m_compressed_color_textures = rhs.m_compressed_color_textures;
+    m_encoded_color_tiles = std::move (rhs.m_encoded_color_tiles);
+    m_texture_eviction_policy = rhs.m_texture_eviction_policy;
+    m_texture_trace = std::move (rhs.m_texture_trace);
+    m_stats = rhs.m_stats;
     m_candidate_tiles = std::move (rhs.m_candidate_tiles);
     m_visible_tiles = std::move (rhs.m_visible_tiles);
+    m_prefetch_tiles = std::move (rhs.m_prefetch_tiles);
+
+    // the textures of the last frame were in the old caches.
+    m_drawn_textures.clear ();
+    rhs.m_drawn_textures.clear ();
+    m_num_missing_tiles = 0;
+    rhs.m_num_missing_tiles = 0;
+
+    if (m_workers != nullptr)
+      create_texture_cache ();
 
     if (g_shader != nullptr && g_shader.use_count () == 1)
       g_shader = nullptr;
@@ -928,6 +1150,219 @@ tiled_image& tiled_image::operator = (tiled_image&& rhs)
   return *this;
 }
 
+void tiled_image::create_texture_cache (void)
+{
+  // the workers get their own copies of the settings, which are fixed for
+  // the cache.  the stats can be replaced.
+  const float max_height_error = m_max_height_error;
+  encoded_tile_cache* const encoded = m_compressed_color_textures
+				      ? m_encoded_color_tiles.get () : nullptr;
+
+  m_worker_stats = m_stats;
+
+  m_texture_cache = std::make_unique<tile_cache> (*m_workers,
+	[this, max_height_error, encoded] (uint64_t key, tile_cache::tile_data& out)
+	{
+	  render_stats* const stats = m_worker_stats.load ();
+	  const uint64_t stamp = encoded != nullptr ? encoded->stamp () : 0;
+
+	  prepare_texture_tile (m_rgb_image, m_rgb_image_mutex, key, out[tile_cache::color]);
+	  if (encoded != nullptr)
+	    compress_color_texture (out[tile_cache::color], key, encoded, stamp, stats);
+
+	  prepare_texture_tile (m_height_image, m_height_image_mutex, key, out[tile_cache::height]);
+	  quantize_height_texture (out[tile_cache::height], max_height_error, stats);
+	}, m_texture_cache_budget, texture_tile_size + texture_border * 2);
+
+  m_texture_cache->set_max_staged_bytes (m_texture_staging_budget);
+  m_texture_cache->set_eviction_policy (m_texture_eviction_policy, &texture_tile_cost);
+  m_texture_cache->set_trace (m_texture_trace.get ());
+  m_texture_cache->set_stats (m_stats);
+
+  pin_textures ();
+}
+
+void tiled_image::pin_textures (void)
+{
+  if (m_texture_cache == nullptr)
+    return;
+
+  const size_t texels = (size_t)(texture_tile_size + texture_border * 2)
+			* (texture_tile_size + texture_border * 2);
+  size_t bytes = 0;
+
+  for (unsigned int i = 0; i < std::min (m_pinned_texture_levels, num_lod_levels ()); ++i)
+  {
+    const unsigned int lvl = num_lod_levels () - 1 - i;
+
+    bytes += texels * m_tiles[lvl].size ()
+	     * (m_rgb_image[lvl].bytes_per_pixel () + m_height_image[lvl].bytes_per_pixel ());
+    if (bytes > m_texture_cache_budget / 4)
+      break;
+
+    for (auto&& t : m_tiles[lvl])
+      if (m_rgb_image.written (lvl, t.pos ()) || m_height_image.written (lvl, t.pos ()))
+	m_texture_cache->pin (texture_key (lvl, t.pos ()).packed);
+  }
+}
+
+void tiled_image::set_pinned_texture_levels (unsigned int val)
+{
+  m_pinned_texture_levels = val;
+
+  if (m_texture_cache != nullptr)
+  {
+    m_texture_cache->unpin_all ();
+    pin_textures ();
+  }
+}
+
+double tiled_image::texture_tile_cost (uint64_t key)
+{
+  return std::ldexp (1.0, (int)texture_key (key).lod);
+}
+
+void tiled_image::set_texture_eviction_policy (eviction_policy::kind val)
+{
+  m_texture_eviction_policy = val;
+
+  if (m_texture_cache != nullptr)
+  {
+    m_texture_cache->set_eviction_policy (val, &texture_tile_cost);
+    pin_textures ();
+  }
+}
+
+void tiled_image::set_texture_trace (const std::string& filename)
+{
+  if (m_texture_cache != nullptr)
+    m_texture_cache->set_trace (nullptr);
+
+  m_texture_trace = nullptr;
+
+  if (filename.empty ())
+    return;
+
+  auto f = std::make_unique<std::ofstream> (filename);
+  if (!f->is_open ())
+  {
+    std::cerr << "tiled_image: can't write texture trace " << filename << std::endl;
+    return;
+  }
+
+  m_texture_trace = std::move (f);
+
+  if (m_texture_cache != nullptr)
+    m_texture_cache->set_trace (m_texture_trace.get ());
+}
+
+void tiled_image::set_stats (render_stats* val)
+{
+  m_stats = val;
+  m_worker_stats = val;
+
+  if (m_texture_cache != nullptr)
+    m_texture_cache->set_stats (val);
+
+  if (m_stats == nullptr)
+    return;
+
+  size_t bytes = 0;
+  for (auto* img : { &m_rgb_image, &m_height_image })
+    for (unsigned int i = 0; i < img->size (); ++i)
+    {
+      auto&& l = (*img)[i];
+      bytes += cpu_image::storage_size (l.format (), l.size (), l.storage_layout ());
+    }
+
+  render_stats::set (m_stats->cpu_image_bytes, bytes);
+  render_stats::set (m_stats->gpu_texture_bytes,
+		     m_texture_cache != nullptr ? m_texture_cache->page_bytes () : 0);
+  render_stats::set (m_stats->staged_texture_bytes,
+		     m_texture_cache != nullptr ? m_texture_cache->staged_bytes () : 0);
+}
+
+void tiled_image::count_update (const std::vector<update_region>& regions,
+				std::chrono::steady_clock::time_point start) const
+{
+  if (m_stats == nullptr)
+    return;
+
+  const auto usec = std::chrono::duration_cast<std::chrono::microseconds> (
+			std::chrono::steady_clock::now () - start).count ();
+
+  render_stats::add (m_stats->num_updates, 1);
+  render_stats::add (m_stats->ingest_usec, (uint64_t)usec);
+
+  if (!regions.empty () && regions[0].tl.x < regions[0].br.x && regions[0].tl.y < regions[0].br.y)
+  {
+    const auto sz = regions[0].br - regions[0].tl;
+    render_stats::add (m_stats->ingest_pixels, (uint64_t)sz.x * sz.y);
+  }
+}
+
+void tiled_image::set_texture_cache_budget (size_t val)
+{
+  m_texture_cache_budget = val;
+
+  if (m_texture_cache != nullptr)
+  {
+    m_texture_cache->set_max_bytes (val);
+    pin_textures ();
+  }
+}
+
+void tiled_image::set_texture_staging_budget (size_t val)
+{
+  m_texture_staging_budget = val;
+
+  if (m_texture_cache != nullptr)
+    m_texture_cache->set_max_staged_bytes (val);
+}
+
+void tiled_image::set_max_height_error (float val)
+{
+  if (val == m_max_height_error)
+    return;
+
+  m_max_height_error = val;
+
+  if (m_texture_cache != nullptr)
+  {
+    m_texture_cache = nullptr;
+    create_texture_cache ();
+  }
+}
+
+void tiled_image::set_compressed_color_textures (bool val)
+{
+  if (val && !tile_cache::block_texture::supported ())
+  {
+    std::cout << "tiled_image: compressed textures are not supported" << std::endl;
+    val = false;
+  }
+
+  if (val == m_compressed_color_textures)
+    return;
+
+  m_compressed_color_textures = val;
+
+  if (val && m_encoded_color_tiles == nullptr)
+    m_encoded_color_tiles = std::make_unique<encoded_tile_cache> (encoded_color_tile_budget);
+
+  if (m_texture_cache != nullptr)
+  {
+    m_texture_cache = nullptr;
+    create_texture_cache ();
+  }
+}
+
+void tiled_image::set_texture_upload_budget (size_t max_bytes, double max_seconds)
+{
+  m_upload_budget_bytes = max_bytes;
+  m_upload_budget_seconds = max_seconds;
+}
+
 tiled_image::~tiled_image (void)
 {
   if (m_shader != nullptr && m_shader.use_count () == 2)
@@ -938,14 +1373,87 @@ tiled_image::~tiled_image (void)
 }
 
 
+void tiled_image::set_lazy_mipmaps (bool val)
+{
+  std::lock_guard<std::mutex> rgb_lock (m_rgb_image_mutex);
+  std::lock_guard<std::mutex> height_lock (m_height_image_mutex);
+
+  m_rgb_image.set_lazy (val);
+  m_height_image.set_lazy (val);
+}
+
+compressed_tier::stats tiled_image::compressed_tier_stats (void) const
+{
+  compressed_tier::stats s;
+
+  if (m_rgb_tier != nullptr)
+    s += m_rgb_tier->get_stats ();
+  if (m_height_tier != nullptr)
+    s += m_height_tier->get_stats ();
+
+  return s;
+}
+
+vec2<float> tiled_image::texel_range (unsigned int lvl, const vec2<unsigned int>& tl,
+				      const vec2<unsigned int>& br) const
+{
+  auto r = m_height_range.range (tl, br);
+
+  // float heights are rounded when they are converted to integers.  the
+  // rounded range is the range of the rounded heights.
+  if (m_height_image[lvl].format () == pixel_format::r16ui
+      && m_height_image[0].format () != pixel_format::r16ui)
+  {
+    auto&& round = [] (float v) { return std::min (std::max (std::floor (v + 0.5f), 0.0f), 65535.0f); };
+    r = { round (r.x), round (r.y) };
+  }
+
+  return r * m_height_texel_scale[lvl];
+}
+
+vec2<float> tiled_image::z_range (const vec2<uint32_t>& xy, const vec2<uint32_t>& size) const
+{
+  if (empty ())
+    return { 0, 0 };
+
+  // the shader clamps negative heights to zero.
+  auto&& r = texel_range (0, xy, xy + size);
+  return { std::max (r.x, 0.0f) * m_texture_z_scale[0], std::max (r.y, 0.0f) * m_texture_z_scale[0] };
+}
+
 void tiled_image::fill (int32_t x, int32_t y, uint32_t width, uint32_t height,
 			float r, float g, float b, float z)
 {
-  auto rgb_area = m_rgb_image[0].fill ({ x, y }, { width, height }, { r, g, b, 1 });
-  auto z_area = m_height_image[0].fill ({ x, y }, { width, height }, { z, z, z, 1 });
-
-  update_mipmaps (m_rgb_image, rgb_area.top_left, rgb_area.size);
-  update_mipmaps (m_height_image, z_area.top_left, z_area.size);
+  const auto t0 = std::chrono::steady_clock::now ();
+
+  auto area = clip_copy_area ({ width, height }, { 0, 0 }, { width, height },
+			      m_size, { x, y });
+
+  std::lock_guard<std::mutex> rgb_lock (m_rgb_image_mutex);
+  std::lock_guard<std::mutex> height_lock (m_height_image_mutex);
+
+  auto&& rgb_regions =
+    update_mipmaps (m_rgb_image, area.dst_top_left, area.size,
+		    [&] (const vec2<unsigned int>& xy, const vec2<unsigned int>& sz)
+		    {
+		      m_rgb_image[0].fill (xy, sz, { r, g, b, 1 });
+		    }, m_stats);
+
+  auto&& height_regions =
+    update_mipmaps (m_height_image, area.dst_top_left, area.size,
+		    [&] (const vec2<unsigned int>& xy, const vec2<unsigned int>& sz)
+		    {
+		      m_height_image[0].fill (xy, sz, { z, z, z, 1 });
+		      m_height_range.update (m_height_image[0], xy, xy + sz);
+		    }, m_stats);
+
+  update_texture_cache (m_texture_cache.get (), m_encoded_color_tiles.get (),
+			tile_cache::color, m_rgb_image, rgb_regions);
+  update_texture_cache (m_texture_cache.get (), nullptr,
+			tile_cache::height, m_height_image, height_regions);
+  pin_textures ();
+
+  count_update (rgb_regions, t0);
 }
 
 void
@@ -970,8 +1478,10 @@ tiled_image::update (int32_t x, int32_t y,
   // originally this was using std::async, which uses std::future, which nobody
   // has implemented for mingw win threads.
 
-  std::array<tiled_image::update_region, tiled_image::max_lod_level> rgb_regions;
-  std::array<tiled_image::update_region, tiled_image::max_lod_level> height_regions;
+  const auto start = std::chrono::steady_clock::now ();
+
+  std::vector<tiled_image::update_region> rgb_regions;
+  std::vector<tiled_image::update_region> height_regions;
 
   auto t0 = std::chrono::high_resolution_clock::now ();
 
@@ -980,8 +1490,7 @@ tiled_image::update (int32_t x, int32_t y,
   std::thread tr (
   [&] (void)
   {
-    std::array<tiled_image::update_region, tiled_image::max_lod_level> res;
-    res.fill ({ { 0 }, { 0 } });
+    std::vector<tiled_image::update_region> res (m_rgb_image.size (), { { 0 }, { 0 } });
 
     try
     {
@@ -992,10 +1501,19 @@ tiled_image::update (int32_t x, int32_t y,
       else
         img = load_raw_image (rgb_bmp_file);
 
-      auto area = img.copy_to ({ src_x, src_y }, { src_width, src_height },
-			       m_rgb_image[0], { x, y });
+      // the decoded image is converted and written to the top level
+      // block by block while updating the mipmaps.
+      auto area = clip_copy_area (img.size (), { src_x, src_y }, { src_width, src_height },
+				  m_size, { x, y });
 
-      res = update_mipmaps (m_rgb_image, area.dst_top_left, area.size);
+      std::lock_guard<std::mutex> lock (m_rgb_image_mutex);
+
+      res = update_mipmaps (m_rgb_image, area.dst_top_left, area.size,
+			    [&] (const vec2<unsigned int>& xy, const vec2<unsigned int>& sz)
+			    {
+			      m_rgb_image[0].write (img, area.src_top_left + (xy - area.dst_top_left),
+						    sz, xy);
+			    }, m_stats);
     }
     catch (const std::exception& e)
     {
@@ -1006,8 +1524,7 @@ tiled_image::update (int32_t x, int32_t y,
   });
 
   {
-    std::array<tiled_image::update_region, tiled_image::max_lod_level> res;
-    res.fill ({ { 0 }, { 0 } });
+    std::vector<tiled_image::update_region> res (m_height_image.size (), { { 0 }, { 0 } });
     try
     {
       image img;
@@ -1017,10 +1534,20 @@ tiled_image::update (int32_t x, int32_t y,
       else
         img = load_raw_image (height_bmp_file);
 
-      auto area = img.copy_to ({ src_x, src_y },  { src_width, src_height },
-			       m_height_image[0], { x, y });
+      // the decoded image is converted and written to the top level
+      // block by block while updating the mipmaps.
+      auto area = clip_copy_area (img.size (), { src_x, src_y }, { src_width, src_height },
+				  m_size, { x, y });
+
+      std::lock_guard<std::mutex> lock (m_height_image_mutex);
 
-      res = update_mipmaps (m_height_image, area.dst_top_left, area.size);
+      res = update_mipmaps (m_height_image, area.dst_top_left, area.size,
+			    [&] (const vec2<unsigned int>& xy, const vec2<unsigned int>& sz)
+			    {
+			      m_height_image[0].write (img, area.src_top_left + (xy - area.dst_top_left),
+						       sz, xy);
+			      m_height_range.update (m_height_image[0], xy, xy + sz);
+			    }, m_stats);
     }
     catch (const std::exception& e)
     {
@@ -1040,13 +1567,18 @@ tiled_image::update (int32_t x, int32_t y,
 	    << " t2-t0 = " << std::chrono::duration_cast<std::chrono::microseconds>(t2 - t0).count ()
 	    << std::endl;
 
-  // invalidate texture tiles affected by the update regions in the caches.
+  // refresh the texture tiles affected by the update regions in the cache.
   // this will trigger texture re-uploads.
   // notice that this step has to be done on the main/GL thread as it might
   // try to delete GL textures.
 
-  invalidate_texture_cache (m_rgb_texture_cache, rgb_regions);
-  invalidate_texture_cache (m_height_texture_cache, height_regions);
+  update_texture_cache (m_texture_cache.get (), m_encoded_color_tiles.get (),
+			tile_cache::color, m_rgb_image, rgb_regions);
+  update_texture_cache (m_texture_cache.get (), nullptr,
+			tile_cache::height, m_height_image, height_regions);
+  pin_textures ();
+
+  count_update (rgb_regions, start);
 }
 
 
@@ -1074,107 +1606,481 @@ void tiled_image::update (uint32_t x, uint32_t y, uint32_t width, uint32_t heigh
   tmp_image height_img (height_format, width, height, height_data_stride_bytes,
 			height_data);
 
-  std::array<tiled_image::update_region, tiled_image::max_lod_level> rgb_regions;
-  std::array<tiled_image::update_region, tiled_image::max_lod_level> height_regions;
+  const auto start = std::chrono::steady_clock::now ();
+
+  std::vector<tiled_image::update_region> rgb_regions;
+  std::vector<tiled_image::update_region> height_regions;
 
   std::thread tr (
   [&] (void)
   {
-    std::array<tiled_image::update_region, tiled_image::max_lod_level> res;
-    res.fill ({ { 0 }, { 0 } });
+    auto area = clip_copy_area (rgb_img.size (), { 0, 0 }, rgb_img.size (),
+				m_size, vec2<int> (x, y));
 
-    auto area = rgb_img.copy_to (m_rgb_image[0], { x, y });
+    std::lock_guard<std::mutex> lock (m_rgb_image_mutex);
 
-    rgb_regions = update_mipmaps (m_rgb_image, area.dst_top_left, area.size);
+    rgb_regions = update_mipmaps (m_rgb_image, area.dst_top_left, area.size,
+				  [&] (const vec2<unsigned int>& xy, const vec2<unsigned int>& sz)
+				  {
+				    m_rgb_image[0].write (rgb_img, area.src_top_left + (xy - area.dst_top_left),
+							  sz, xy);
+				  }, m_stats);
   });
 
   {
-    std::array<tiled_image::update_region, tiled_image::max_lod_level> res;
-    res.fill ({ { 0 }, { 0 } });
-
-    auto area = height_img.copy_to (m_height_image[0], { x, y });
-    height_regions = update_mipmaps (m_height_image, area.dst_top_left, area.size);
+    auto area = clip_copy_area (height_img.size (), { 0, 0 }, height_img.size (),
+				m_size, vec2<int> (x, y));
+
+    std::lock_guard<std::mutex> lock (m_height_image_mutex);
+
+    height_regions = update_mipmaps (m_height_image, area.dst_top_left, area.size,
+				     [&] (const vec2<unsigned int>& xy, const vec2<unsigned int>& sz)
+				     {
+				       m_height_image[0].write (height_img, area.src_top_left + (xy - area.dst_top_left),
+								sz, xy);
+				       m_height_range.update (m_height_image[0], xy, xy + sz);
+				     }, m_stats);
   }
 
   tr.join ();
 
-  invalidate_texture_cache (m_rgb_texture_cache, rgb_regions);
-  invalidate_texture_cache (m_height_texture_cache, height_regions);
+  update_texture_cache (m_texture_cache.get (), m_encoded_color_tiles.get (),
+			tile_cache::color, m_rgb_image, rgb_regions);
+  update_texture_cache (m_texture_cache.get (), nullptr,
+			tile_cache::height, m_height_image, height_regions);
+  pin_textures ();
+
+  count_update (rgb_regions, start);
 }
 
 void tiled_image
-::invalidate_texture_cache (utils::lru_cache<texture_key, gl::texture, load_texture_tile>& cache,
-			    const std::array<update_region, max_lod_level>& regions)
+::update_texture_cache (tile_cache* cache, encoded_tile_cache* encoded,
+			tile_cache::texture_index t,
+			const mipmap_pyramid& img, const std::vector<update_region>& regions)
 {
-  for (unsigned int i = 0; i < max_lod_level; ++i)
+  if (cache == nullptr && encoded == nullptr)
+    return;
+
+  // the changed tiles of all levels are collected and passed to the caches
+  // at once.
+  std::vector<tile_cache::tile_update> tiles;
+  std::vector<uint64_t> keys;
+
+  // the texture tiles include the sampling border around them.
+  for (unsigned int i = 0; i < regions.size (); ++i)
   {
-    vec2<unsigned int> tl = regions[i].tl / texture_tile_size;
-    vec2<unsigned int> br = (regions[i].br + texture_tile_size - 1) / texture_tile_size;
+    if (regions[i].tl.x >= regions[i].br.x || regions[i].tl.y >= regions[i].br.y)
+      continue;
+
+    vec2<unsigned int> tl = (std::max (regions[i].tl, vec2<unsigned int> (texture_border))
+			     - texture_border) / texture_tile_size;
+    vec2<unsigned int> br = (regions[i].br + texture_border + texture_tile_size - 1) / texture_tile_size;
+
+    // the edge pixels of the image are replicated into the border texels
+    // outside of the image.
+    vec2<unsigned int> r_tl = regions[i].tl + texture_border;
+    vec2<unsigned int> r_br = regions[i].br + texture_border;
+
+    if (regions[i].tl.x == 0)
+      r_tl.x = 0;
+    if (regions[i].tl.y == 0)
+      r_tl.y = 0;
+    if (regions[i].br.x >= img[i].size ().x)
+      r_br.x = std::numeric_limits<unsigned int>::max ();
+    if (regions[i].br.y >= img[i].size ().y)
+      r_br.y = std::numeric_limits<unsigned int>::max ();
 
     for (unsigned int y = tl.y; y < br.y; ++y)
       for (unsigned int x = tl.x; x < br.x; ++x)
       {
 	texture_key k (i, { x * (texture_tile_size << i), y * (texture_tile_size << i) });
-	// std::cout << "invalidating texture " << k << std::endl;
-	cache.erase (k);
+
+	// the region in texels of the texture, whose top left texel is at
+	// the tile position minus the border.  the coordinates are shifted by
+	// the border to stay positive.
+	const vec2<unsigned int> org = vec2<unsigned int> (x, y) * texture_tile_size;
+	const vec2<unsigned int> tex_tl = std::max (r_tl, org) - org;
+	const vec2<unsigned int> tex_br = std::min (r_br, org + texture_tile_size + texture_border * 2) - org;
+
+	tiles.push_back ({ k.packed, tex_tl, tex_br, img.generation (i, k.img_pos) });
+	keys.push_back (k.packed);
       }
   }
-}
 
-std::array<tiled_image::update_region, tiled_image::max_lod_level>
-tiled_image::update_mipmaps (std::array<cpu_image, max_lod_level>& img,
-			     const vec2<unsigned int>& top_level_xy,
-			     const vec2<unsigned int>& top_level_size)
-{
-  std::array<tiled_image::update_region, tiled_image::max_lod_level> res;
+  if (tiles.empty ())
+    return;
 
-  auto xy = top_level_xy;
-  auto size = top_level_size;
+  // the refreshes which are posted by the update must not find the old
+  // encoded textures.  'encoded' outlives the jobs of 'cache', see the
+  // member order of tiled_image.
+  if (encoded != nullptr)
+    encoded->erase (keys);
 
-  res[0] = { top_level_xy, top_level_xy + top_level_size };
+  if (cache != nullptr)
+    cache->update (t, tiles);
+}
 
-  for (unsigned int i = 0; i < img.size () - 1; ++i)
+// clip a copy of the source rectangle (src_xy, src_size) of an image with
+// size src_img_size to the position dst_xy of an image with size dst_img_size
+// the same way as img::image::copy_to does it.
+static tiled_image_copy_area
+clip_copy_area (const vec2<unsigned int>& src_img_size,
+		const vec2<unsigned int>& src_xy, const vec2<unsigned int>& src_size,
+		const vec2<unsigned int>& dst_img_size, const vec2<int>& dst_xy)
+{
+  // do everything in 64 bit to avoid overflows with "max" sizes.
+  auto clip = [] (int64_t src_img, int64_t src_pos, int64_t src_sz,
+		  int64_t dst_img, int64_t dst_pos,
+		  unsigned int& out_src, unsigned int& out_dst, unsigned int& out_sz)
   {
-    const image& src_level = img[i];
-    image& dst_level = img[i + 1];
-
-    // source and destination area coordinates for simple 2x2 averaging.
-    auto dst_xy = xy / 2;
-    auto dst_size = size / 2;
-
-    // notice that this "rounds" the source coordinates
-    auto src_xy = dst_xy * 2;
-    auto src_size = dst_size * 2;
+    int64_t s0 = std::min (src_pos, src_img);
+    int64_t s1 = std::min (src_pos + src_sz, src_img);
+    int64_t d0 = dst_pos;
 
-    // if the source region is outside the image, stop here.
-    if (src_xy.x >= src_level.size ().x || src_xy.y >= src_level.size ().y
-	|| src_size.x > src_level.size ().x || src_size.y > src_level.size ().y
-	|| dst_size.x == 0 || dst_size.y == 0)
+    if (d0 < 0)
     {
-      std::cout << "update_mipmaps terminating"
-		<< " src_xy = (" << src_xy.x << "," << src_xy.y << ")"
-		<< " src_size = (" << src_size.x << "," << src_size.y << ")"
-		<< " src image size = (" << src_level.size ().x << "," << src_level.size ().y << ")"
-		<< std::endl;
-      break;
+      s0 -= d0;
+      d0 = 0;
     }
 
-    std::cout << "update_mipmaps"
-	      << " src_xy = (" << src_xy.x << "," << src_xy.y << ")"
-	      << " src_size = (" << src_size.x << "," << src_size.y << ")"
-	      << " dst_xy = (" << dst_xy.x << "," << dst_xy.y << ")"
-	      << " dst_size = (" << dst_size.x << "," << dst_size.y << ")"
-	      << std::endl;
+    int64_t sz = std::max<int64_t> (0, std::min (s1 - s0, dst_img - d0));
 
-    src_level.subimg (vec2<int> (src_xy), src_size)
-		.pyr_down_to (dst_level.subimg (vec2<int> (dst_xy), dst_size));
+    out_src = sz > 0 ? (unsigned int)s0 : 0;
+    out_dst = sz > 0 ? (unsigned int)d0 : 0;
+    out_sz = (unsigned int)sz;
+  };
+
+  tiled_image_copy_area res;
+  clip (src_img_size.x, src_xy.x, src_size.x, dst_img_size.x, dst_xy.x,
+	res.src_top_left.x, res.dst_top_left.x, res.size.x);
+  clip (src_img_size.y, src_xy.y, src_size.y, dst_img_size.y, dst_xy.y,
+	res.src_top_left.y, res.dst_top_left.y, res.size.y);
+
+  if (res.size.x == 0 || res.size.y == 0)
+    res.size = { 0 };
+
+  return res;
+}
+
+void tiled_image::mipmap_pyramid::set_lazy (bool val)
+{
+  if (m_lazy && !val)
+    for (unsigned int i = 1; i < m_level.size (); ++i)
+      resolve (i, { { 0 }, m_level[i].size () });
+
+  m_lazy = val;
+}
+
+void tiled_image::mipmap_pyramid::resize (unsigned int num_levels)
+{
+  m_level.clear ();
+  m_level.resize (num_levels);
+
+  m_dirty.clear ();
+  m_dirty.resize (num_levels);
+  m_dirty_stride.assign (num_levels, 0);
+  m_dirty_count.assign (num_levels, 0);
+
+  m_written.clear ();
+  m_written.resize (num_levels);
+  m_written_stride.assign (num_levels, 0);
+
+  m_generation.clear ();
+  m_generation.resize (num_levels);
+}
+
+void tiled_image::mipmap_pyramid::mark_dirty (unsigned int lvl, const update_region& r)
+{
+  if (lvl == 0 || m_level[lvl].empty ())
+    return;
+
+  auto&& blocks = (m_level[lvl].size () + (dirty_block_size - 1)) / dirty_block_size;
+
+  if (m_dirty[lvl].empty ())
+  {
+    m_dirty[lvl].resize (blocks.x * blocks.y, false);
+    m_dirty_stride[lvl] = blocks.x;
+  }
+
+  auto&& tl = std::min (r.tl / dirty_block_size, blocks);
+  auto&& br = std::min ((r.br + (dirty_block_size - 1)) / dirty_block_size, blocks);
+
+  for (unsigned int y = tl.y; y < br.y; ++y)
+    for (unsigned int x = tl.x; x < br.x; ++x)
+    {
+      auto&& d = m_dirty[lvl][x + y * m_dirty_stride[lvl]];
+      if (!d)
+      {
+	d = true;
+	m_dirty_count[lvl] += 1;
+      }
+    }
+}
+
+void tiled_image::mipmap_pyramid::resolve (unsigned int lvl, const update_region& r)
+{
+  if (lvl == 0 || m_dirty_count[lvl] == 0)
+    return;
+
+  const auto& level_size = m_level[lvl].size ();
+
+  auto&& tl = std::min (r.tl, level_size) / dirty_block_size;
+  auto&& br = (std::min (r.br, level_size) + (dirty_block_size - 1)) / dirty_block_size;
+
+  for (unsigned int y = tl.y; y < br.y; ++y)
+    for (unsigned int x = tl.x; x < br.x; ++x)
+    {
+      auto&& d = m_dirty[lvl][x + y * m_dirty_stride[lvl]];
+      if (!d)
+	continue;
+
+      vec2<unsigned int> blk_tl (x * dirty_block_size, y * dirty_block_size);
+      auto&& blk_br = std::min (blk_tl + dirty_block_size, level_size);
+
+      // the next higher detail level has to be up to date first.
+      resolve (lvl - 1, { blk_tl * 2, blk_br * 2 });
+
+      m_level[lvl].reduce (m_level[lvl - 1], blk_tl, blk_br);
+
+      d = false;
+      m_dirty_count[lvl] -= 1;
+    }
+}
+
+void tiled_image::mipmap_pyramid::mark_written (const update_region& r)
+{
+  const auto& top_size = m_level[0].size ();
+
+  for (unsigned int lvl = 0; lvl < m_level.size () && !m_level[lvl].empty (); ++lvl)
+  {
+    const auto tile_size = texture_tile_size << lvl;
+    auto&& tiles = (top_size + (tile_size - 1)) / tile_size;
+
+    if (m_written[lvl].empty ())
+    {
+      m_written[lvl].resize (tiles.x * tiles.y, false);
+      m_written_stride[lvl] = tiles.x;
+    }
+
+    auto&& tl = std::min (r.tl / tile_size, tiles);
+    auto&& br = std::min ((r.br + (tile_size - 1)) / tile_size, tiles);
+
+    for (unsigned int y = tl.y; y < br.y; ++y)
+      for (unsigned int x = tl.x; x < br.x; ++x)
+	m_written[lvl][x + y * m_written_stride[lvl]] = true;
+  }
+}
+
+bool tiled_image::mipmap_pyramid::written (unsigned int lvl,
+					   const vec2<unsigned int>& top_level_pos) const
+{
+  if (m_written[lvl].empty ())
+    return false;
+
+  auto&& t = top_level_pos / (texture_tile_size << lvl);
+  return m_written[lvl][t.x + t.y * m_written_stride[lvl]];
+}
+
+void tiled_image::mipmap_pyramid::mark_changed (const std::vector<update_region>& regions)
+{
+  const auto& top_size = m_level[0].size ();
+
+  m_last_generation += 1;
+
+  for (unsigned int lvl = 0; lvl < std::min<size_t> (regions.size (), m_level.size ()); ++lvl)
+  {
+    auto&& r = regions[lvl];
+    if (r.tl.x >= r.br.x || r.tl.y >= r.br.y)
+      continue;
+
+    const auto tile_size = texture_tile_size << lvl;
+    auto&& tiles = (top_size + (tile_size - 1)) / tile_size;
+
+    if (m_generation[lvl].empty ())
+      m_generation[lvl].resize (tiles.x * tiles.y, 0);
+
+    // the texture tiles include the sampling border around them.
+    auto&& tl = std::min ((std::max (r.tl, vec2<unsigned int> (texture_border)) - texture_border)
+			  / texture_tile_size, tiles);
+    auto&& br = std::min ((r.br + texture_border + texture_tile_size - 1) / texture_tile_size, tiles);
+
+    for (unsigned int y = tl.y; y < br.y; ++y)
+      for (unsigned int x = tl.x; x < br.x; ++x)
+	m_generation[lvl][x + y * tiles.x] = m_last_generation;
+  }
+}
+
+uint64_t tiled_image::mipmap_pyramid::generation (unsigned int lvl,
+						  const vec2<unsigned int>& top_level_pos) const
+{
+  if (m_generation[lvl].empty ())
+    return 0;
+
+  const auto tile_size = texture_tile_size << lvl;
+  const unsigned int stride = (m_level[0].size ().x + (tile_size - 1)) / tile_size;
+
+  auto&& t = top_level_pos / tile_size;
+  return m_generation[lvl][t.x + t.y * stride];
+}
+
+bool tiled_image::mipmap_pyramid::constant (unsigned int lvl, const vec2<unsigned int>& top_level_pos,
+					    uint64_t& value)
+{
+  auto&& level = m_level[lvl];
+
+  value = 0;
+
+  if (level.empty () || level.bytes_per_pixel () > sizeof (value))
+    return false;
+
+  // the whole texture tile including the sampling border.
+  auto&& tl = vec2<int> (top_level_pos >> lvl) - texture_border;
+  auto&& br = tl + texture_tile_size + texture_border * 2;
+
+  const update_region r = { vec2<unsigned int> (std::max (tl, vec2<int> (0))),
+			    vec2<unsigned int> (std::max (br, vec2<int> (0))) };
+
+  if (m_lazy)
+    resolve (lvl, r);
+
+  return level.constant (r.tl, r.br, &value);
+}
+
+std::vector<tiled_image::update_region>
+tiled_image::update_mipmaps (mipmap_pyramid& img,
+			     const vec2<unsigned int>& top_level_xy,
+			     const vec2<unsigned int>& top_level_size,
+			     const write_block_func& write_block,
+			     render_stats* stats)
+{
+  std::vector<tiled_image::update_region> res (img.size (), { { 0 }, { 0 } });
+
+  if (top_level_size.x == 0 || top_level_size.y == 0)
+    return res;
+
+  const auto t0 = std::chrono::steady_clock::now ();
+
+  auto&& count_time = [&] (void)
+  {
+    if (stats != nullptr)
+      render_stats::add (stats->pyramid_usec,
+			 std::chrono::duration_cast<std::chrono::microseconds> (
+				std::chrono::steady_clock::now () - t0).count ());
+  };
+
+  img.mark_written ({ top_level_xy, top_level_xy + top_level_size });
+
+  if (img.lazy ())
+  {
+    if (write_block)
+      write_block (top_level_xy, top_level_size);
+
+    // every lower level pixel which has a changed source pixel is dirty.
+    res[0] = { top_level_xy, top_level_xy + top_level_size };
+
+    for (unsigned int i = 1; i < img.size (); ++i)
+    {
+      auto&& sz = img[i].size ();
+      auto&& tl = std::min (res[i - 1].tl / 2, sz);
+      auto&& br = std::min ((res[i - 1].br + 1) / 2, sz);
+
+      if (tl.x >= br.x || tl.y >= br.y)
+	break;
+
+      res[i] = { tl, br };
+      img.mark_dirty (i, res[i]);
+    }
+
+    img.mark_changed (res);
+    count_time ();
+    return res;
+  }
+
+  // figure out the affected area of each level first.
+  auto xy = top_level_xy;
+  auto size = top_level_size;
+
+  res[0] = { top_level_xy, top_level_xy + top_level_size };
+
+  unsigned int num_levels = 1;
+
+  for (unsigned int i = 0; i + 1 < img.size (); ++i)
+  {
+    const cpu_image& src_level = img[i];
+
+    // source and destination area coordinates for simple 2x2 averaging.
+    auto dst_xy = xy / 2;
+    auto dst_size = size / 2;
+
+    // notice that this "rounds" the source coordinates
+    auto src_xy = dst_xy * 2;
+    auto src_size = dst_size * 2;
+
+    // if the source region is outside the image, stop here.
+    if (src_xy.x >= src_level.size ().x || src_xy.y >= src_level.size ().y
+	|| src_size.x > src_level.size ().x || src_size.y > src_level.size ().y
+	|| dst_size.x == 0 || dst_size.y == 0)
+    {
+      std::cout << "update_mipmaps terminating"
+		<< " src_xy = (" << src_xy.x << "," << src_xy.y << ")"
+		<< " src_size = (" << src_size.x << "," << src_size.y << ")"
+		<< " src image size = (" << src_level.size ().x << "," << src_level.size ().y << ")"
+		<< std::endl;
+      break;
+    }
+
+    std::cout << "update_mipmaps"
+	      << " src_xy = (" << src_xy.x << "," << src_xy.y << ")"
+	      << " src_size = (" << src_size.x << "," << src_size.y << ")"
+	      << " dst_xy = (" << dst_xy.x << "," << dst_xy.y << ")"
+	      << " dst_size = (" << dst_size.x << "," << dst_size.y << ")"
+	      << std::endl;
 
     res[i + 1] = { dst_xy, dst_xy + dst_size };
+    num_levels = i + 2;
 
     xy = dst_xy;
     size = dst_size;
   }
 
+  // walk over the area in blocks.  the blocks are aligned to the block size,
+  // so that the footprint of a block on each lower level contains all the
+  // source pixels for that level.  within a block, each level is produced
+  // from the same source pixels as if the levels were done one after another
+  // for the whole area.
+  const auto blk_tl = (top_level_xy / mipmap_block_size) * mipmap_block_size;
+  const auto blk_br = top_level_xy + top_level_size;
+  const unsigned int num_block_levels = std::min (num_levels, mipmap_block_levels + 1);
+
+  for (unsigned int by = blk_tl.y; by < blk_br.y; by += mipmap_block_size)
+    for (unsigned int bx = blk_tl.x; bx < blk_br.x; bx += mipmap_block_size)
+    {
+      const vec2<unsigned int> blk (bx, by);
+
+      if (write_block)
+      {
+	auto tl = std::max (blk, res[0].tl);
+	auto br = std::min (blk + mipmap_block_size, res[0].br);
+	write_block (tl, br - tl);
+      }
+
+      for (unsigned int i = 1; i < num_block_levels; ++i)
+      {
+	auto tl = std::max (blk >> i, res[i].tl);
+	auto br = std::min ((blk + mipmap_block_size) >> i, res[i].br);
+
+	if (tl.x >= br.x || tl.y >= br.y)
+	  continue;
+
+	img[i].reduce (img[i - 1], tl, br);
+      }
+    }
+
+  for (unsigned int i = num_block_levels; i < num_levels; ++i)
+    img[i].reduce (img[i - 1], res[i].tl, res[i].br);
+
+  img.mark_changed (res);
+  count_time ();
   return res;
 }
 
@@ -1247,19 +2153,23 @@ tiled_image::tile_visibility
 tiled_image::calc_tile_visibility (const tile& t,
 				   const mat4<double>& proj_cam_trv,
 				   const mat4<double>& viewport_trv,
-				   float zscale) const
+				   const vec2<float>& z_range) const
 {
+  // the box of the tile from the lowest to the highest z value.
+  const double z0 = z_range.x;
+  const double z1 = z_range.y;
+
   std::array<point, 8> corners =
   {{
-    { vec4<double> (t.pos ().x, t.pos ().y, 0, 1) },
-    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y, 0, 1) },
-    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y + t.size ().y, 0, 1) },
-    { vec4<double> (t.pos ().x, t.pos ().y + t.size ().y, 0, 1) },
-
-    { vec4<double> (t.pos ().x, t.pos ().y, zscale, 1) },
-    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y, zscale, 1) },
-    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y + t.size ().y, zscale, 1) },
-    { vec4<double> (t.pos ().x, t.pos ().y + t.size ().y, zscale, 1) }
+    { vec4<double> (t.pos ().x, t.pos ().y, z0, 1) },
+    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y, z0, 1) },
+    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y + t.size ().y, z0, 1) },
+    { vec4<double> (t.pos ().x, t.pos ().y + t.size ().y, z0, 1) },
+
+    { vec4<double> (t.pos ().x, t.pos ().y, z1, 1) },
+    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y, z1, 1) },
+    { vec4<double> (t.pos ().x + t.size ().x, t.pos ().y + t.size ().y, z1, 1) },
+    { vec4<double> (t.pos ().x, t.pos ().y + t.size ().y, z1, 1) }
   }};
 
   for (auto& c : corners)
@@ -1412,11 +2322,11 @@ tiled_image::calc_tile_visibility (const tile& t,
 #ifdef use_max_edge_length
       res.display_area = 0;
 
-      // this uses only the bottom plane of the tile box.
-      for (unsigned int i = 0; i < 4; ++i)
+      // the longest edge of the bottom and top planes of the tile box.
+      for (unsigned int i = 0; i < 8; ++i)
       {
 	// this assumes that the corner points are in clockwise order.
-	unsigned int ii = (i + 1) & 3;
+	unsigned int ii = (i & 4) | ((i + 1) & 3);
 
 	auto edge_len = length (corners[ii].ps.xy () - corners[i].ps.xy ());
 
@@ -1569,56 +2479,23 @@ void tiled_image
 
 }
 
-void tiled_image::render (const mat4<double>& cam_trv, const mat4<double>& proj_trv,
-			  const mat4<double>& viewport_trv,
-			  bool render_wireframe,
-			  bool stairs_mode,
-			  bool debug_dist,
-			  bool heightmap) const
+// the heightmap palette is defined for the texel values of the top level.
+// the values of the other levels might be scaled differently.
+float tiled_image::heightmap_min_val (unsigned int lvl) const
 {
-//  (10000 / 10000) * 0.05 = 0.05
-//  (10000/ 2000) * 0.05 = 0.25
-
-//  const float zscale = 0.05f;
-//  const float zscale = (10000.0 / std::max (m_size.x, m_size.y)) * 0.05; 
-
-  shader* use_shader;
-
-  if (heightmap)
-  {
-    m_heightmap_shader->activate ();
-    use_shader = m_heightmap_shader.get ();
-
-    m_heightmap_shader->heightmap_palette = 2;
-    m_heightmap_shader->heightmap_min_val = m_heightmap_palette_min_value;
-    m_heightmap_shader->heightmap_max_val = m_heightmap_palette_max_value;
-    m_heightmap_shader->heightmap_texture_scale =
-	m_heightmap_palette.empty ()
-	? 0.0f
-	: (1.0f / m_heightmap_step_size) * (1.0f / m_heightmap_palette.size ().x);
-
-    m_heightmap_palette.bind (2);
-  }
-  else
-  {
-    m_shader->activate ();
-    use_shader = m_shader.get ();
-  }
-
-  use_shader->color_texture = 0;
-  use_shader->height_texture = 1;
-  use_shader->texture_border = texture_border;
+  return m_heightmap_palette_min_value * (m_height_texel_scale[lvl] / m_height_texel_scale[0]);
+}
 
-  static const std::array<vec4<float>, max_lod_level> lod_colors =
-  {
-    vec4<float> (1, 1, 1, 1),
-    vec4<float> (1, 0, 0, 0),
-    vec4<float> (0, 1, 0, 0),
-    vec4<float> (0, 0, 1, 0),
-    vec4<float> (1, 0, 1, 1),
-//    vec4<float> (1, 1, 0, 1),
-  };
+float tiled_image::heightmap_max_val (unsigned int lvl) const
+{
+  return m_heightmap_palette_max_value * (m_height_texel_scale[lvl] / m_height_texel_scale[0]);
+}
 
+unsigned int
+tiled_image::select_tiles (const mat4<double>& cam_trv, const mat4<double>& proj_trv,
+			   const mat4<double>& viewport_trv, bool heightmap,
+			   std::vector<const tile*>& out) const
+{
 /*
 - visibility candidate list
     contains tiles that could be potentially visible.
@@ -1642,7 +2519,7 @@ void tiled_image::render (const mat4<double>& cam_trv, const mat4<double>& proj_
   const auto viewport_proj_cam_trv = viewport_trv * proj_cam_trv;
 
   m_candidate_tiles.clear ();
-  m_visible_tiles.clear ();
+  out.clear ();
 
   // initially add all lowest level tiles as candidates.
   for (auto&& t : m_tiles.back ())
@@ -1661,12 +2538,36 @@ std::cout
 
 #endif
 
+  unsigned int num_tested = 0;
+
   while (!m_candidate_tiles.empty ())
   {
     auto&& t = m_candidate_tiles.back ();
     m_candidate_tiles.pop_back ();
 
-    auto tv = calc_tile_visibility (*t, proj_cam_trv, viewport_trv, 1);
+    // nothing has been written to the tile and its subtiles.  skip it
+    // instead of uploading and rendering an empty texture.
+    if (!m_rgb_image.written (t->lod (), t->pos ())
+	&& !m_height_image.written (t->lod (), t->pos ()))
+      continue;
+
+    // the z range of the tile including the texels around it, which are
+    // sampled for the edge vertices.  the shaders clamp the heights.
+    const unsigned int margin = 2 << t->lod ();
+    auto&& r = texel_range (t->lod (), std::max (t->pos (), vec2<uint32_t> (margin)) - margin,
+			    t->pos () + t->size () + margin);
+
+    const float z_min_val = heightmap ? heightmap_min_val (t->lod ()) : 0.0f;
+    const float z_max_val = heightmap ? heightmap_max_val (t->lod ())
+				      : std::numeric_limits<float>::max ();
+    const float zscale = m_texture_z_scale[t->lod ()];
+
+    const vec2<float> z_range (std::min (std::max (r.x, z_min_val), z_max_val) * zscale,
+			       std::min (std::max (r.y, z_min_val), z_max_val) * zscale);
+
+    auto tv = calc_tile_visibility (*t, proj_cam_trv, viewport_trv, z_range);
+    num_tested += 1;
+
     if (tv.visible)
     {
       double lod_d = tv.display_area / tv.image_area;
@@ -1692,14 +2593,202 @@ std::cout
 	    m_candidate_tiles.push_back (subtile);
       }
       else
-	m_visible_tiles.push_back (t);
+	out.push_back (t);
     }
   }
 
 #ifdef per_frame_log
-  std::cout << "visible tiles: " << m_visible_tiles.size () << std::endl;
+  std::cout << "visible tiles: " << out.size () << std::endl;
 #endif
 
+  return num_tested;
+}
+
+void tiled_image::prefetch (const mat4<double>& cam_trv, const mat4<double>& proj_trv,
+			    const mat4<double>& viewport_trv, bool finer_levels,
+			    bool heightmap) const
+{
+  if (empty ())
+    return;
+
+  select_tiles (cam_trv, proj_trv, viewport_trv, heightmap, m_prefetch_tiles);
+
+  auto&& written = [&] (const tile& t)
+  {
+    return m_rgb_image.written (t.lod (), t.pos ()) || m_height_image.written (t.lod (), t.pos ());
+  };
+
+  for (const tile* t : m_prefetch_tiles)
+  {
+    m_texture_cache->prefetch (texture_key (t->lod (), t->pos ()).packed);
+
+    if (finer_levels && t->has_subtiles () && t->lod () > 0)
+      for (const tile* subtile : t->subtiles ())
+	if (subtile != nullptr && written (*subtile))
+	  m_texture_cache->prefetch (texture_key (subtile->lod (), subtile->pos ()).packed);
+  }
+}
+
+tile_cache::prefetch_stats tiled_image::texture_prefetch_stats (void) const
+{
+  return m_texture_cache != nullptr ? m_texture_cache->get_prefetch_stats ()
+				    : tile_cache::prefetch_stats ();
+}
+
+void tiled_image::render (const mat4<double>& cam_trv, const mat4<double>& proj_trv,
+			  const mat4<double>& viewport_trv,
+			  bool render_wireframe,
+			  bool stairs_mode,
+			  bool debug_dist,
+			  bool heightmap) const
+{
+//  (10000 / 10000) * 0.05 = 0.05
+//  (10000/ 2000) * 0.05 = 0.25
+
+//  const float zscale = 0.05f;
+//  const float zscale = (10000.0 / std::max (m_size.x, m_size.y)) * 0.05; 
+
+  if (empty ())
+    return;
+
+  shader* use_shader;
+
+  if (heightmap)
+  {
+    m_heightmap_shader->activate ();
+    use_shader = m_heightmap_shader.get ();
+
+    m_heightmap_shader->heightmap_palette = 2;
+    m_heightmap_palette.bind (2);
+  }
+  else
+  {
+    m_shader->activate ();
+    use_shader = m_shader.get ();
+  }
+
+  use_shader->color_texture = 0;
+  use_shader->height_texture = 1;
+  use_shader->texture_border = texture_border;
+
+  // the texture tiles are in the slots of the atlas pages, which have the
+  // same size for all tiles.  the 1x1 textures of the constant tiles have
+  // the same value everywhere.
+  use_shader->texture_scale = 1.0f / vec2<float> (m_texture_cache->page_texture_size ());
+
+  // upload the texture tiles which have been prepared since the last
+  // frame.
+  m_texture_cache->begin_frame ();
+
+  {
+    tile_cache::upload_budget budget (m_upload_budget_bytes, m_upload_budget_seconds);
+    while (m_texture_cache->upload_next (budget));
+
+    if (m_stats != nullptr)
+    {
+      render_stats::set (m_stats->last_upload_bytes, budget.bytes ());
+      render_stats::add (m_stats->upload_bytes, budget.bytes ());
+    }
+  }
+
+  // the textures of the tile if they are ready.  otherwise they are
+  // requested and the part of the nearest cached tile of a lower detail
+  // level is drawn instead.  if there is none, the lowest detail tile is
+  // requested too and the tile is skipped in this frame.  returns the level
+  // of the textures or -1.
+  auto&& find_textures = [&] (const tile& t, tile_cache::tile_slots& s) -> int
+  {
+    unsigned int lvl = t.lod ();
+    vec2<unsigned int> pos = t.pos ();
+
+    bool found = m_texture_cache->get (texture_key (lvl, pos).packed, s);
+
+    while (!found && lvl + 1 < num_lod_levels ())
+    {
+      lvl += 1;
+      pos = t.pos () / (texture_tile_size << lvl) * (texture_tile_size << lvl);
+      found = m_texture_cache->get_cached (texture_key (lvl, pos).packed, s);
+    }
+
+    // the missing tile has been counted already.
+    if (!found)
+    {
+      m_texture_cache->request_missing (texture_key (lvl, pos).packed);
+      return -1;
+    }
+
+    m_texture_cache->trace_use (texture_key (lvl, pos).packed);
+    return (int)lvl;
+  };
+
+  // binds the atlas pages of the textures found for the tile.  the tiles in
+  // the same pages as the previous tile need no binds.
+  const void* bound_textures[2] = { nullptr, nullptr };
+
+  auto&& bind_textures = [&] (const tile& t, const drawn_textures& d)
+  {
+    auto&& s = d.slots;
+    const unsigned int lvl = (unsigned int)d.lvl;
+    const vec2<unsigned int> pos = t.pos () / (texture_tile_size << lvl)
+				   * (texture_tile_size << lvl);
+
+    auto&& s0 = s[tile_cache::color];
+    auto&& s1 = s[tile_cache::height];
+
+    if (s0.texture () != bound_textures[0])
+    {
+      s0.bind (0);
+      bound_textures[0] = s0.texture ();
+    }
+
+    if (s1.texture () != bound_textures[1])
+    {
+      s1.bind (1);
+      bound_textures[1] = s1.texture ();
+    }
+
+    // the position of the tile in the texels of the texture's level.
+    const vec2<float> offset ((t.pos () - pos) >> lvl);
+
+    use_shader->color_texture_offset = vec2<float> (s0.pos) + offset;
+    use_shader->height_texture_offset = vec2<float> (s1.pos) + offset;
+    use_shader->height_value_scale = s1.value_scale;
+    use_shader->height_value_offset = s1.value_offset;
+    use_shader->texel_scale = 1.0f / (float)(1 << (lvl - t.lod ()));
+  };
+
+  auto&& set_level_params = [&] (unsigned int lvl)
+  {
+    use_shader->zscale = m_texture_z_scale[lvl];
+
+    if (heightmap)
+    {
+      m_heightmap_shader->heightmap_min_val = heightmap_min_val (lvl);
+      m_heightmap_shader->heightmap_max_val = heightmap_max_val (lvl);
+      m_heightmap_shader->heightmap_texture_scale =
+	  m_heightmap_palette.empty ()
+	  ? 0.0f
+	  : (1.0f / m_heightmap_step_size) * (1.0f / m_heightmap_palette.size ().x)
+	    * (m_height_texel_scale[0] / m_height_texel_scale[lvl]);
+    }
+  };
+
+  // the colors repeat for the levels beyond the end of the table.
+  static const std::array<vec4<float>, 5> lod_colors =
+  {
+    vec4<float> (1, 1, 1, 1),
+    vec4<float> (1, 0, 0, 0),
+    vec4<float> (0, 1, 0, 0),
+    vec4<float> (0, 0, 1, 0),
+    vec4<float> (1, 0, 1, 1),
+//    vec4<float> (1, 1, 0, 1),
+  };
+
+  const auto proj_cam_trv = proj_trv * cam_trv;
+
+  const unsigned int num_candidates =
+	select_tiles (cam_trv, proj_trv, viewport_trv, heightmap, m_visible_tiles);
+
   // render tiles from lowest detail level to highest detail level.
   // notice that lower detail level = higher lod number.
   std::sort (m_visible_tiles.begin (), m_visible_tiles.end (),
@@ -1722,21 +2811,29 @@ std::cout
   use_shader->zbias = 0;
   use_shader->color = { 1 };
 
-  use_shader->zscale = m_texture_z_scale;
+  m_num_missing_tiles = 0;
+  m_drawn_textures.resize (m_visible_tiles.size ());
 
-  for (const tile* t : m_visible_tiles)
+  for (size_t i = 0; i < m_visible_tiles.size (); ++i)
   {
-    use_shader->mvp = (mat4<float>)(proj_cam_trv2 * t->trv ());
-    use_shader->pos = gl::vertex_attrib (t->mesh ().vertex_buffer (), &vertex::pos);
+    const tile* t = m_visible_tiles[i];
+    auto&& d = m_drawn_textures[i];
+
+    d.lvl = find_textures (*t, d.slots);
+
+    if (d.lvl != (int)t->lod ())
+      m_num_missing_tiles += 1;
 
-    auto&& t0 = m_rgb_texture_cache.get ({ t->lod (), t->pos () });
-    auto&& t1 = m_height_texture_cache.get ({ t->lod (), t->pos () });
+    if (d.lvl < 0)
+      continue;
 
-    t0.bind (0);
-    t1.bind (1);
+    bind_textures (*t, d);
+    set_level_params (d.lvl);
+
+    use_shader->mvp = (mat4<float>)(proj_cam_trv2 * t->trv ());
+    use_shader->pos = gl::vertex_attrib (t->mesh ().vertex_buffer (), &vertex::pos);
 
     use_shader->tile_scale = 1.0f / vec2<float> (t->mesh ().size ());
-    use_shader->texture_scale = 1.0f / vec2<float> (t0.size ());
 
     if (stairs_mode)
       t->mesh ().render_textured_stairs ();
@@ -1744,6 +2841,28 @@ std::cout
       t->mesh ().render_textured ();
   }
 
+  if (m_stats != nullptr)
+  {
+    std::array<uint64_t, render_stats::max_lod_levels> num_visible = { 0 };
+    for (const tile* t : m_visible_tiles)
+      num_visible[std::min (t->lod (), render_stats::max_lod_levels - 1)] += 1;
+
+    for (unsigned int i = 0; i < render_stats::max_lod_levels; ++i)
+      render_stats::set (m_stats->last_visible_tiles[i], num_visible[i]);
+
+    render_stats::set (m_stats->last_candidate_tiles, num_candidates);
+    render_stats::set (m_stats->last_missing_tiles, m_num_missing_tiles);
+    render_stats::set (m_stats->gpu_texture_bytes, m_texture_cache->page_bytes ());
+    render_stats::set (m_stats->staged_texture_bytes, m_texture_cache->staged_bytes ());
+    render_stats::set (m_stats->pinned_textures, m_texture_cache->num_pinned ());
+    render_stats::set (m_stats->pinned_textures_cached, m_texture_cache->num_pinned_cached ());
+
+    const auto prefetch = m_texture_cache->get_prefetch_stats ();
+    render_stats::set (m_stats->prefetch_requests, prefetch.num_requests);
+    render_stats::set (m_stats->prefetch_hits, prefetch.num_hits);
+    render_stats::set (m_stats->prefetch_late, prefetch.num_late);
+    render_stats::set (m_stats->prefetch_unused, prefetch.num_unused);
+  }
 
   if (render_wireframe)
   {
@@ -1753,20 +2872,24 @@ std::cout
     use_shader->color = { 0 };
     use_shader->zbias = 0.00001f;
 
-    for (const tile* t : m_visible_tiles)
+    // the textures are still in the same slots, nothing has been uploaded
+    // since the tiles were drawn.
+    for (size_t i = 0; i < m_visible_tiles.size (); ++i)
     {
-      use_shader->mvp = (mat4<float>)(proj_cam_trv2 * t->trv ());
-      use_shader->pos = gl::vertex_attrib (t->mesh ().vertex_buffer (), &vertex::pos);
-      use_shader->offset_color = lod_colors[t->lod ()];
+      const tile* t = m_visible_tiles[i];
+      auto&& d = m_drawn_textures[i];
+
+      if (d.lvl < 0)
+	continue;
 
-      auto&& t0 = m_rgb_texture_cache.get ({ t->lod (), t->pos () });
-      auto&& t1 = m_height_texture_cache.get ({ t->lod (), t->pos () });
+      bind_textures (*t, d);
+      set_level_params (d.lvl);
 
-      t0.bind (0);
-      t1.bind (1);
+      use_shader->mvp = (mat4<float>)(proj_cam_trv2 * t->trv ());
+      use_shader->pos = gl::vertex_attrib (t->mesh ().vertex_buffer (), &vertex::pos);
+      use_shader->offset_color = lod_colors[t->lod () % lod_colors.size ()];
 
       use_shader->tile_scale = 1.0f / vec2<float> (t->mesh ().size ());
-      use_shader->texture_scale = 1.0f / vec2<float> (t0.size ());
 
 //      glLineWidth (0.025f * t->lod () + 0.125f);
       glLineWidth (0.5f);
@@ -5,19 +5,30 @@
 #include <memory>
 #include <array>
 #include <vector>
+#include <functional>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <atomic>
+#include <iosfwd>
 
 #include "gl/gl.hpp"
 #include "utils/vec_mat.hpp"
-#include "utils/lru_cache.hpp"
 #include "img/image.hpp"
 
+#include "cpu_image.hpp"
+#include "compressed_tier.hpp"
+#include "minmax_pyramid.hpp"
+#include "tile_cache.hpp"
+#include "worker_pool.hpp"
+
+class mapped_arena;
+class encoded_tile_cache;
+struct render_stats;
+
 class tiled_image
 {
 public:
-  // how many LOD levels we have
-  static constexpr unsigned int max_lod_level = 6;
-  static constexpr unsigned int max_lod_scale_factor = 1 << max_lod_level;
-
   // to avoid creases textures have to have some sampling border.
   static constexpr unsigned int texture_border = 8;
 
@@ -36,7 +47,7 @@ public:
 
   // if the mipmapping of the gpu is used, the lowest mipmap level geometry
   // tiles must not cross a texture border.
-  // static constexpr unsigned int texture_tile_size = max_lod_scale_factor * tile_grid_size;
+  // static constexpr unsigned int texture_tile_size = (1 << lod levels) * tile_grid_size;
 
   // if texture tiles are managed and selected manually for each mipmap level
   // and automatic gpu mipmapping is not used, we have more freedom on the
@@ -51,8 +62,52 @@ public:
   // textures > 4096 can be problematic it seems.
   static_assert (texture_tile_size <= 4096, "");
 
+  // with the bricked image layout, one brick is one texture tile.
+  static_assert (cpu_image::brick_core_size == texture_tile_size, "");
+  static_assert (cpu_image::brick_border == texture_border, "");
+
+  // how the mipmap levels are stored in cpu memory.
+  struct storage_params
+  {
+    cpu_image::layout layout = cpu_image::layout::linear;
+
+    // if set, the mipmap levels are stored in a sparse temporary file in
+    // 'backing_file_dir' (the system's temporary directory if empty), which
+    // is mapped into memory.  only 'resident_budget' bytes of it are kept
+    // in physical memory (0 = no limit).  this allows images which are
+    // bigger than the physical memory.
+    bool file_backed = false;
+    std::string backing_file_dir;
+    size_t resident_budget = 0;
+
+    // if not 0 and not file backed, the texture tiles which haven't been
+    // used recently are compressed, so that the uncompressed tiles take up
+    // about 'compressed_tier_budget' bytes.  this implies the bricked
+    // layout.
+    size_t compressed_tier_budget = 0;
+
+    // the pixel formats of each mipmap level.  'invalid' and the levels
+    // beyond the end of the list select the default format, which is rgba8
+    // for the color and r32f or r16ui (with use_uint16_heightmap) for the
+    // heights.  the lower detail levels can be stored in more compact
+    // formats to save memory and upload bandwidth:
+    //   color:   r5_g6_b5
+    //   height:  r16ui.  float heights are rounded to integers, like the
+    //            input of use_uint16_heightmap.
+    // a level is reduced and converted from the level above in one pass.
+    struct level_format
+    {
+      img::pixel_format color = img::pixel_format::invalid;
+      img::pixel_format height = img::pixel_format::invalid;
+    };
+
+    std::vector<level_format> level_formats;
+  };
+
   tiled_image (bool use_uint16_heightmap = false);
   tiled_image (const utils::vec2<uint32_t>& size, bool use_uint16_heightmap = false);
+  tiled_image (const utils::vec2<uint32_t>& size, bool use_uint16_heightmap,
+	       const storage_params& storage);
 
   tiled_image (const tiled_image&) = delete;
   tiled_image (tiled_image&&);
@@ -65,6 +120,12 @@ public:
   const utils::vec2<uint32_t>& size (void) const { return m_size; }
   bool empty (void) const { return m_size.x == 0 || m_size.y == 0; }
 
+  // the number of LOD levels of an image of the given size.  the levels
+  // go down until a single tile covers the whole image.
+  static unsigned int lod_levels_for_size (const utils::vec2<uint32_t>& size);
+
+  unsigned int num_lod_levels (void) const { return m_tiles.size (); }
+
   void fill (int32_t x, int32_t y, uint32_t width, uint32_t height,
 	     float r, float g, float b, float z);
 
@@ -96,8 +157,116 @@ public:
 	       bool debug_dist,
 	       bool heightmap) const;
 
+  // request the textures of the tiles which would be rendered with the
+  // given camera at a low priority, e.g. for the camera position which is
+  // expected in the next frames.  if 'finer_levels' is set, the next more
+  // detailed tiles are requested too, e.g. when zooming in.
+  void prefetch (const utils::mat4<double>& cam_trv, const utils::mat4<double>& proj_trv,
+		 const utils::mat4<double>& viewport_trv,
+		 bool finer_levels,
+		 bool heightmap) const;
+
+  // how many of the prefetched tiles were used.
+  tile_cache::prefetch_stats texture_prefetch_stats (void) const;
+
   void set_heightmap_palette (const std::vector<std::pair<unsigned int, utils::vec4<float>>>& val);
 
+  // if enabled, the lower detail mipmap levels are not updated right away
+  // when the image is updated, but only when they are needed for rendering.
+  // disabled by default.
+  bool lazy_mipmaps (void) const { return m_rgb_image.lazy (); }
+  void set_lazy_mipmaps (bool val);
+
+  // the texture tiles are prepared on worker threads and uploaded while
+  // rendering.  the uploads of one frame are limited to the given number
+  // of bytes and seconds (0 = no limit).  the default is 4 ms.
+  void set_texture_upload_budget (size_t max_bytes, double max_seconds);
+
+  // the gpu memory for the cached color and height textures in bytes.  the
+  // default is 128 MByte.  changing it drops the cached textures.
+  static constexpr size_t default_texture_cache_budget = 128 << 20;
+
+  void set_texture_cache_budget (size_t val);
+  size_t texture_cache_budget (void) const { return m_texture_cache_budget; }
+
+  // the ram for the prepared textures of the tiles which have been loaded,
+  // so that evicted textures can be uploaded again without preparing them
+  // again (see tile_cache).  0 disables it.  the default is 128 MByte.
+  static constexpr size_t default_texture_staging_budget = 128 << 20;
+
+  void set_texture_staging_budget (size_t val);
+  size_t texture_staging_budget (void) const { return m_texture_staging_budget; }
+
+  // the textures of the 'val' lowest detail levels, which are rendered
+  // whenever most of the image is in view, are kept in the texture cache
+  // (see tile_cache::pin).  they are loaded in the background as soon as
+  // something has been written to them and refreshed when they change.
+  // the levels are pinned from the lowest detail level on, as long as their
+  // uncompressed textures take at most a quarter of the texture cache
+  // budget.  the default is 5 levels, which covers the overview of an image
+  // of about 10000 x 10000 pixels in a viewport of 1000 x 1000 pixels.
+  static constexpr unsigned int default_pinned_texture_levels = 5;
+
+  void set_pinned_texture_levels (unsigned int val);
+  unsigned int pinned_texture_levels (void) const { return m_pinned_texture_levels; }
+
+  // the height textures of the tiles are stored with 8 or 16 bits per
+  // texel, scaled to the height range of each tile, where the heights
+  // change by at most 'val' in the units of the height values.  with 0,
+  // the default, only the tiles whose heights are integers in a small
+  // enough range use fewer bits.  changing it drops the cached textures.
+  void set_max_height_error (float val);
+  float max_height_error (void) const { return m_max_height_error; }
+
+  // if enabled, the color textures are uploaded bc1 (dxt1) compressed,
+  // which takes 1/8 of the graphics card memory and upload bandwidth of
+  // rgba8 textures at some loss of quality.  the workers encode the tiles
+  // and keep up to 'encoded_color_tile_budget' bytes of them, so that
+  // evicted textures are uploaded again without encoding them again.  only
+  // the rgba8 levels are compressed.  needs a gl context and is ignored if
+  // the graphics card doesn't support it.  disabled by default.  changing
+  // it drops the cached textures.
+  static constexpr size_t encoded_color_tile_budget = 64 << 20;
+
+  void set_compressed_color_textures (bool val);
+  bool compressed_color_textures (void) const { return m_compressed_color_textures; }
+
+  // the order in which the textures are evicted when the texture cache is
+  // full (see eviction_policy).  the cost of a tile is the factor by which
+  // its edges are scaled down, i.e. the coarse tiles, which are needed
+  // whenever the view is zoomed out, are kept longer by 'gdsf'.  the
+  // default is 'lru'.  changing it drops the cached textures.
+  void set_texture_eviction_policy (eviction_policy::kind val);
+  eviction_policy::kind texture_eviction_policy (void) const { return m_texture_eviction_policy; }
+
+  // write the texture tiles which are rendered to a file, for comparing
+  // the eviction policies and budgets offline (see tile_cache::set_trace
+  // and '3dview_bench evict_sim').  an empty filename stops it.
+  void set_texture_trace (const std::string& filename);
+
+  // the number of visible tiles whose textures were not ready in the last
+  // frame.  they have been rendered with the textures of a lower detail
+  // level or not at all.  if it's not zero, another frame should be
+  // rendered.
+  unsigned int num_missing_tiles (void) const { return m_num_missing_tiles; }
+
+  // count the rendering and the updates of the image in 'val', which must
+  // outlive the image.  null = no counting.  the cached textures are kept.
+  // the texture tiles which are being prepared when the stats are replaced
+  // might still be counted in the previous ones.
+  void set_stats (render_stats* val);
+
+  // the statistics of the compressed tiles.  all zero if the image doesn't
+  // use compression.
+  compressed_tier::stats compressed_tier_stats (void) const;
+
+  // the range (min, max) of the z values of the heightmap in the area, as
+  // they are rendered, i.e. in model coordinates before the scene's z scale.
+  // the range is conservative and might include some pixels around the area.
+  // takes constant time.
+  utils::vec2<float> z_range (const utils::vec2<uint32_t>& xy,
+			      const utils::vec2<uint32_t>& size) const;
+
 private:
   struct vertex;
   struct shader;
@@ -107,40 +276,85 @@ private:
   struct tile_visibility;
   struct texture_key;
 
-  class cpu_image;
+  struct update_region
+  {
+    utils::vec2<unsigned int> tl;
+    utils::vec2<unsigned int> br;
+  };
 
-  // since the gpu texture format might be different from the cpu image
-  // store that, as part of the image.
-  class cpu_image : public img::image
+  // the mipmap levels of an image.
+  // in lazy mode, updates are written only to the top level and the affected
+  // blocks of the lower detail levels are marked as dirty.  the dirty blocks
+  // are reduced from the next higher detail level when they are needed.
+  class mipmap_pyramid
   {
   public:
-    cpu_image (void) : img::image (), m_texture_format (img::pixel_format::invalid) { }
+    // granularity of the dirty tracking, in pixels of the respective level.
+    static constexpr unsigned int dirty_block_size = 64;
 
-    cpu_image (img::pixel_format pf, const utils::vec2<unsigned int>& size,
-	       img::pixel_format texture_format)
-    : img::image (pf, size), m_texture_format (texture_format)
-    {
-    }
+    cpu_image& operator [] (unsigned int i) { return m_level[i]; }
+    const cpu_image& operator [] (unsigned int i) const { return m_level[i]; }
+
+    unsigned int size (void) const { return m_level.size (); }
+
+    // set the number of levels.  the levels are empty.
+    void resize (unsigned int num_levels);
+
+    bool lazy (void) const { return m_lazy; }
+
+    // when switching lazy mode off, all dirty blocks are resolved.
+    void set_lazy (bool val);
+
+    // mark the area of level 'lvl' as out of date.
+    void mark_dirty (unsigned int lvl, const update_region& r);
+
+    // bring the area of level 'lvl' up to date.  this recursively resolves
+    // the dirty blocks of the higher detail levels which are needed.
+    void resolve (unsigned int lvl, const update_region& r);
+
+    // mark the texture tiles of all levels which contain any pixel of the
+    // top level area as written.
+    void mark_written (const update_region& top_level_region);
 
-    auto texture_format (void) const { return m_texture_format; }
+    // true if anything has been written to the texture tile at 'top_level_pos'
+    // of level 'lvl'.  unwritten tiles are all zero.
+    bool written (unsigned int lvl, const utils::vec2<unsigned int>& top_level_pos) const;
+
+    // start a new generation and assign it to the texture tiles whose
+    // texels, including the sampling border, are in the changed areas of
+    // the levels.
+    void mark_changed (const std::vector<update_region>& regions);
+
+    // the generation of the texels of the texture tile at 'top_level_pos'
+    // of level 'lvl', i.e. of the last update which changed them.  0 if
+    // it has never been changed.
+    uint64_t generation (unsigned int lvl, const utils::vec2<unsigned int>& top_level_pos) const;
+
+    // true if all texels of the texture tile at 'top_level_pos' of level
+    // 'lvl', including the sampling border, have the same value.  the
+    // texel is stored in the lower bytes of 'value'.
+    bool constant (unsigned int lvl, const utils::vec2<unsigned int>& top_level_pos,
+		   uint64_t& value);
 
   private:
-    img::pixel_format m_texture_format;
-  };
+    std::vector<cpu_image> m_level;
 
-  struct load_texture_tile
-  {
-    std::reference_wrapper<std::array<cpu_image, max_lod_level>> m_img;
+    bool m_lazy = false;
+
+    // one flag per dirty block for each level.  the top level is never dirty.
+    std::vector<std::vector<bool>> m_dirty;
+    std::vector<unsigned int> m_dirty_stride;
+    std::vector<unsigned int> m_dirty_count;
 
-    load_texture_tile (std::array<cpu_image, max_lod_level>& img) : m_img (img) { }
-    load_texture_tile (void) = delete;
-    load_texture_tile (const load_texture_tile&) = default;
-    load_texture_tile (load_texture_tile&&) = default;
-    load_texture_tile& operator = (const load_texture_tile&) = default;
-    load_texture_tile& operator = (load_texture_tile&&) = default;
+    // one flag per texture tile for each level.  the tiles are counted in
+    // top level coordinates, like the geometry tiles.
+    std::vector<std::vector<bool>> m_written;
+    std::vector<unsigned int> m_written_stride;
 
-    // replace the specified entry for the specified key.
-    void operator () (const texture_key& key, gl::texture& entry);
+    // one generation per texture tile for each level, in the same grid as
+    // the written flags.
+    std::vector<std::vector<uint64_t>> m_generation;
+    uint64_t m_last_generation = 0;
   };
 
   // shader and geomety is shared amongst image instances.
@@ -151,26 +365,82 @@ private:
   // size of the whole image.
   utils::vec2<uint32_t> m_size;
 
-  // z scale of the heightmap texture.  depends on the texel format used.
+  // z scale of the heightmap texture of each level.  depends on the texel
+  // format used.
   // e.g. r8 = 1/256, r16 = 1/65536, r16ui = 1, r32f = 1
   // although integer textures are too restrictive and not useful.
-  float m_texture_z_scale;
+  std::vector<float> m_texture_z_scale;
+
+  // the texel value of a stored height value of each level.  normalized
+  // textures sample the heights as 0 .. 1.
+  std::vector<float> m_height_texel_scale;
+
+  // the memory of the mipmaps.  must be destroyed after the mipmaps.
+  // the memory is allocated sparsely.  only the parts of the image which
+  // are actually written take up memory.
+  std::unique_ptr<mapped_arena> m_arena;
 
-  // for simplicity, keep the whole image mipmaps in memory.
+  // the compressed tiles of the mipmaps, if any.  must be destroyed after
+  // the mipmaps, too.  the color and height mipmaps are updated in parallel
+  // and thus have separate tiers.
+  std::unique_ptr<compressed_tier> m_rgb_tier;
+  std::unique_ptr<compressed_tier> m_height_tier;
+
+  // the whole image mipmaps are in (virtual) memory.
   // one FOV image is 2048x2048 @ 32 bpp = 16 MByte, 20 FOVs = 320 MByte.
-  std::array<cpu_image, max_lod_level> m_rgb_image;
-  std::array<cpu_image, max_lod_level> m_height_image;
+  // for huge images use file backed storage.
+  mipmap_pyramid m_rgb_image;
+  mipmap_pyramid m_height_image;
+
+  // the value ranges of the top level heightmap.  the lower detail levels
+  // are averages of the top level and thus within the same ranges.
+  // updated together with the top level.
+  minmax_pyramid m_height_range;
 
   // a reference to the shared shader.
   std::shared_ptr<shader> m_shader;
   std::shared_ptr<heightmap_shader> m_heightmap_shader;
 
-  // all tiles in the image.
-  std::array<std::vector<tile>, max_lod_level> m_tiles;
+  // all tiles in the image, for each level.  the lowest detail level
+  // has a single tile.
+  std::vector<std::vector<tile>> m_tiles;
+
+  // the texture tiles are prepared from the mipmaps by the workers.  an
+  // update of the mipmaps and the preparation of a tile must not run at
+  // the same time.
+  std::mutex m_rgb_image_mutex;
+  std::mutex m_height_image_mutex;
+
+  std::unique_ptr<worker_pool> m_workers;
+
+  // the encoded color textures.  must outlive the jobs of the texture
+  // cache, which find and insert them.
+  bool m_compressed_color_textures = false;
+  std::unique_ptr<encoded_tile_cache> m_encoded_color_tiles;
+
+  // the color and height textures of the tiles.  must be destroyed before
+  // the workers and the encoded textures, which its jobs use.
+  std::unique_ptr<tile_cache> m_texture_cache;
+  size_t m_texture_cache_budget = default_texture_cache_budget;
+  size_t m_texture_staging_budget = default_texture_staging_budget;
+  unsigned int m_pinned_texture_levels = default_pinned_texture_levels;
+  float m_max_height_error = 0;
+
+  eviction_policy::kind m_texture_eviction_policy = eviction_policy::lru;
+  std::unique_ptr<std::ostream> m_texture_trace;
+
+  // the upload budget per frame.
+  size_t m_upload_budget_bytes = 0;
+  double m_upload_budget_seconds = 0.004;
+
+  // the number of visible tiles in the last frame whose textures were
+  // not ready.
+  mutable unsigned int m_num_missing_tiles = 0;
 
-  // texture tile cache
-  mutable utils::lru_cache<texture_key, gl::texture, load_texture_tile> m_rgb_texture_cache;
-  mutable utils::lru_cache<texture_key, gl::texture, load_texture_tile> m_height_texture_cache;
+  render_stats* m_stats = nullptr;
+
+  // 'm_stats' for the jobs of the texture cache, which run on the workers.
+  std::atomic<render_stats*> m_worker_stats { nullptr };
 
   // candidate tiles for display.  modified during rendering.
   mutable std::vector<const tile*> m_candidate_tiles;
@@ -178,32 +448,111 @@ private:
   // actually visible tiles for display.   modified during rendering.
   mutable std::vector<const tile*> m_visible_tiles;
 
+  // the level and the slots of the textures which were drawn for each
+  // visible tile, -1 if it was skipped.  the wireframe pass uses them
+  // without looking the tiles up again.
+  struct drawn_textures
+  {
+    int lvl;
+    tile_cache::tile_slots slots;
+  };
+
+  mutable std::vector<drawn_textures> m_drawn_textures;
+
+  // the tiles of the predicted view.  modified during prefetching.
+  mutable std::vector<const tile*> m_prefetch_tiles;
+
   // color palette and some additional info for heightmap visualization.
   gl::texture m_heightmap_palette;
   unsigned int m_heightmap_palette_min_value = 0;
   unsigned int m_heightmap_palette_max_value = 0;
   unsigned int m_heightmap_step_size = 0;
 
-  struct update_region
-  {
-    utils::vec2<unsigned int> tl;
-    utils::vec2<unsigned int> br;
-  };
-
-  static std::array<update_region, max_lod_level>
-  update_mipmaps (std::array<cpu_image, max_lod_level>& img,
+  // the mipmaps are updated in blocks of this size (in top level pixels).
+  // each block is written to the top level and then reduced through all the
+  // lower detail levels while the data is still in the cpu cache.
+  // below level 'mipmap_block_levels' a block is smaller than one pixel.
+  // those levels are reduced after the whole area has been done.
+  static constexpr unsigned int mipmap_block_levels = 6;
+  static constexpr unsigned int mipmap_block_size = 1 << mipmap_block_levels;
+
+  // writes a block of the top level image.  'xy' and 'size' are in
+  // top level image coordinates.
+  typedef std::function<void (const utils::vec2<unsigned int>& xy,
+			      const utils::vec2<unsigned int>& size)> write_block_func;
+
+  // update the top level area with 'write_block' (if any) and update the
+  // mipmap pyramid of the area.  returns the updated area of each level.
+  // in lazy mode the lower levels are only marked as dirty.  the time is
+  // added to the pyramid time of 'stats', if any.
+  static std::vector<update_region>
+  update_mipmaps (mipmap_pyramid& img,
 		  const utils::vec2<unsigned int>& top_level_xy,
-		  const utils::vec2<unsigned int>& top_level_size);
+		  const utils::vec2<unsigned int>& top_level_size,
+		  const write_block_func& write_block = nullptr,
+		  render_stats* stats = nullptr);
+
+  // count an update, which started at 'start'.  'regions' are the updated
+  // areas of the levels.
+  void count_update (const std::vector<update_region>& regions,
+		     std::chrono::steady_clock::time_point start) const;
+
+  // the range of the heightmap texel values of level 'lvl' in the top level
+  // area (tl, br), as they are sampled by the shader.
+  utils::vec2<float> texel_range (unsigned int lvl, const utils::vec2<unsigned int>& tl,
+				  const utils::vec2<unsigned int>& br) const;
+
+  void create_texture_cache (void);
+
+  // pin the written textures of the pinned levels.
+  void pin_textures (void);
+
+  // the eviction cost of a texture tile in the texture cache.
+  static double texture_tile_cost (uint64_t key);
+
+  // the heightmap palette range for the texel values of level 'lvl'.
+  float heightmap_min_val (unsigned int lvl) const;
+  float heightmap_max_val (unsigned int lvl) const;
+
+  // the tiles which are rendered with the given camera, in their level of
+  // detail.  uses m_candidate_tiles.  returns the number of tiles which
+  // have been tested for visibility.
+  unsigned int select_tiles (const utils::mat4<double>& cam_trv, const utils::mat4<double>& proj_trv,
+		     const utils::mat4<double>& viewport_trv, bool heightmap,
+		     std::vector<const tile*>& out) const;
+
+  // runs on a worker thread.
+  static void
+  prepare_texture_tile (mipmap_pyramid& img, std::mutex& img_mutex, uint64_t key,
+			tile_cache::texture_data& out);
+
+  // store the prepared height texture with fewer bits per texel if the
+  // heights don't change by more than 'max_error'.  runs on a worker
+  // thread.
+  static void
+  quantize_height_texture (tile_cache::texture_data& d, float max_error,
+			   render_stats* stats);
+
+  // replace the prepared rgba8 color texture by its bc1 blocks, which are
+  // taken from 'encoded' if possible.  'stamp' is the stamp of 'encoded'
+  // before the texels were read.  runs on a worker thread.
+  static void
+  compress_color_texture (tile_cache::texture_data& d, uint64_t key,
+			  encoded_tile_cache* encoded, uint64_t stamp,
+			  render_stats* stats);
 
+  // refresh the cached textures which overlap the regions of the image and
+  // forget their encoded textures.
   static void
-  invalidate_texture_cache (utils::lru_cache<texture_key, gl::texture, load_texture_tile>& cache,
-			    const std::array<update_region, max_lod_level>& regions);
+  update_texture_cache (tile_cache* cache, encoded_tile_cache* encoded,
+			tile_cache::texture_index t,
+			const mipmap_pyramid& img, const std::vector<update_region>& regions);
 
   tile_visibility
   calc_tile_visibility (const tile& t,
 			const utils::mat4<double>& proj_cam_trv,
 			const utils::mat4<double>& viewport_trv,
-			float zscale) const;
+			const utils::vec2<float>& z_range) const;
 };
 
 #endif // includeguard_tiled_image_hpp_includeguard
@@ -0,0 +1,950 @@
+
+// cpu-only benchmarks for the image pyramid and texture tile code.
+// this doesn't need a display or a gl context.
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cmath>
+#include <array>
+#include <map>
+#include <list>
+#include <algorithm>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+  #include <sys/ioctl.h>
+  #include <unistd.h>
+#endif
+
+#include "pyr_down.hpp"
+#include "cpu_image.hpp"
+#include "tile_codec.hpp"
+#include "bc1_codec.hpp"
+#include "tile_map.hpp"
+#include "eviction_policy.hpp"
+
+using img::pixel_format;
+using utils::vec2;
+
+// ----------------------------------------------------------------------------
+
+// counts the last level cache misses of this thread with the linux perf
+// events interface.  if that's not available, the count is always -1.
+class cache_miss_counter
+{
+public:
+  cache_miss_counter (void)
+  {
+#ifdef __linux__
+    perf_event_attr attr;
+    std::memset (&attr, 0, sizeof (attr));
+    attr.size = sizeof (attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    m_fd = (int)syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  ~cache_miss_counter (void)
+  {
+#ifdef __linux__
+    if (m_fd >= 0)
+      close (m_fd);
+#endif
+  }
+
+  void start (void)
+  {
+#ifdef __linux__
+    if (m_fd >= 0)
+    {
+      ioctl (m_fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl (m_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+  }
+
+  long long stop (void)
+  {
+    long long count = -1;
+#ifdef __linux__
+    if (m_fd >= 0)
+    {
+      ioctl (m_fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read (m_fd, &count, sizeof (count)) != sizeof (count))
+	count = -1;
+    }
+#endif
+    return count;
+  }
+
+private:
+  int m_fd = -1;
+};
+
+// ----------------------------------------------------------------------------
+
+static int bench_pyr_down (int argc, const char* argv[])
+{
+  const unsigned int width = argc > 0 ? std::atoi (argv[0]) : 2048;
+  const unsigned int height = argc > 1 ? std::atoi (argv[1]) : 2048;
+  const unsigned int iterations = argc > 2 ? std::atoi (argv[2]) : 20;
+
+  std::cout << "pyr_down " << width << " x " << height
+	    << " -> " << width/2 << " x " << height/2
+	    << ", " << iterations << " iterations"
+	    << ", best isa: " << pyr_down::isa_name (pyr_down::best_isa ())
+	    << std::endl;
+
+  struct format_info
+  {
+    pixel_format pf;
+    pixel_format dst_pf;
+    const char* name;
+    unsigned int bytes_per_pixel;
+    unsigned int dst_bytes_per_pixel;
+  };
+
+  const format_info formats[] =
+  {
+    { pixel_format::rgba8, pixel_format::rgba8, "rgba8", 4, 4 },
+    { pixel_format::r16ui, pixel_format::r16ui, "r16ui", 2, 2 },
+    { pixel_format::r32f, pixel_format::r32f, "r32f", 4, 4 },
+    { pixel_format::r5_g6_b5, pixel_format::r5_g6_b5, "rgb565", 2, 2 },
+    { pixel_format::rgba8, pixel_format::r5_g6_b5, "rgba8->rgb565", 4, 2 },
+    { pixel_format::r32f, pixel_format::r16ui, "r32f->r16ui", 4, 2 }
+  };
+
+  std::mt19937 rnd (1234);
+
+  int result = 0;
+
+  for (const auto& f : formats)
+  {
+    const unsigned int src_bpl = width * f.bytes_per_pixel;
+    const unsigned int dst_bpl = (width / 2) * f.dst_bytes_per_pixel;
+
+    std::vector<uint8_t> src (src_bpl * height);
+
+    if (f.pf == pixel_format::r32f)
+    {
+      // also some values out of the r16ui range.
+      std::uniform_real_distribution<float> dist (-1000, 70000);
+      for (unsigned int i = 0; i < width * height; ++i)
+      {
+	float v = dist (rnd);
+	std::memcpy (&src[i * 4], &v, 4);
+      }
+    }
+    else
+      for (auto& v : src)
+	v = (uint8_t)rnd ();
+
+    std::vector<uint8_t> ref_dst;
+
+    for (unsigned int i = 0; i < (unsigned int)pyr_down::isa::count; ++i)
+    {
+      auto k = pyr_down::find_kernel (f.pf, f.dst_pf, (pyr_down::isa)i);
+      if (k == nullptr)
+	continue;
+
+      std::vector<uint8_t> dst (dst_bpl * (height / 2), 0);
+
+      auto t0 = std::chrono::high_resolution_clock::now ();
+
+      for (unsigned int n = 0; n < iterations; ++n)
+	k (src.data (), src_bpl, dst.data (), dst_bpl, width / 2, height / 2);
+
+      auto t1 = std::chrono::high_resolution_clock::now ();
+
+      double sec = std::chrono::duration<double> (t1 - t0).count ();
+      double mpix = (double)width * height * iterations / 1000000.0;
+
+      bool identical = true;
+      if (ref_dst.empty ())
+	ref_dst = dst;
+      else
+	identical = ref_dst == dst;
+
+      if (!identical)
+	result = 1;
+
+      std::cout << "  " << std::setw (14) << std::left << f.name
+		<< std::setw (7) << pyr_down::isa_name ((pyr_down::isa)i)
+		<< std::right << std::fixed << std::setprecision (1)
+		<< std::setw (10) << mpix / sec << " MPixel/s (source)"
+		<< (identical ? "" : "  MISMATCH vs. scalar")
+		<< std::endl;
+    }
+  }
+
+  return result;
+}
+
+// ----------------------------------------------------------------------------
+
+static int bench_tile_extract (int argc, const char* argv[])
+{
+  const unsigned int width = argc > 0 ? std::atoi (argv[0]) : 4096;
+  const unsigned int height = argc > 1 ? std::atoi (argv[1]) : 4096;
+  const unsigned int iterations = argc > 2 ? std::atoi (argv[2]) : 10;
+
+  const unsigned int bs = cpu_image::brick_size;
+
+  std::cout << "tile_extract " << width << " x " << height
+	    << ", " << bs << " x " << bs << " tiles"
+	    << ", " << iterations << " iterations" << std::endl;
+
+  struct format_info
+  {
+    pixel_format pf;
+    const char* name;
+  };
+
+  const format_info formats[] =
+  {
+    { pixel_format::rgba8, "rgba8" },
+    { pixel_format::r16ui, "r16ui" },
+    { pixel_format::r32f, "r32f" }
+  };
+
+  struct layout_info
+  {
+    cpu_image::layout l;
+    const char* name;
+  };
+
+  const layout_info layouts[] =
+  {
+    { cpu_image::layout::linear, "linear" },
+    { cpu_image::layout::bricked, "bricked" }
+  };
+
+  std::mt19937 rnd (1234);
+  cache_miss_counter cache_misses;
+
+  int result = 0;
+
+  for (const auto& f : formats)
+  {
+    img::image src (f.pf, { width, height });
+    for (unsigned int y = 0; y < height; ++y)
+    {
+      uint8_t* row = (uint8_t*)src.data () + y * src.bytes_per_line ();
+      for (unsigned int x = 0; x < src.bytes_per_line (); ++x)
+	row[x] = (uint8_t)rnd ();
+    }
+
+    if (f.pf == pixel_format::r32f)
+      for (unsigned int y = 0; y < height; ++y)
+      {
+	float* row = (float*)((uint8_t*)src.data () + y * src.bytes_per_line ());
+	for (unsigned int x = 0; x < width; ++x)
+	  row[x] = (float)(rnd () % 100000) * 0.01f;
+      }
+
+    img::image tile (f.pf, { bs, bs });
+    std::vector<uint8_t> ref_tiles;
+
+    for (const auto& l : layouts)
+    {
+      cpu_image ci (f.pf, { width, height }, f.pf, l.l);
+      ci.write (src, { 0, 0 }, src.size (), { 0, 0 });
+
+      const auto num_tiles = ci.num_tiles ();
+
+      // the first pass brings the brick borders up to date and collects
+      // the tiles for comparing the layouts.
+      std::vector<uint8_t> tiles;
+      for (unsigned int ty = 0; ty < num_tiles.y; ++ty)
+	for (unsigned int tx = 0; tx < num_tiles.x; ++tx)
+	{
+	  ci.copy_tile ({ tx, ty }, tile);
+	  for (unsigned int y = 0; y < bs; ++y)
+	  {
+	    const uint8_t* row = (const uint8_t*)tile.data () + y * tile.bytes_per_line ();
+	    tiles.insert (tiles.end (), row, row + tile.bytes_per_line ());
+	  }
+	}
+
+      cache_misses.start ();
+      auto t0 = std::chrono::high_resolution_clock::now ();
+
+      for (unsigned int n = 0; n < iterations; ++n)
+	for (unsigned int ty = 0; ty < num_tiles.y; ++ty)
+	  for (unsigned int tx = 0; tx < num_tiles.x; ++tx)
+	    ci.copy_tile ({ tx, ty }, tile);
+
+      auto t1 = std::chrono::high_resolution_clock::now ();
+      long long misses = cache_misses.stop ();
+
+      const double count = (double)num_tiles.x * num_tiles.y * iterations;
+      const double usec = std::chrono::duration<double, std::micro> (t1 - t0).count ();
+
+      bool identical = true;
+      if (ref_tiles.empty ())
+	ref_tiles = std::move (tiles);
+      else
+	identical = ref_tiles == tiles;
+
+      if (!identical)
+	result = 1;
+
+      std::cout << "  " << std::setw (14) << std::left << f.name
+		<< std::setw (8) << l.name
+		<< std::right << std::fixed << std::setprecision (2)
+		<< std::setw (8) << usec / count << " us/tile";
+
+      if (misses >= 0)
+	std::cout << std::setw (10) << std::setprecision (1)
+		  << misses / count << " cache misses/tile";
+      else
+	std::cout << "  cache misses n/a";
+
+      std::cout << (identical ? "" : "  MISMATCH vs. linear") << std::endl;
+    }
+  }
+
+  return result;
+}
+
+// ----------------------------------------------------------------------------
+
+static int bench_tile_codec (int argc, const char* argv[])
+{
+  const unsigned int iterations = argc > 0 ? std::atoi (argv[0]) : 200;
+
+  const unsigned int bs = cpu_image::brick_size;
+
+  std::cout << "tile_codec " << bs << " x " << bs << " tiles"
+	    << ", " << iterations << " iterations" << std::endl;
+
+  struct content_info
+  {
+    pixel_format pf;
+    const char* name;
+  };
+
+  // 'noise' is the worst case.  'smooth' is a height map or an image with
+  // slowly changing values.  'flat' is a filled area.
+  const content_info contents[] =
+  {
+    { pixel_format::rgba8, "noise" },
+    { pixel_format::rgba8, "smooth" },
+    { pixel_format::rgba8, "flat" },
+    { pixel_format::r16ui, "noise" },
+    { pixel_format::r16ui, "smooth" },
+    { pixel_format::r16ui, "flat" },
+    { pixel_format::r32f, "noise" },
+    { pixel_format::r32f, "smooth" },
+    { pixel_format::r32f, "flat" }
+  };
+
+  std::mt19937 rnd (1234);
+
+  int result = 0;
+
+  for (const auto& c : contents)
+  {
+    img::image tile (c.pf, { bs, bs });
+    const bool noise = std::strcmp (c.name, "noise") == 0;
+    const bool smooth = std::strcmp (c.name, "smooth") == 0;
+
+    for (unsigned int y = 0; y < bs; ++y)
+    {
+      uint8_t* row = (uint8_t*)tile.data () + y * tile.bytes_per_line ();
+
+      for (unsigned int x = 0; x < bs; ++x)
+      {
+	// a tilted plane with a bit of noise.
+	const double v = smooth ? x * 3.1 + y * 1.7 + (rnd () % 3) : noise ? rnd () % 100000 : 42;
+
+	if (c.pf == pixel_format::rgba8)
+	  for (unsigned int i = 0; i < 4; ++i)
+	    row[x*4 + i] = noise ? (uint8_t)rnd () : (uint8_t)((int)v / (i + 1));
+	else if (c.pf == pixel_format::r16ui)
+	  ((uint16_t*)row)[x] = (uint16_t)(noise ? rnd () : (unsigned int)v);
+	else
+	  ((float*)row)[x] = (float)(v * 0.01);
+      }
+    }
+
+    const size_t raw_bytes = (size_t)tile.bytes_per_line () * bs;
+    std::vector<uint8_t> data;
+
+    auto t0 = std::chrono::high_resolution_clock::now ();
+
+    for (unsigned int n = 0; n < iterations; ++n)
+    {
+      data.clear ();
+      tile_codec::encode (tile.data (), tile.bytes_per_line (), tile.size (), c.pf, data);
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now ();
+
+    img::image decoded (c.pf, { bs, bs });
+    bool identical = true;
+
+    for (unsigned int n = 0; n < iterations; ++n)
+      identical &= tile_codec::decode (data.data (), data.size (), decoded.data (),
+				       decoded.bytes_per_line (), decoded.size (), c.pf);
+
+    auto t2 = std::chrono::high_resolution_clock::now ();
+
+    for (unsigned int y = 0; y < bs && identical; ++y)
+      identical = std::memcmp ((const uint8_t*)tile.data () + y * tile.bytes_per_line (),
+			       (const uint8_t*)decoded.data () + y * decoded.bytes_per_line (),
+			       tile.bytes_per_line ()) == 0;
+
+    if (!identical)
+      result = 1;
+
+    const double mbytes = (double)raw_bytes * iterations / (1024 * 1024);
+
+    std::cout << "  " << std::setw (6) << std::left
+	      << (c.pf == pixel_format::rgba8 ? "rgba8" : c.pf == pixel_format::r16ui ? "r16ui" : "r32f")
+	      << std::setw (7) << c.name
+	      << std::right << std::fixed << std::setprecision (2)
+	      << std::setw (8) << (double)raw_bytes / data.size () << " : 1"
+	      << std::setprecision (0)
+	      << std::setw (8) << mbytes / std::chrono::duration<double> (t1 - t0).count ()
+	      << " MByte/s encode"
+	      << std::setw (8) << mbytes / std::chrono::duration<double> (t2 - t1).count ()
+	      << " MByte/s decode"
+	      << (identical ? "" : "  MISMATCH") << std::endl;
+  }
+
+  return result;
+}
+
+// ----------------------------------------------------------------------------
+
+static int bench_bc1 (int argc, const char* argv[])
+{
+  const unsigned int iterations = argc > 0 ? std::atoi (argv[0]) : 200;
+
+  // a color texture tile with its border.
+  const unsigned int ts = 128;
+
+  std::cout << "bc1 " << ts << " x " << ts << " rgba8 tiles"
+	    << ", " << iterations << " iterations" << std::endl;
+
+  // 'noise' is the worst case.  'smooth' are slowly changing colors.
+  // 'edges' are flat areas with hard edges, like text or markings.
+  const char* contents[] = { "noise", "smooth", "edges" };
+
+  std::mt19937 rnd (1234);
+
+  int result = 0;
+
+  for (const char* name : contents)
+  {
+    img::image tile (pixel_format::rgba8, { ts, ts });
+    const bool noise = std::strcmp (name, "noise") == 0;
+    const bool smooth = std::strcmp (name, "smooth") == 0;
+
+    for (unsigned int y = 0; y < ts; ++y)
+    {
+      uint8_t* row = (uint8_t*)tile.data () + y * tile.bytes_per_line ();
+
+      for (unsigned int x = 0; x < ts; ++x)
+	for (unsigned int i = 0; i < 4; ++i)
+	{
+	  const bool inside = (x / 11 + y / 7) % 3 == 0;
+	  row[x*4 + i] = noise ? (uint8_t)rnd ()
+			 : smooth ? (uint8_t)((x * (i + 1) + y * (3 - i)) / 3 + rnd () % 3)
+			 : (uint8_t)(inside ? 40 + i * 60 : 220 - i * 50);
+	}
+    }
+
+    std::vector<uint8_t> reference (bc1_codec::encoded_size (tile.size ()));
+    bc1_codec::find_encoder (pyr_down::isa::scalar) (tile.data (), tile.bytes_per_line (),
+						    reference.data (), ts, ts);
+
+    // the quality, the same for all encoders.
+    img::image decoded (pixel_format::rgba8, { ts, ts });
+    bc1_codec::decode (reference.data (), decoded.data (), decoded.bytes_per_line (), decoded.size ());
+
+    double sum_sq = 0;
+    for (unsigned int y = 0; y < ts; ++y)
+    {
+      const uint8_t* a = (const uint8_t*)tile.data () + y * tile.bytes_per_line ();
+      const uint8_t* b = (const uint8_t*)decoded.data () + y * decoded.bytes_per_line ();
+
+      for (unsigned int x = 0; x < ts; ++x)
+	for (unsigned int i = 0; i < 3; ++i)
+	  sum_sq += (double)(a[x*4 + i] - b[x*4 + i]) * (a[x*4 + i] - b[x*4 + i]);
+    }
+
+    const double mse = sum_sq / ((double)ts * ts * 3);
+    const double psnr = mse > 0 ? 10 * std::log10 (255.0 * 255.0 / mse) : 99.0;
+
+    std::cout << "  " << std::setw (7) << std::left << name << std::right
+	      << std::fixed << std::setprecision (2)
+	      << std::setw (8) << (double)tile.bytes_per_line () * ts / reference.size () << " : 1"
+	      << std::setw (8) << psnr << " dB psnr" << std::endl;
+
+    for (unsigned int i = 0; i < (unsigned int)pyr_down::isa::count; ++i)
+    {
+      const auto encode = bc1_codec::find_encoder ((pyr_down::isa)i);
+      if (encode == nullptr)
+	continue;
+
+      std::vector<uint8_t> data (reference.size ());
+
+      auto t0 = std::chrono::high_resolution_clock::now ();
+
+      for (unsigned int n = 0; n < iterations; ++n)
+	encode (tile.data (), tile.bytes_per_line (), data.data (), ts, ts);
+
+      auto t1 = std::chrono::high_resolution_clock::now ();
+
+      const bool identical = data == reference;
+      if (!identical)
+	result = 1;
+
+      const double mpixels = (double)ts * ts * iterations / 1e6;
+
+      std::cout << "    " << std::setw (8) << std::left << pyr_down::isa_name ((pyr_down::isa)i)
+		<< std::right << std::setprecision (1)
+		<< std::setw (8) << mpixels / std::chrono::duration<double> (t1 - t0).count ()
+		<< " MPixel/s encode"
+		<< (identical ? "" : "  MISMATCH vs. scalar") << std::endl;
+    }
+  }
+
+  return result;
+}
+
+// ----------------------------------------------------------------------------
+
+// the key of the texture tile (x, y) of level 'lvl', packed like
+// tiled_image::texture_key: the level in the lowest 6 bits and the image
+// position of the tile's top left pixel in 29 bits each.  the tiles have
+// the size of tiled_image::texture_tile_size in pixels of their level.
+static uint64_t bench_texture_key (unsigned int lvl, unsigned int x, unsigned int y)
+{
+  const unsigned int tile_size = 112u << lvl;
+
+  return (uint64_t)lvl | ((uint64_t)(x * tile_size) << 6)
+	 | ((uint64_t)(y * tile_size) << (6+29));
+}
+
+// the resident tiles of the texture cache, as an ordered map with an lru
+// list (what tile_cache used before) and as a tile_map.  the entries have
+// about the size of a tile_cache entry.
+typedef std::array<uint64_t, 10> bench_tile_entry;
+
+class bench_ordered_tiles
+{
+public:
+  bool touch (uint64_t key)
+  {
+    auto i = m_tiles.find (key);
+    if (i == m_tiles.end ())
+      return false;
+
+    m_lru.splice (m_lru.begin (), m_lru, i->second.lru);
+    return true;
+  }
+
+  void insert (uint64_t key)
+  {
+    m_lru.push_front (key);
+    auto&& e = m_tiles[key];
+    e.lru = m_lru.begin ();
+  }
+
+  void erase (uint64_t key)
+  {
+    auto i = m_tiles.find (key);
+    if (i == m_tiles.end ())
+      return;
+
+    m_lru.erase (i->second.lru);
+    m_tiles.erase (i);
+  }
+
+  uint64_t evict (void)
+  {
+    const uint64_t key = m_lru.back ();
+    erase (key);
+    return key;
+  }
+
+private:
+  struct entry
+  {
+    bench_tile_entry data;
+    std::list<uint64_t>::iterator lru;
+  };
+
+  std::map<uint64_t, entry> m_tiles;
+  std::list<uint64_t> m_lru;
+};
+
+class bench_hashed_tiles
+{
+public:
+  bool touch (uint64_t key)
+  {
+    auto h = m_tiles.find (key);
+    if (h == m_tiles.npos)
+      return false;
+
+    m_tiles.lru_push_front (h);
+    return true;
+  }
+
+  void insert (uint64_t key)
+  {
+    m_tiles.lru_push_front (m_tiles.insert (key, bench_tile_entry ()));
+  }
+
+  void erase (uint64_t key)
+  {
+    auto h = m_tiles.find (key);
+    if (h != m_tiles.npos)
+      m_tiles.erase (h);
+  }
+
+  uint64_t evict (void)
+  {
+    const uint64_t key = m_tiles.key (m_tiles.lru_back ());
+    m_tiles.erase (m_tiles.lru_back ());
+    return key;
+  }
+
+private:
+  tile_map<bench_tile_entry> m_tiles;
+};
+
+template <typename Tiles> static void
+bench_tile_map_run (const char* name, unsigned int grid, unsigned int iterations)
+{
+  auto&& key = bench_texture_key;
+
+  Tiles tiles;
+  for (unsigned int y = 0; y < grid; ++y)
+    for (unsigned int x = 0; x < grid; ++x)
+      tiles.insert (key (0, x, y));
+
+  std::mt19937 rnd (1234);
+
+  // a frame looks up a view of a quarter of the tiles and their parents,
+  // which are missing.
+  std::vector<uint64_t> view;
+  for (unsigned int y = grid / 4; y < grid * 3 / 4; ++y)
+    for (unsigned int x = grid / 4; x < grid * 3 / 4; ++x)
+      view.push_back (key (0, x, y));
+  std::shuffle (view.begin (), view.end (), rnd);
+
+  typedef std::chrono::high_resolution_clock clock;
+  auto&& nsec_per_op = [] (clock::time_point t0, size_t ops)
+  {
+    return std::chrono::duration<double, std::nano> (clock::now () - t0).count () / ops;
+  };
+
+  size_t found = 0;
+
+  auto t0 = clock::now ();
+  for (unsigned int n = 0; n < iterations; ++n)
+    for (uint64_t k : view)
+      found += tiles.touch (k);
+  const double hit_ns = nsec_per_op (t0, (size_t)iterations * view.size ());
+
+  t0 = clock::now ();
+  for (unsigned int n = 0; n < iterations; ++n)
+    for (uint64_t k : view)
+      found += tiles.touch (k + 1);
+  const double miss_ns = nsec_per_op (t0, (size_t)iterations * view.size ());
+
+  // evict the least recently used tile for each new one.  the new tiles
+  // are the rows below the grid, one row per iteration.
+  unsigned int next_row = grid;
+  t0 = clock::now ();
+  for (unsigned int n = 0; n < iterations; ++n, ++next_row)
+    for (unsigned int x = 0; x < grid; ++x)
+    {
+      tiles.evict ();
+      tiles.insert (key (0, x, next_row));
+    }
+  const double churn_ns = nsec_per_op (t0, (size_t)iterations * grid);
+
+  // an image update erases a region of 16 x 16 resident tiles, which are
+  // loaded again.  the number of tiles stays the same.
+  std::vector<uint64_t> region;
+  for (unsigned int y = next_row - 16; y < next_row; ++y)
+    for (unsigned int x = grid / 4; x < grid / 4 + 16; ++x)
+      region.push_back (key (0, x, y));
+
+  t0 = clock::now ();
+  for (unsigned int n = 0; n < iterations; ++n)
+  {
+    for (uint64_t k : region)
+      tiles.erase (k);
+    for (uint64_t k : region)
+      tiles.insert (k);
+  }
+  const double region_ns = nsec_per_op (t0, (size_t)iterations * region.size ());
+
+  std::cout << "  " << std::setw (8) << std::left << name << std::right
+	    << std::fixed << std::setprecision (1)
+	    << std::setw (8) << hit_ns << " ns/hit"
+	    << std::setw (8) << miss_ns << " ns/miss"
+	    << std::setw (8) << churn_ns << " ns/evict+insert"
+	    << std::setw (8) << region_ns << " ns/region tile"
+	    << (found == (size_t)iterations * view.size () ? "" : "  WRONG LOOKUPS")
+	    << std::endl;
+}
+
+static int bench_tile_map (int argc, const char* argv[])
+{
+  const unsigned int num_tiles = argc > 0 ? std::atoi (argv[0]) : 4096;
+  const unsigned int iterations = argc > 1 ? std::atoi (argv[1]) : 200;
+
+  const unsigned int grid = std::max (16u, (unsigned int)std::sqrt ((double)num_tiles));
+
+  std::cout << "tile_map " << grid * grid << " resident tiles"
+	    << ", " << iterations << " iterations" << std::endl;
+
+  bench_tile_map_run<bench_ordered_tiles> ("ordered", grid, iterations);
+  bench_tile_map_run<bench_hashed_tiles> ("hashed", grid, iterations);
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+// a texture trace: the tiles which are rendered in each frame.
+typedef std::vector<std::vector<uint64_t>> bench_texture_trace;
+
+// reads a trace written by tile_cache::set_trace.
+static bool read_texture_trace (const char* filename, bench_texture_trace& out)
+{
+  std::ifstream f (filename);
+  if (!f.is_open ())
+    return false;
+
+  out.clear ();
+  out.emplace_back ();
+
+  std::string line;
+  while (std::getline (f, line))
+  {
+    if (line.empty ())
+      continue;
+
+    if (line == "f")
+    {
+      if (!out.back ().empty ())
+	out.emplace_back ();
+      continue;
+    }
+
+    uint64_t key;
+    std::istringstream (line) >> std::hex >> key;
+    out.back ().push_back (key);
+  }
+
+  return true;
+}
+
+// a session on a 64 x 64 tiles image: looking at the whole image, zooming
+// into an area and panning around in it, and flying over the image at full
+// detail to another area.
+static bench_texture_trace make_texture_trace (unsigned int rounds)
+{
+  const unsigned int grid = 64;
+  const unsigned int view = 8;
+
+  bench_texture_trace trace;
+  std::mt19937 rnd (1234);
+
+  auto&& frame = [&] (unsigned int lvl, unsigned int x0, unsigned int y0)
+  {
+    trace.emplace_back ();
+    for (unsigned int y = y0; y < y0 + view; ++y)
+      for (unsigned int x = x0; x < x0 + view; ++x)
+	trace.back ().push_back (bench_texture_key (lvl, x, y));
+  };
+
+  // two areas which are visited again and again.
+  const vec2<unsigned int> areas[] = { { 8, 8 }, { 40, 44 } };
+
+  for (unsigned int r = 0; r < rounds; ++r)
+  {
+    // the whole image.
+    for (unsigned int i = 0; i < 10; ++i)
+      frame (3, 0, 0);
+
+    // zoomed in on one of the areas, panning a bit.
+    const vec2<unsigned int> a = areas[rnd () % 2];
+    for (unsigned int i = 0; i < 30; ++i)
+      frame (0, a.x + rnd () % 4, a.y + rnd () % 4);
+
+    // a fly-by over a random row at full detail.
+    const unsigned int y = rnd () % (grid - view);
+    for (unsigned int x = 0; x + view <= grid; ++x)
+      frame (0, x, y);
+  }
+
+  return trace;
+}
+
+// replays the trace like tile_cache does: a tile is used at most once per
+// frame and is reused only if it wasn't used in the previous frame, and a
+// missing tile is loaded and added, evicting another one if the cache is
+// full.  returns the hit rate.
+static double simulate_eviction (const bench_texture_trace& trace,
+				 eviction_policy::kind kind, size_t capacity)
+{
+  // like tiled_image: a lower detail tile covers more of the image and is
+  // needed more often.
+  auto policy = eviction_policy::create (kind, [] (uint64_t key)
+  {
+    return std::ldexp (1.0, (int)(key & 63));
+  });
+
+  tile_map<uint64_t> tiles;
+  size_t hits = 0;
+  size_t misses = 0;
+  uint64_t frame = 0;
+
+  for (auto&& f : trace)
+  {
+    frame += 1;
+
+    for (uint64_t key : f)
+    {
+      const auto h = tiles.find (key);
+      if (h != tiles.npos)
+      {
+	if (tiles[h] != frame)
+	{
+	  policy->touch (key, tiles[h] + 1 != frame);
+	  tiles[h] = frame;
+	}
+	hits += 1;
+	continue;
+      }
+
+      misses += 1;
+
+      if (tiles.size () >= capacity)
+      {
+	const uint64_t victim = policy->victim ();
+	tiles.erase (tiles.find (victim));
+	policy->erase (victim);
+      }
+
+      tiles.insert (key, frame);
+      policy->insert (key);
+    }
+  }
+
+  return hits + misses > 0 ? (double)hits / (hits + misses) : 0;
+}
+
+static int bench_evict_sim (int argc, const char* argv[])
+{
+  bench_texture_trace trace;
+
+  if (argc > 0 && std::strcmp (argv[0], "-") != 0)
+  {
+    if (!read_texture_trace (argv[0], trace))
+    {
+      std::cerr << "can't read texture trace " << argv[0] << std::endl;
+      return 1;
+    }
+  }
+  else
+    trace = make_texture_trace (40);
+
+  std::vector<size_t> capacities;
+  for (int i = 1; i < argc; ++i)
+    capacities.push_back (std::atoi (argv[i]));
+  if (capacities.empty ())
+    capacities = { 96, 128, 192, 256, 384 };
+
+  size_t num_uses = 0;
+  for (auto&& f : trace)
+    num_uses += f.size ();
+
+  std::cout << "evict_sim " << trace.size () << " frames, "
+	    << num_uses << " tile uses" << std::endl;
+
+  std::cout << "  " << std::setw (8) << std::left << "tiles" << std::right;
+  for (int k = 0; k < eviction_policy::num_kinds; ++k)
+    std::cout << std::setw (8) << eviction_policy::name ((eviction_policy::kind)k);
+  std::cout << std::endl;
+
+  for (size_t c : capacities)
+  {
+    if (c == 0)
+      continue;
+
+    std::cout << "  " << std::setw (8) << std::left << c << std::right
+	      << std::fixed << std::setprecision (1);
+
+    for (int k = 0; k < eviction_policy::num_kinds; ++k)
+      std::cout << std::setw (7)
+		<< simulate_eviction (trace, (eviction_policy::kind)k, c) * 100 << "%";
+
+    std::cout << std::endl;
+  }
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+int main (int argc, const char* argv[])
+{
+  struct bench_entry
+  {
+    const char* name;
+    const char* args;
+    int (*func) (int argc, const char* argv[]);
+  };
+
+  const bench_entry benches[] =
+  {
+    { "pyr_down", "[width height iterations]", bench_pyr_down },
+    { "tile_extract", "[width height iterations]", bench_tile_extract },
+    { "tile_codec", "[iterations]", bench_tile_codec },
+    { "bc1", "[iterations]", bench_bc1 },
+    { "tile_map", "[tiles iterations]", bench_tile_map },
+    { "evict_sim", "[trace|- tiles...]", bench_evict_sim },
+  };
+
+  if (argc < 2)
+  {
+    std::cout << "usage: <executable> <benchmark> [args]\n";
+    for (const auto& b : benches)
+      std::cout << "  " << b.name << " " << b.args << "\n";
+    std::cout << std::flush;
+    return 0;
+  }
+
+  for (const auto& b : benches)
+    if (std::strcmp (argv[1], b.name) == 0)
+      return b.func (argc - 2, argv + 2);
+
+  std::cerr << "unknown benchmark " << argv[1] << std::endl;
+  return 1;
+}
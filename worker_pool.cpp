@@ -0,0 +1,55 @@
+
+#include "worker_pool.hpp"
+
+worker_pool::worker_pool (unsigned int num_threads)
+{
+  m_threads.reserve (num_threads);
+
+  for (unsigned int i = 0; i < num_threads; ++i)
+    m_threads.emplace_back ([this] (void) { thread_func (); });
+}
+
+worker_pool::~worker_pool (void)
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_quit = true;
+    m_jobs.clear ();
+  }
+
+  m_cond.notify_all ();
+
+  for (auto&& t : m_threads)
+    t.join ();
+}
+
+void worker_pool::post (job j)
+{
+  {
+    std::lock_guard<std::mutex> lock (m_mutex);
+    m_jobs.push_back (std::move (j));
+  }
+
+  m_cond.notify_one ();
+}
+
+void worker_pool::thread_func (void)
+{
+  while (true)
+  {
+    job j;
+
+    {
+      std::unique_lock<std::mutex> lock (m_mutex);
+      m_cond.wait (lock, [this] (void) { return m_quit || !m_jobs.empty (); });
+
+      if (m_quit)
+	return;
+
+      j = std::move (m_jobs.front ());
+      m_jobs.pop_front ();
+    }
+
+    j ();
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef includeguard_worker_pool_hpp_includeguard
+#define includeguard_worker_pool_hpp_includeguard
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// a fixed number of threads which run jobs in the order they are posted.
+// the destructor finishes the jobs which are already running and drops
+// the others.
+
+class worker_pool
+{
+public:
+  typedef std::function<void (void)> job;
+
+  explicit worker_pool (unsigned int num_threads);
+  ~worker_pool (void);
+
+  worker_pool (const worker_pool&) = delete;
+  worker_pool& operator = (const worker_pool&) = delete;
+
+  unsigned int num_threads (void) const { return (unsigned int)m_threads.size (); }
+
+  void post (job j);
+
+private:
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  std::deque<job> m_jobs;
+  bool m_quit = false;
+
+  std::vector<std::thread> m_threads;
+
+  void thread_func (void);
+};
+
+#endif // includeguard_worker_pool_hpp_includeguard